@@ -49,7 +49,7 @@
 #define HDR_MAX 36
 #define POS_MAX 16
 #define EXT_MAX 128
-#define SCORE_MAX 12
+#define SCORE_MAX 32
 
 typedef struct _options_t {
   char *scFile;
@@ -58,6 +58,7 @@ typedef struct _options_t {
   int score;
   int norm;
   int mism;
+  int canonical;
   int db;
   int debug;
   int help;
@@ -286,6 +287,56 @@ process_ac()
   return 0;
 }
 
+void
+print_bed(char *nb, int pos, int end, char *tag, char *sc, char strand)
+{
+  /* Convert to BED format */
+  if (options.mism) {
+    int s = 0;
+    s = misMatch;
+    printf("chr%s\t%d\t%d\t%s\t%d\t%c\n", nb, pos, end, tag, s, strand);
+  } else {
+    if (options.norm) {
+      int score = atoi(sc)/options.norm;
+      printf("chr%s\t%d\t%d\t%s\t%d\t%c\n", nb, pos, end, tag, score, strand);
+    } else {
+      //printf("%s\t%d\t%s\t%s\t%s\t%c\n", ac, pos, end, tag, sc, strand);
+      printf("chr%s\t%d\t%d\t%s\t%s\t%c\n", nb, pos, end, tag, sc, strand);
+    }
+  }
+}
+
+void
+print_canonical(char *nb, int pos, int end, char *tag, char *sc, char strand)
+{
+  /* Strand-canonical tag (mba -C), named SCORE:RSCORE:STRANDS, where
+     STRANDS are the orientations of the tag (+) and of its reverse
+     complement (-) that pass the cut-off.
+     The aligned word (tag) is the tag itself on the '+' strand hits and
+     its reverse complement on the '-' strand hits: report the PWM
+     matches of the aligned word on both strands.
+  */
+  char rtag[TAG_MAX];
+  char *rsc, *str;
+
+  if ((rsc = strchr(sc, ':')) == NULL || (str = strchr(rsc + 1, ':')) == NULL) {
+    fprintf(stderr, "Invalid canonical tag name \"%s\" (expected SCORE:RSCORE:STRANDS)\n", sc);
+    exit(1);
+  }
+  *rsc++ = 0;
+  *str++ = 0;
+  strcpy(rtag, tag);
+  reverse(rtag);
+  complement(rtag);
+  /* Palindromic tags are aligned on both strands at the same position */
+  if (strand == '-' && strcmp(tag, rtag) == 0)
+    return;
+  if (strchr(str, (strand == '+') ? '+' : '-') != NULL)
+    print_bed(nb, pos, end, tag, (strand == '+') ? sc : rsc, '+');
+  if (strchr(str, (strand == '+') ? '-' : '+') != NULL)
+    print_bed(nb, pos, end, rtag, (strand == '+') ? rsc : sc, '-');
+}
+
 int
 process_bowtie(FILE *input, char *iFile)
 {
@@ -392,6 +443,12 @@ process_bowtie(FILE *input, char *iFile)
 #ifdef DEBUG
     printf("%s\t%c\t%s\t%s\t%s\n", sc, strand, ac, start, tag );
 #endif
+    if (options.canonical) {
+      int pos = atoi(start);
+      char *nb = hash_table_lookup(ac_table, ac, strlen(ac) + 1);
+      print_canonical(nb, pos, pos + tagLen, tag, sc, strand);
+      continue;
+    }
     if (strand == '-') {
       reverse(tag);
       complement(tag);
@@ -401,20 +458,7 @@ process_bowtie(FILE *input, char *iFile)
     int end = pos + tagLen;
     char *nb = hash_table_lookup(ac_table, ac, hdr_len);
     //fprintf (stderr, "Hash table value for %s is chr%s\n", ac, nb);
-    /* Convert to BED format */
-    if (options.mism) {
-      int s = 0;
-      s = misMatch;
-      printf("chr%s\t%d\t%d\t%s\t%d\t%c\n", nb, pos, end, tag, s, strand);
-    } else {
-      if (options.norm) {
-        int score = atoi(sc)/options.norm;
-        printf("chr%s\t%d\t%d\t%s\t%d\t%c\n", nb, pos, end, tag, score, strand);
-      } else {
-        //printf("%s\t%d\t%s\t%s\t%s\t%c\n", ac, pos, end, tag, sc, strand);
-        printf("chr%s\t%d\t%d\t%s\t%s\t%c\n", nb, pos, end, tag, sc, strand);
-      }
-    }
+    print_bed(nb, pos, end, tag, sc, strand);
   }
   if (options.debug) {
     fprintf (stderr, "Done!\n");
@@ -433,10 +477,13 @@ int main(int argc, char *argv[])
   options.colSep = "\t";
 
   while (1) {
-    int c = getopt(argc, argv, "s:i:l:t:n:m:dh");
+    int c = getopt(argc, argv, "s:i:l:t:n:m:cdh");
     if (c == -1)
       break;
     switch (c) {
+    case 'c':
+      options.canonical = 1;
+      break;
     case 'd':
       options.debug = 1;
       break;
@@ -472,6 +519,7 @@ int main(int argc, char *argv[])
              "  \t\t -h             Show this help text\n"
              "  \t\t -m <mismatch>  Tag mismatch\n"
              "  \t\t -n             Scaling correction factor for score values\n"
+             "  \t\t -c             Tags are strand-canonical (mba -C), named SCORE:RSCORE:STRANDS\n"
              "  \t\t -i <path>      Use <path> to locate the chr_hdr file (default is /home/local/db/genome)\n"
              "\n\tConvert output of bowtie into BED format.\n"
              "\n\tThe score value is reported in the first field of the Bowtie output file.\n"
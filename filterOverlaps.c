@@ -8,6 +8,9 @@
   # Arguments:
   # BED region length (rLen)
 
+  With the -B option, the input and output are binary match records
+  (matrix_scan -B output, see hitrec.h) instead of BED lines.
+
   Giovanna Ambrosini, EPFL/ISREC, Giovanna.Ambrosini@epfl.ch
 
   Copyright (c) 2014 EPFL and Swiss Institute of Bioinformatics.
@@ -37,6 +40,7 @@
 #include <unistd.h>
 #include <ctype.h>
 #include <sys/stat.h>
+#include "hitrec.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -52,6 +56,7 @@
 typedef struct _options_t {
   int help;
   int debug;
+  int binary;
 } options_t;
 
 static options_t options;
@@ -63,6 +68,7 @@ typedef struct _bedline_t {
   char **tag;
   int *score;
   char *strand;
+  char **rest;     /* Extra columns after strand (e.g. name, p-value) */
   int *pflag;
 } bedline_t, *bedline_p_t;
 
@@ -103,11 +109,162 @@ filter_regions(int len)
     fprintf(stderr,"dbg: %s\t%lu\t%lu\t%s\t%d\t%c\n", bed_reg.seq_id, bed_reg.start[i], bed_reg.end[i], bed_reg.tag[i], bed_reg.score[i], bed_reg.strand[i]);
 #endif
     if (bed_reg.pflag[i]) {
-      printf("%s\t%lu\t%lu\t%s\t%d\t%c\n", bed_reg.seq_id, bed_reg.start[i], bed_reg.end[i], bed_reg.tag[i], bed_reg.score[i], bed_reg.strand[i]);
+      printf("%s\t%lu\t%lu\t%s\t%d\t%c", bed_reg.seq_id, bed_reg.start[i], bed_reg.end[i], bed_reg.tag[i], bed_reg.score[i], bed_reg.strand[i]);
+      if (bed_reg.rest[i][0])
+        printf("\t%s", bed_reg.rest[i]);
+      putchar('\n');
+    }
+    free(bed_reg.tag[i]);
+    free(bed_reg.rest[i]);
+  }
+}
+
+void
+filter_hits(hit_t *hits, hit_pwm_t *pwms, int *pflag, int *idx, int len)
+{
+  /* Same as filter_regions, for the binary match records idx[0..len-1] */
+  /* of one PWM                                                         */
+  int max_score = 0;
+  int win = 0;
+  int i, k;
+
+  for (i = 0; i < len; i++) {
+    max_score = hits[idx[i]].score;
+    if (rLen == 0) {
+      win = (int)pwms[hits[idx[i]].pwm].len;
+    } else {
+      win = rLen;
+    }
+    for (k = i + 1; k < len && hits[idx[k]].start <= hits[idx[i]].start + (unsigned int)win; k++) {
+      if (hits[idx[k]].score > max_score) {
+        pflag[idx[i]] = 0;
+        max_score = hits[idx[k]].score;
+        i = k;
+      } else {
+        pflag[idx[k]] = 0;
+      }
     }
+    i = k - 1;
+  }
+}
+
+void
+filter_seq_hits(hit_t *hits, hit_pwm_t *pwms, int *pflag, int *idx, int *first, uint32_t nb_pwms, int len)
+{
+  /* Filter the matches of one sequence PWM by PWM (the PWMs of a     */
+  /* library stream are interleaved), and write out non-overlapping    */
+  /* matches (pflag = 1) in input order                                */
+  int i;
+  uint32_t p;
+
+  memset(first, 0, ((size_t)nb_pwms + 1) * sizeof(int));
+  for (i = 0; i < len; i++) {
+    pflag[i] = 1;
+    first[hits[i].pwm + 1]++;
+  }
+  for (p = 0; p < nb_pwms; p++)
+    first[p + 1] += first[p];
+  for (i = 0; i < len; i++)
+    idx[first[hits[i].pwm]++] = i;
+  /* first[p] now points to the end of the matches of PWM p */
+  for (p = 0, i = 0; p < nb_pwms; p++) {
+    filter_hits(hits, pwms, pflag, idx + i, first[p] - i);
+    i = first[p];
+  }
+  for (i = 0; i < len; i++) {
+    if (pflag[i])
+      fwrite(&hits[i], sizeof(hit_t), 1, stdout);
   }
 }
 
+int
+process_hits(FILE *input)
+{
+  hit_hdr_t h;
+  hit_pwm_t *pwms;
+  hit_t *hits;
+  int *pflag;
+  int *idx;
+  int *first;
+  uint32_t *last;  /* Start of the last match of each PWM in the sequence */
+  size_t mLen = BUF_SIZE;
+  size_t k = 0;
+  hit_t hit;
+
+  if (hit_read_header(input, &h, &pwms) != 0)
+    return 1;
+  if (hit_write_header(stdout, &h, pwms) != 0) {
+    perror("process_hits: fwrite");
+    return 1;
+  }
+  if ((hits = (hit_t *)malloc(mLen * sizeof(hit_t))) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  if ((pflag = (int *)malloc(mLen * sizeof(int))) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  if ((idx = (int *)malloc(mLen * sizeof(int))) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  if ((first = (int *)malloc(((size_t)h.nb_pwms + 1) * sizeof(int))) == NULL
+      || (last = (uint32_t *)calloc((size_t)h.nb_pwms + 1, sizeof(uint32_t))) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  while (fread(&hit, sizeof(hit_t), 1, input) == 1) {
+    if (hit.pwm >= h.nb_pwms) {
+      fprintf(stderr, "Invalid match record\n");
+      return 1;
+    }
+    /* Matches must be sorted by sequence, and by position for each PWM */
+    if ((k > 0 && hit.chrom < hits[0].chrom)
+        || (k > 0 && hit.chrom == hits[0].chrom && hit.start < last[hit.pwm])) {
+      fprintf(stderr, "Match records are not sorted by sequence and position "
+              "(sequence %u, position %u, matrix %s)\n", hit.chrom, hit.start,
+              pwms[hit.pwm].name);
+      return 1;
+    }
+    /* Check Sequence BEGINNING, process previous sequence matches */
+    if (k > 0 && hit.chrom != hits[0].chrom) {
+      filter_seq_hits(hits, pwms, pflag, idx, first, h.nb_pwms, (int)k);
+      memset(last, 0, (size_t)h.nb_pwms * sizeof(uint32_t));
+      k = 0;
+    }
+    if (k == mLen) {
+      mLen *= 2;
+      if ((hits = (hit_t *)realloc(hits, mLen * sizeof(hit_t))) == NULL) {
+        perror("process_hits: realloc");
+        exit(1);
+      }
+      if ((pflag = (int *)realloc(pflag, mLen * sizeof(int))) == NULL) {
+        perror("process_hits: realloc");
+        exit(1);
+      }
+      if ((idx = (int *)realloc(idx, mLen * sizeof(int))) == NULL) {
+        perror("process_hits: realloc");
+        exit(1);
+      }
+    }
+    last[hit.pwm] = hit.start;
+    hits[k++] = hit;
+  }
+  /* Filter overlapping matches for last sequence */
+  filter_seq_hits(hits, pwms, pflag, idx, first, h.nb_pwms, (int)k);
+  free(hits);
+  free(pflag);
+  free(idx);
+  free(first);
+  free(last);
+  free(pwms);
+  if (input != stdin) {
+    fclose(input);
+  }
+  return 0;
+}
+
 int
 process_bed(FILE *input, char *iFile)
 {
@@ -172,6 +329,10 @@ process_bed(FILE *input, char *iFile)
     perror("process_bed: malloc");
     exit(1);
   }
+  if (( bed_reg.rest = (char**)calloc(mLen, sizeof(*(bed_reg.rest)))) == NULL) {
+    perror("process_bed: malloc");
+    exit(1);
+  }
   if ((s = malloc(bLen * sizeof(char))) == NULL) {
     perror("process_bed: malloc");
     exit(1);
@@ -302,6 +463,10 @@ process_bed(FILE *input, char *iFile)
         perror("process_bed: realloc");
         exit(1);
       }
+      if ((bed_reg.rest = (char**)realloc(bed_reg.rest, mLen * sizeof(*(bed_reg.rest)))) == NULL) {
+        perror("process_bed: realloc");
+        exit(1);
+      }
     }
     /* Check Chromosome/Sequence BEGINNING, process previous chromosomal region and printout results*/
     if (strcmp(seq_id, seq_id_prev) != 0) {
@@ -312,6 +477,8 @@ process_bed(FILE *input, char *iFile)
     strcpy(bed_reg.seq_id, seq_id);
     bed_reg.tag[k] = malloc(strlen(tag) + 1);
     strcpy(bed_reg.tag[k], tag);
+    /* Extra columns are passed through unchanged */
+    bed_reg.rest[k] = strdup(buf);
     bed_reg.start[k] = start;
     bed_reg.end[k] = end;
     bed_reg.score[k] = score;
@@ -337,7 +504,7 @@ main(int argc, char *argv[])
   FILE *input;
 
   while (1) {
-    int c = getopt(argc, argv, "dhl:v:");
+    int c = getopt(argc, argv, "dhBl:v:");
     if (c == -1)
       break;
     switch (c) {
@@ -350,6 +517,9 @@ main(int argc, char *argv[])
       case 'l':
         rLen = atoi(optarg);
         break;
+      case 'B':
+        options.binary = 1;
+        break;
       default:
         printf ("?? getopt returned character code 0%o ??\n", c);
     }
@@ -360,6 +530,9 @@ main(int argc, char *argv[])
              "  \t\t -d     Produce debug information and check BED file\n"
              "  \t\t -h     Show this help text\n"
              "  \t\t -l     BED Region length (default is %d)\n"
+             "  \t\t -B     Binary match records (matrix_scan -B output) as input and output\n"
+             "  \t\t        (matches sorted by sequence, and by position for each PWM; PWMs are\n"
+             "  \t\t        filtered separately, default length is the PWM length)\n"
              "\n\tFilters out overlapping matches or regions represented in BED or BED-like format.\n"
              "\n\tIf regions are of fixed size, their length must be set via the -l <len> option.\n"
              "\tThe BED input file MUST BE sorted by sequence name (or chromosome id), position, and strand.\n"
@@ -394,7 +567,10 @@ main(int argc, char *argv[])
       fprintf(stderr, " Warning: regions don't have a fixed length (Len = %d)\n\n", rLen);
     }
   }
-  if (process_bed(input, argv[optind++]) != 0) {
+  if (options.binary) {
+    if (process_hits(input) != 0)
+      return 1;
+  } else if (process_bed(input, argv[optind++]) != 0) {
     return 1;
   }
   return 0;
@@ -0,0 +1,490 @@
+/*
+  genome_pack.c
+
+  Convert the FASTA chromosome files of a genome assembly into a binary
+  genome pack file, which can be memory-mapped by matrix_scan and
+  seq_extract_bcomp (-g option).
+
+  # Arguments:
+  # species assembly (e.g. hg19)
+  # output genome pack file
+  # assembly directory (chrom*.seq files) or list of FASTA files
+
+  FASTA files may be gzip or BGZF compressed (see zfile.h).
+
+  The genome pack file holds the sequences as 2-bit packed bases, the
+  intervals of N's, the FASTA identifiers and accessions, the chromosome
+  names (taken from the chr_hdr/chr_NC_gi tables of the assembly) and a
+  per-sequence offset index (see seqpack.h).
+
+  Copyright (c) 2015
+  School of Life Sciences
+  Ecole Polytechnique Federale de Lausanne
+  and Swiss Institute of Bioinformatics
+  EPFL SV ISREC UPNAE
+  Station 15
+  CH-1015 Lausanne, Switzerland.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <ctype.h>
+#include <glob.h>
+#include <sys/stat.h>
+#include "hashtable.h"
+#include "seqpack.h"
+#include "zfile.h"
+#ifdef DEBUG
+#include <mcheck.h>
+#endif
+
+#define BUF_SIZE 4194304 /* 4MB */
+#define THIRTY_TWO_MEG 0x2000000ULL
+#define LINE_SIZE 1024
+#define RUNS_MAX 1024
+#define INDEX_MAX 64
+
+typedef struct _options_t {
+  int help;
+  int debug;
+  int db;
+  char *dbPath;
+  int acPipe;
+  int softmask;
+} options_t;
+
+static options_t options;
+
+char *Species = NULL;
+char *packFile = NULL;
+
+static hash_table_t *hdr_table = NULL;
+static hash_table_t *ac_table = NULL;
+
+FILE *pack_out;
+pack_hdr_t Header;
+pack_chrom_t *Index;
+int maxIndex = 0;
+
+/* Sequence buffers (reused for each sequence) */
+unsigned char *Seq;
+unsigned long mLen = 0;
+nrun_t *Nrun;
+unsigned long mRuns = 0;
+
+static hash_table_t *
+load_table(const char *table)
+{
+  /* Load a two-column table (chr_hdr or chr_NC_gi): the second column */
+  /* (FASTA header or NCBI accession) is mapped to the chromosome name */
+  FILE *input;
+  char buf[LINE_SIZE];
+  char *chrFile;
+  size_t cLen;
+  hash_table_t *ht;
+
+  if (options.db) {
+    cLen = strlen(options.dbPath) + strlen(Species) + strlen(table) + 3;
+    if ((chrFile = malloc(cLen * sizeof(char))) == NULL) {
+      perror("load_table: malloc");
+      exit(1);
+    }
+    strcpy(chrFile, options.dbPath);
+  } else {
+    cLen = 21 + strlen(Species) + strlen(table) + 3;
+    if ((chrFile = malloc(cLen * sizeof(char))) == NULL) {
+      perror("load_table: malloc");
+      exit(1);
+    }
+    strcpy(chrFile, "/home/local/db/genome");
+  }
+  strcat(chrFile, "/");
+  strcat(chrFile, Species);
+  strcat(chrFile, "/");
+  strcat(chrFile, table);
+
+  input = fopen(chrFile, "r");
+  if (input == NULL) {
+    if (options.debug)
+      fprintf(stderr, "Could not open file %s: %s(%d)\n",
+              chrFile, strerror(errno), errno);
+    free(chrFile);
+    return NULL;
+  }
+  if (options.debug)
+    fprintf(stderr, "Loading table %s\n", chrFile);
+  ht = hash_table_new(MODE_COPY);
+  while (fgets(buf, LINE_SIZE, input) != NULL) {
+    char *s = buf;
+    char chr_nb[PACK_NAME_MAX] = "";
+    char key[PACK_ID_MAX] = "";
+    int i = 0;
+    /* Get first character: if # skip line */
+    if (*s == '#')
+      continue;
+    /* Chrom NB */
+    while (*s != 0 && !isspace(*s)) {
+      if (i >= PACK_NAME_MAX - 1) {
+        fprintf(stderr, "Chr NB too long in %s\n", buf);
+        fclose(input);
+        exit(1);
+      }
+      chr_nb[i++] = *s++;
+    }
+    chr_nb[i] = 0;
+    while (isspace(*s))
+      s++;
+    /* FASTA header or NCBI AC */
+    i = 0;
+    while (*s != 0 && !isspace(*s)) {
+      if (i >= PACK_ID_MAX - 1) {
+        fprintf(stderr, "Key too long in %s\n", buf);
+        fclose(input);
+        exit(1);
+      }
+      key[i++] = *s++;
+    }
+    key[i] = 0;
+    if (i == 0)
+      continue;
+    hash_table_add(ht, key, strlen(key) + 1, chr_nb, strlen(chr_nb) + 1);
+    if (options.debug)
+      fprintf(stderr, " %s Hash table: %s -> %s\n", table, key, chr_nb);
+  }
+  fclose(input);
+  free(chrFile);
+  return ht;
+}
+
+static void
+write_seq(pack_chrom_t *c, unsigned long len, unsigned long nbRuns)
+{
+  /* Append the packed bases and N-runs of the current sequence */
+  static const unsigned char pad[8] = {0};
+  size_t sLen = len / 4 + 1;
+  off_t off = ftello(pack_out);
+
+  c->len = (uint32_t)len;
+  c->nb_runs = (uint32_t)nbRuns;
+  c->seq_off = (uint64_t)off;
+  c->run_off = (uint64_t)off + ((sLen + 7) & ~(size_t)7);
+  if (fwrite(Seq, 1, sLen, pack_out) != sLen
+      || fwrite(pad, 1, ((sLen + 7) & ~(size_t)7) - sLen, pack_out) != ((sLen + 7) & ~(size_t)7) - sLen
+      || fwrite(Nrun, sizeof(nrun_t), nbRuns, pack_out) != nbRuns) {
+    fprintf(stderr, "Could not write file %s: %s(%d)\n",
+            packFile, strerror(errno), errno);
+    exit(1);
+  }
+}
+
+static void
+set_names(pack_chrom_t *c, const char *hdr)
+{
+  /* Set FASTA identifier, accession and chromosome name of sequence */
+  const char *s = hdr;
+  char *chr_nb = NULL;
+  size_t i;
+
+  memcpy(c->id, hdr, strlen(hdr) + 1); /* length checked by caller */
+  /* Get AC (after acPipe pipes, up to the next pipe) */
+  for (int p = 0; p < options.acPipe && s != NULL; p++) {
+    s = strchr(s, '|');
+    if (s != NULL)
+      s++;
+  }
+  if (s == NULL)
+    s = hdr;
+  for (i = 0; i < PACK_NAME_MAX - 1 && s[i] && s[i] != '|' && s[i] != ';'; i++)
+    c->ac[i] = s[i];
+  c->ac[i] = 0;
+  /* Map sequence to chromosome name */
+  if (hdr_table != NULL)
+    chr_nb = hash_table_lookup(hdr_table, c->id, strlen(c->id) + 1);
+  if (chr_nb == NULL && ac_table != NULL)
+    chr_nb = hash_table_lookup(ac_table, c->ac, strlen(c->ac) + 1);
+  if (chr_nb != NULL)
+    strncpy(c->chr, chr_nb, PACK_NAME_MAX - 1);
+  else if (Species != NULL)
+    fprintf(stderr, "Warning: sequence %s not found in chr_hdr/chr_NC_gi tables\n", c->id);
+}
+
+static int
+process_fasta(const char *iFile)
+{
+  char buf[BUF_SIZE], *res;
+  zfile_t *input;
+  unsigned long len = 0;
+  unsigned long nbRuns = 0;
+  pack_chrom_t *c = NULL;
+
+  if ((input = zfile_open(iFile, 0)) == NULL)
+    return -1;
+  if (options.debug)
+    fprintf(stderr, "Processing file %s\n", iFile);
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL) {
+    if (buf[0] == '>') {
+      /* Get the header */
+      char *s = buf + 1;
+      size_t i = 0;
+      if (c != NULL)
+        write_seq(c, len, nbRuns);
+      if (Header.nb_chroms == (uint32_t)maxIndex) {
+        maxIndex *= 2;
+        if ((Index = realloc(Index, (size_t)maxIndex * sizeof(pack_chrom_t))) == NULL) {
+          perror("process_fasta: realloc");
+          exit(1);
+        }
+      }
+      c = &Index[Header.nb_chroms++];
+      memset(c, 0, sizeof(pack_chrom_t));
+      while (s[i] && !isspace(s[i]))
+        i++;
+      if (i >= PACK_ID_MAX) {
+        fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", buf, iFile);
+        exit(1);
+      }
+      s[i] = 0;
+      set_names(c, s);
+      len = 0;
+      nbRuns = 0;
+      Seq[0] = 0;
+      if (options.debug)
+        fprintf(stderr, "Sequence ID: %s (AC: %s, chromosome: %s)\n", c->id, c->ac, c->chr);
+      continue;
+    }
+    if (c == NULL)
+      continue;
+    /* Gobble sequence  */
+    char ch;
+    char *s = buf;
+    while ((ch = *s++) != 0) {
+      unsigned char n;
+      if (!isalpha(ch))
+        continue;
+      /* Soft-masked bases (-m) are recorded in the N-runs */
+      if (options.softmask && islower(ch))
+        ch = 'N';
+      switch (toupper(ch)) {
+        case 'A':
+          n = 0;
+          break;
+        case 'C':
+          n = 1;
+          break;
+        case 'G':
+          n = 2;
+          break;
+        case 'T':
+          n = 3;
+          break;
+        default: /* N or any other letter */
+          n = 4;
+      }
+      len++;
+      if (len >= 0xffffffffUL) {
+        fprintf(stderr, "Sequence %s is too long\n", c->id);
+        exit(1);
+      }
+      if (len >= mLen) {
+        mLen *= 2;
+        if ((Seq = realloc(Seq, mLen / 4 * sizeof(unsigned char))) == NULL) {
+          perror("process_fasta: realloc");
+          exit(1);
+        }
+      }
+      /* Clear each byte before storing its first base */
+      if ((len & 3) == 0)
+        Seq[len >> 2] = 0;
+      if (n == 4) {
+        /* Extend the last N-run or start a new one */
+        if (nbRuns && Nrun[nbRuns-1].end == len - 1) {
+          Nrun[nbRuns-1].end = (uint32_t)len;
+        } else {
+          if (nbRuns == mRuns) {
+            mRuns *= 2;
+            if ((Nrun = realloc(Nrun, mRuns * sizeof(nrun_t))) == NULL) {
+              perror("process_fasta: realloc");
+              exit(1);
+            }
+          }
+          Nrun[nbRuns].beg = (uint32_t)len;
+          Nrun[nbRuns].end = (uint32_t)len;
+          nbRuns++;
+        }
+      } else {
+        Seq[len >> 2] |= (unsigned char)(n << ((len & 3) << 1));
+      }
+    }
+  }
+  if (c != NULL)
+    write_seq(c, len, nbRuns);
+  zfile_close(input);
+  return 0;
+}
+
+static int
+process_arg(const char *arg)
+{
+  /* Process a FASTA file or all chrom*.seq[.gz] files of a directory */
+  struct stat st;
+
+  if (strcmp(arg, "-") && stat(arg, &st) == 0 && S_ISDIR(st.st_mode)) {
+    glob_t gl;
+    char *pattern = malloc(strlen(arg) + 17);
+    if (pattern == NULL) {
+      perror("process_arg: malloc");
+      exit(1);
+    }
+    strcpy(pattern, arg);
+    strcat(pattern, "/chrom*.seq{,.gz}");
+    if (glob(pattern, GLOB_BRACE, NULL, &gl) != 0) {
+      fprintf(stderr, "No chrom*.seq[.gz] files found in directory %s\n", arg);
+      free(pattern);
+      return -1;
+    }
+    for (size_t k = 0; k < gl.gl_pathc; k++) {
+      if (process_fasta(gl.gl_pathv[k]) != 0) {
+        globfree(&gl);
+        free(pattern);
+        return -1;
+      }
+    }
+    globfree(&gl);
+    free(pattern);
+    return 0;
+  }
+  return process_fasta(arg);
+}
+
+int
+main(int argc, char *argv[])
+{
+#ifdef DEBUG
+  mcheck(NULL);
+  mtrace();
+#endif
+  options.acPipe = 2;
+
+  while (1) {
+    int c = getopt(argc, argv, "dhmi:n:o:s:");
+    if (c == -1)
+      break;
+    switch (c) {
+      case 'd':
+        options.debug = 1;
+        break;
+      case 'h':
+        options.help = 1;
+        break;
+      case 'm':
+        options.softmask = 1;
+        break;
+      case 'i':
+        options.dbPath = optarg;
+        options.db = 1;
+        break;
+      case 'n':
+        options.acPipe = atoi(optarg);
+        break;
+      case 'o':
+        packFile = optarg;
+        break;
+      case 's':
+        Species = optarg;
+        break;
+      case '?':
+        break;
+      default:
+        printf ("?? getopt returned character code 0%o ??\n", c);
+    }
+  }
+  if (optind >= argc || options.help == 1 || packFile == NULL) {
+    fprintf(stderr, "Usage: %s [options] [-s <assembly (e.g. hg19)>] -o <pack_file> <assembly_dir|fasta_file ...>\n"
+             "      where options are:\n"
+             "  \t\t -h         Show this help text\n"
+             "  \t\t -d         Produce debug information\n"
+             "  \t\t -i <path>  Use <path> to locate the chr_hdr/chr_NC_gi files (default is /home/local/db/genome)\n"
+             "  \t\t -n <int>   AC index (after how many pipes |) for FASTA header [%d]\n"
+             "  \t\t -m         Store soft-masked (lowercase) bases as N's, so that they are not scanned\n"
+             "\n\tConvert FASTA sequence files into a binary genome pack file (2-bit packed bases,\n"
+             "\tN-runs and sequence index), to be used with the -g option of matrix_scan and\n"
+             "\tseq_extract_bcomp. If a directory is given, all its chrom*.seq[.gz] files are packed.\n"
+             "\tIf the assembly is given, chromosome names are taken from its chr_hdr/chr_NC_gi tables.\n\n",
+             argv[0], options.acPipe);
+      return 1;
+  }
+  if (Species != NULL) {
+    hdr_table = load_table("chr_hdr");
+    ac_table = load_table("chr_NC_gi");
+    if (hdr_table == NULL && ac_table == NULL) {
+      fprintf(stderr, "Could not find the chr_hdr/chr_NC_gi tables for assembly %s\n", Species);
+      return 1;
+    }
+  }
+  if ((pack_out = fopen(packFile, "w")) == NULL) {
+    fprintf(stderr, "Could not open file %s: %s(%d)\n",
+            packFile, strerror(errno), errno);
+    return 1;
+  }
+  /* Allocate sequence buffers and sequence index */
+  mLen = THIRTY_TWO_MEG;
+  mRuns = RUNS_MAX;
+  maxIndex = INDEX_MAX;
+  Seq = malloc(mLen / 4 * sizeof(unsigned char));
+  Nrun = malloc(mRuns * sizeof(nrun_t));
+  Index = malloc((size_t)maxIndex * sizeof(pack_chrom_t));
+  if (Seq == NULL || Nrun == NULL || Index == NULL) {
+    perror("genome_pack: malloc");
+    return 1;
+  }
+  /* Header is rewritten once the index offset is known */
+  memcpy(Header.magic, PACK_MAGIC, sizeof(Header.magic));
+  Header.version = PACK_VERSION;
+  if (Species != NULL)
+    strncpy(Header.assembly, Species, PACK_NAME_MAX - 1);
+  if (fwrite(&Header, sizeof(pack_hdr_t), 1, pack_out) != 1) {
+    fprintf(stderr, "Could not write file %s: %s(%d)\n",
+            packFile, strerror(errno), errno);
+    return 1;
+  }
+  while (optind < argc) {
+    if (process_arg(argv[optind++]) != 0)
+      return 1;
+  }
+  Header.index_off = (uint64_t)ftello(pack_out);
+  if (fwrite(Index, sizeof(pack_chrom_t), Header.nb_chroms, pack_out) != Header.nb_chroms
+      || fseeko(pack_out, 0, SEEK_SET) != 0
+      || fwrite(&Header, sizeof(pack_hdr_t), 1, pack_out) != 1
+      || fclose(pack_out) != 0) {
+    fprintf(stderr, "Could not write file %s: %s(%d)\n",
+            packFile, strerror(errno), errno);
+    return 1;
+  }
+  if (options.debug) {
+    for (uint32_t k = 0; k < Header.nb_chroms; k++)
+      fprintf(stderr, "%s\t%s\tchr%s\t%u bp\t%u N-runs\n", Index[k].id, Index[k].ac,
+              Index[k].chr, Index[k].len, Index[k].nb_runs);
+  }
+  fprintf(stderr, "Packed %u sequences into %s\n", Header.nb_chroms, packFile);
+  free(Seq);
+  free(Nrun);
+  free(Index);
+  return 0;
+}
@@ -0,0 +1,139 @@
+/**
+ * License GPLv3+
+ * @file hitrec.c
+ * @brief binary match records (matrix_scan -B output)
+ */
+#include "hitrec.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Function to read the header and matrix table of a binary match stream
+ * @param in input stream
+ * @param h header to be filled in
+ * @param pwms allocated matrix table (to be freed by the caller)
+ * @returns 0 on success
+ * @returns -1 on error (a message is printed on stderr)
+ */
+int hit_read_header(FILE *in, hit_hdr_t *h, hit_pwm_t **pwms)
+{
+  if (fread(h, sizeof(hit_hdr_t), 1, in) != 1
+      || memcmp(h->magic, HIT_MAGIC, sizeof(h->magic)) != 0) {
+    fprintf(stderr, "Input is not a binary match stream (matrix_scan -B)\n");
+    return -1;
+  }
+  if (h->version != HIT_VERSION) {
+    fprintf(stderr, "Binary match stream has version %u (expected %d)\n",
+            h->version, HIT_VERSION);
+    return -1;
+  }
+  if ((*pwms = calloc((size_t)h->nb_pwms + 1, sizeof(hit_pwm_t))) == NULL) {
+    perror("hit_read_header: calloc");
+    exit(1);
+  }
+  if (fread(*pwms, sizeof(hit_pwm_t), h->nb_pwms, in) != h->nb_pwms) {
+    fprintf(stderr, "Binary match stream is truncated\n");
+    free(*pwms);
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Function to write the header and matrix table of a binary match stream
+ * @returns 0 on success
+ * @returns -1 on write error
+ */
+int hit_write_header(FILE *out, const hit_hdr_t *h, const hit_pwm_t *pwms)
+{
+  if (fwrite(h, sizeof(hit_hdr_t), 1, out) != 1
+      || fwrite(pwms, sizeof(hit_pwm_t), h->nb_pwms, out) != h->nb_pwms)
+    return -1;
+  return 0;
+}
+
+/**
+ * Function to check that a binary match stream refers to genome g
+ * @returns 0 if the header matches the genome pack
+ * @returns -1 otherwise (a message is printed on stderr)
+ */
+int hit_check_genome(const hit_hdr_t *h, const genome_t *g)
+{
+  if (h->nb_chroms != g->hdr->nb_chroms
+      || strncmp(h->assembly, g->hdr->assembly, PACK_NAME_MAX) != 0) {
+    fprintf(stderr, "Binary match stream (%s, %u sequences) does not refer to "
+            "the given genome pack (%s, %u sequences)\n", h->assembly,
+            h->nb_chroms, g->hdr->assembly, g->hdr->nb_chroms);
+    return -1;
+  }
+  if (h->genome_sum != hit_genome_sum(g)) {
+    fprintf(stderr, "Binary match stream does not refer to the given genome "
+            "pack (sequence accessions or lengths differ)\n");
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * Function to compute the checksum of the sequence accessions and lengths
+ * of genome g (FNV-1a)
+ * @returns the checksum
+ */
+uint64_t hit_genome_sum(const genome_t *g)
+{
+  uint64_t sum = 14695981039346656037ULL;
+
+  for (uint32_t k = 0; k < g->hdr->nb_chroms; k++) {
+    const pack_chrom_t *c = &g->chrom[k];
+    const unsigned char *p = (const unsigned char *)c->ac;
+    uint32_t len = c->len;
+
+    for (size_t i = 0; i < sizeof(c->ac) && p[i]; i++)
+      sum = (sum ^ p[i]) * 1099511628211ULL;
+    for (int i = 0; i < 4; i++, len >>= 8)
+      sum = (sum ^ (len & 0xff)) * 1099511628211ULL;
+  }
+  return sum;
+}
+
+/**
+ * Function to check that a match record lies within its sequence
+ * @returns 1 if the sequence and matrix indexes are valid and the match
+ * ends within the sequence
+ * @returns 0 otherwise
+ */
+int hit_valid(const hit_hdr_t *h, const hit_pwm_t *pwms, const genome_t *g, const hit_t *hit)
+{
+  if (hit->chrom >= h->nb_chroms || hit->pwm >= h->nb_pwms)
+    return 0;
+  return (uint64_t)hit->start + pwms[hit->pwm].len <= g->chrom[hit->chrom].len;
+}
+
+/**
+ * Function to rebuild the matched word of a hit from the genome pack
+ * (the hit must lie within its sequence, see hit_valid)
+ * @param word output buffer of at least len + 1 characters
+ * @returns word (reverse complement for '-' strand matches)
+ */
+char * hit_word(const genome_t *g, const hit_t *hit, uint32_t len, char *word)
+{
+  static const char fw[] = "ACGTN";
+  static const char rv[] = "TGCAN";
+
+  genome_decode(g, (int)hit->chrom, hit->start + 1, hit->start + len, word);
+  if (hit->strand == '-') {
+    for (uint32_t i = 0, j = len - 1; i < j; i++, j--) {
+      char c = word[i];
+      word[i] = word[j];
+      word[j] = c;
+    }
+    for (uint32_t i = 0; i < len; i++)
+      word[i] = rv[(int)word[i]];
+  } else {
+    for (uint32_t i = 0; i < len; i++)
+      word[i] = fw[(int)word[i]];
+  }
+  word[len] = 0;
+  return word;
+}
@@ -0,0 +1,121 @@
+/**
+ * License GPLv3+
+ * @file hitrec.h
+ * @brief binary match records (matrix_scan -B output)
+ *
+ * A binary match stream has the following layout:
+ *
+ *   hit_hdr_t                        stream header
+ *   hit_pwm_t x nb_pwms              matrix table
+ *   hit_t ...                        match records, up to the end of the stream
+ *
+ * Matches refer to the sequences of a genome pack file (see seqpack.h) by
+ * their index, so that sequence names and matched words can be rebuilt
+ * from the genome pack. The header records the assembly name, the number
+ * of sequences and a checksum of the sequence accessions and lengths of the
+ * genome pack, which readers check against the genome pack they are given.
+ * All integers are stored in native byte order.
+ */
+#ifndef _HITREC_H
+#define _HITREC_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include "seqpack.h"
+
+#define HIT_MAGIC "PWMSHITS"
+#define HIT_VERSION 2
+#define HIT_NAME_MAX 128
+/** The matrix name is reported as an extra column (library mode) */
+#define HIT_NAMED 1
+
+/**
+ * @struct hit_hdr_t "hitrec.h"
+ * @brief binary match stream header
+ */
+typedef struct _hit_hdr_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  uint32_t nb_pwms;
+  uint32_t nb_chroms;
+  char assembly[PACK_NAME_MAX];
+  /** checksum of the genome pack index (see hit_genome_sum) */
+  uint64_t genome_sum;
+} hit_hdr_t;
+
+/**
+ * @struct hit_pwm_t "hitrec.h"
+ * @brief matrix table entry
+ */
+typedef struct _hit_pwm_t {
+  char name[HIT_NAME_MAX];
+  uint32_t len;
+  uint32_t pad;
+} hit_pwm_t;
+
+/**
+ * @struct hit_t "hitrec.h"
+ * @brief match record (16 bytes)
+ */
+typedef struct _hit_t {
+  /** sequence index in the genome pack */
+  uint32_t chrom;
+  /** 0-based start position */
+  uint32_t start;
+  int32_t score;
+  /** matrix index in the matrix table */
+  uint16_t pwm;
+  /** '+' or '-' */
+  char strand;
+  char pad;
+} hit_t, *hit_p_t;
+
+/**
+ * Function to read the header and matrix table of a binary match stream
+ * @param in input stream
+ * @param h header to be filled in
+ * @param pwms allocated matrix table (to be freed by the caller)
+ * @returns 0 on success
+ * @returns -1 on error (a message is printed on stderr)
+ */
+int hit_read_header(FILE *in, hit_hdr_t *h, hit_pwm_t **pwms);
+
+/**
+ * Function to write the header and matrix table of a binary match stream
+ * @returns 0 on success
+ * @returns -1 on write error
+ */
+int hit_write_header(FILE *out, const hit_hdr_t *h, const hit_pwm_t *pwms);
+
+/**
+ * Function to check that a binary match stream refers to genome g
+ * @returns 0 if the header matches the genome pack
+ * @returns -1 otherwise (a message is printed on stderr)
+ */
+int hit_check_genome(const hit_hdr_t *h, const genome_t *g);
+
+/**
+ * Function to compute the checksum of the sequence accessions and lengths
+ * of genome g (FNV-1a)
+ * @returns the checksum
+ */
+uint64_t hit_genome_sum(const genome_t *g);
+
+/**
+ * Function to check that a match record lies within its sequence
+ * @returns 1 if the sequence and matrix indexes are valid and the match
+ * ends within the sequence
+ * @returns 0 otherwise
+ */
+int hit_valid(const hit_hdr_t *h, const hit_pwm_t *pwms, const genome_t *g, const hit_t *hit);
+
+/**
+ * Function to rebuild the matched word of a hit from the genome pack
+ * (the hit must lie within its sequence, see hit_valid)
+ * @param word output buffer of at least len + 1 characters
+ * @returns word (reverse complement for '-' strand matches)
+ */
+char * hit_word(const genome_t *g, const hit_t *hit, uint32_t len, char *word);
+
+#endif
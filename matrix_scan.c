@@ -8,7 +8,7 @@
      # Matrix File
      # Cut-off score (integer)
      # Search mode: both strands/forward [def: both]
-     # Word index length
+     # Word index length (or auto)
      # Background model (base composition)
        a comma-separated list of four numbers, e.g. 25,25,25,25,
        internally normalized to probabilities [def: 0.25,0.25,0.25,0.25]
@@ -57,17 +57,53 @@
 #include <getopt.h>
 #include <assert.h>
 #include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define HAVE_SIMD
+#include <immintrin.h>
+#endif
+#include "seqpack.h"
+#include "hitrec.h"
+#include "zfile.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
 
 #define BUF_SIZE 4194304 /* 4MB */
 #define THIRTY_TWO_MEG 0x2000000ULL
+#define WINDOW_SIZE THIRTY_TWO_MEG /* Bases of FASTA input scanned at once */
 #define LINE_SIZE 1024
 #define NUCL  5
 #define LMAX  100
 #define HDR_MAX 256
 #define MVAL_MAX 16
+#define CHUNK_SIZE 1048576 /* 1MB */
+#define CHUNK_MIN  65536
+#define THREADS_MAX 256
+#define RUNS_MAX 1024
+#define OBUF_SIZE 1048576 /* 1MB */
+#define OBUF_QUEUED 8
+#define PVAL_LEN 24
+#define BITMAP_WORDLEN 12  /* Viable word bitmap from this word length */
+#define SCORE_FAIL (INT_MIN / 2)
+#define SCORE16_FAIL INT16_MIN
+#define LAT_BLOCK 4  /* Max lateral positions per lookup block (<= 5) */
+#define PLAN_SAMPLE 65536  /* Max candidates of the drop-off profile (-a) */
+#define PLAN_MINLEN 5      /* Word lengths tried by the profile (-a)     */
+#define PLAN_MAXLEN 11
+#define PLAN_MB_MAX 4294   /* Max profile length (Mb, sequences are < 4 Gb) */
+/* Cost model of the automatic word length (-i auto), in CPU cycles   */
+#define COST_L1 1       /* Table lookup hitting the L1, L2, L3 cache  */
+#define COST_L2 2
+#define COST_L3 15
+#define COST_MEM 50     /* Table lookup missing the caches            */
+#define COST_BITMAP 4   /* Rank computation of the viable word bitmap */
+#define COST_BLOCK 10   /* Lateral block lookup                       */
+#define COST_DROP 20    /* Candidates left after the core region      */
+#define AUTO_MINLEN 4
+#define AUTO_BINS 4096  /* Score bins of the survival estimates       */
 
 typedef struct _options_t {
   int help;
@@ -80,61 +116,372 @@ static options_t options;
 static char nucleotide[] = {'N','A','C','G','T'};
 static float bgcomp[] = {0.25,0.25,0.25,0.25, 0.0};
 
+/* Regions to scan in a sequence (--regions): BED intervals [beg..end[ */
+/* (0-based, end excluded), sorted and merged                           */
+typedef struct _region_t {
+  unsigned int beg;
+  unsigned int end;
+} region_t, *region_p_t;
+
+typedef struct _reglist_t {
+  char *name;
+  region_p_t reg;
+  int nb;
+  int size;
+} reglist_t, *reglist_p_t;
+
+/* DNA sequence: bases are packed four per byte (2-bit codes A=0,C=1,  */
+/* G=2,T=3), base j being stored at bits 2*(j%4) of byte j/4, with the */
+/* first base at position 1. N's are stored as A's and recorded in an  */
+/* ordered list of N-runs (same layout as genome pack files).         */
+/* FASTA sequences are streamed through a window of WINDOW_SIZE bases: */
+/* seq then holds bases off+1..off+len of the sequence, and the window */
+/* owns the matches starting at beg..len-maxLen+1 (up to the sequence  */
+/* end for the last window).                                          */
 typedef struct _seq_t {
   char *hdr;
-  short int *seq;
+  unsigned char *seq;
   unsigned int len;
+  nrun_p_t nrun;
+  int nbRuns;
+  unsigned int id;   /* Sequence index in the genome pack (-g)      */
+  unsigned int off;  /* Offset of the window in the sequence        */
+  unsigned int beg;  /* First match start owned by the window       */
+  int more;          /* More bases follow the window                */
+  reglist_p_t reg;   /* Regions to scan (--regions)                 */
 } seq_t, *seq_p_t;
 
+/* Match kept by the top-K selection (--top): matches rank by        */
+/* decreasing score, then in sequence order. The formatted match     */
+/* (text line or binary record) is kept until the end of the scan.   */
+typedef struct _topm_t {
+  int score;
+  unsigned int id;   /* Sequence number                             */
+  unsigned int pos;  /* End position in the sequence                */
+  int rev;
+  char *line;
+  size_t len;
+} topm_t, *topm_p_t;
+
+/* Heap of the K best matches of a PWM found by a thread, the worst */
+/* one at the root. cut is the cut-off the thread scans the PWM     */
+/* with: the highest of its own worst kept match and of the shared  */
+/* cut-off of the PWM (TopCut), refreshed under TopLock.            */
+typedef struct _topk_t {
+  topm_p_t heap;
+  int nb;
+  int cut;
+} topk_t, *topk_p_t;
+
+/* Output buffer: matches are formatted into buf. Buffers attached  */
+/* to a file descriptor (fd >= 0) are written out when full, others */
+/* (chunk output in multi-threaded mode) grow as needed.            */
+/* With --top, matches go to the heaps of the scanning thread (top, */
+/* one per PWM) instead.                                            */
+typedef struct _obuf_t {
+  char *buf;
+  size_t len;
+  size_t size;
+  int fd;
+  topk_p_t top;
+} obuf_t, *obuf_p_t;
+
+/* Sequence chunk: matches ending at positions [from+pwmLen-1..to]  */
+/* Consecutive chunks overlap by maxLen-1 bases                      */
+typedef struct _chunk_t {
+  seq_p_t seq;
+  unsigned int from;
+  unsigned int to;
+  obuf_t out;        /* Output buffer (in memory)                   */
+} chunk_t, *chunk_p_t;
+
+/* Match record of a chunk (non-overlapping mode, multi-threaded):  */
+/* matches are filtered in sequence order when chunks are released  */
+typedef struct _mrec_t {
+  unsigned int j;
+  int score;
+  unsigned short pwm;
+  unsigned short rev;
+} mrec_t, *mrec_p_t;
+
+/* Work-stealing queue: range [lo..hi[ of chunk indices               */
+/* The owner takes chunks from the front, thieves from the back       */
+typedef struct _wsq_t {
+  pthread_mutex_t lock;
+  int lo;
+  int hi;
+} wsq_t, *wsq_p_t;
+
 typedef struct _arr_idx_t {
   float value;
   int index;
 } arr_idx_t, *arr_idx_p_t;
 
-FILE *fasta_in;
+zfile_t *fasta_in;
+char *genomeFile = NULL;
+
+/* Block of contiguous lateral PWM positions, scored by a single lookup */
+typedef struct _latblk_t {
+  int off;           /* First position, relative to the end of the PWM */
+  unsigned int mask; /* 4^(block length) - 1                           */
+  int *tab;          /* Summed weights of the 4^(block length) words,   */
+                     /* first base in the low bits (packed order)       */
+} latblk_t, *latblk_p_t;
+
+/* Position weight matrix, word index score tables and search strategy */
+typedef struct _pwm_t {
+  char *name;       /* Matrix name (library mode)                     */
+  char *tag;        /* Output tag: empty, or TAB + name (library)     */
+  int **pwm;
+  int **pwm_r;      /* reverse PWM  */
+  int pwmLen;
+  int wordLen;
+  /* Score arrays  */
+  /* Reverse strand scores are read from ScoreF, at the index of the */
+  /* reverse complement word (see define_search_strategy)            */
+  int *ScoreF;
+  /* 16-bit score table, used instead of ScoreF if the cut-off fits:  */
+  /* scores below the cut-off are clamped to SCORE16_FAIL             */
+  int16_t *Score16;
+  /* Long words (wordLen >= BITMAP_WORDLEN): bitmap of the words that */
+  /* may reach the cut-off, ScoreF only holds the scores of these     */
+  /* words, ranked by index. Rank counts the viable words before each */
+  /* block of 512 words.                                              */
+  uint64_t *Viable;
+  unsigned int *Rank;
+  unsigned int nbViable;
+  int cutOff;
+  int TopCut;      /* Cut-off raised by --top (under TopLock)      */
+  int Offset;
+  /* WordMask is used to compute the next word index (seq[2...j+1]) */
+  unsigned int WordMask;
+  /* RcShift is used to compute the next reverse complement word index */
+  unsigned int RcShift;
+  /* PWMs Core Regions (set by define_search_strategy() function)   */
+  /* In case the PWM is longer than the Word index, we must define  */
+  /* a core region within the PWM such that it minimizes the sum of */
+  /* weigths for rapid drop-off. The lateral positions are ranked   */
+  /* by weigth in decreasing order of importance.                   */
+  int Bfw;         /* Beginning forward Core Region                 */
+  int Efw;         /* End forward Core Region                       */
+  int Brv;         /* Beginning reverse Core Region                 */
+  int Erv;         /* End reverse Core Region                       */
+  int *Rfw;        /* Ranked index array (for lateral positions) FW */
+  int *Rrv;        /* Ranked index array (for lateral positions) RV */
+  /* Lateral positions are scored by blocks of up to LAT_BLOCK      */
+  /* contiguous positions, ordered by their best ranked position.    */
+  latblk_t *Kfw;   /* Lateral blocks FW                             */
+  latblk_t *Krv;   /* Lateral blocks RV                             */
+  int nbBlk;       /* Number of lateral blocks                      */
+  /* P-values (-p option): Pval + PVAL_LEN*s is the "P-value=..."   */
+  /* string of rescaled score -s, for s in [0..PvalMax]              */
+  char *Pval;
+  int PvalMax;
+  /* Pending match of the non-overlapping filter (-o option): end   */
+  /* position (0 if none), rescaled score and strand                 */
+  unsigned int BestJ;
+  int BestScore;
+  int BestRev;
+} pwm_t, *pwm_p_t;
+
+/* Matrices: a single PWM (-m) or a PWM library (-l)              */
+pwm_t *Pwms;
+int nbPwms = 0;
+int maxLen = 0;  /* Length of the longest PWM                     */
 
-int **pwm;
-int **pwm_r;      /* reverse PWM  */
-int pwmLen = 10;
 int wordLen = 7;
-
-/* Score arrays  */
-int *ScoreF;
-int *ScoreR;
-
+int autoWordLen = 0; /* Choose the word length of each PWM (-i auto) */
+/* Data cache sizes (bytes) by level, read from sysfs (-i auto)    */
+double cacheSize[4] = {0, 32768, 262144, 8388608};
 int cutOff = INT_MIN;
-int Offset = 0;
+char *cutoffFile = NULL;
 
-/* Array z is used to compute the next word index (seq[2...j+1])  */
-unsigned int *z;
-
-/* PWMs Core Regions (set by define_search_strategy() function)   */
-/* In case the PWM is longer than the Word index, we must define  */
-/* a core region within the PWM such that it minimizes the sum of */
-/* weigths for rapid drop-off. The lateral positions are ranked   */
-/* by weigth in decreasing order of importance.                   */
-int Bfw = 0;     /* Beginning forward Core Region                 */
-int Efw = 0;     /* End forward Core Region                       */
-int Brv = 0;     /* Beginning reverse Core Region                 */
-int Erv = 0;     /* End reverse Core Region                       */
-
-int *Rfw;        /* Ranked index array (for lateral positions) FW */
-int *Rrv;        /* Ranked index array (for lateral positions) RV */
+/* Lateral scoring kernel, selected at run time according to the CPU:  */
+/* scores simdLanes consecutive candidates at once (1 = scalar code).   */
+typedef unsigned int (*lateral_f)(const latblk_t *blk, int nb,
+    const unsigned char *s, unsigned int j, int *score, int cutOff);
+lateral_f lateral = NULL;
+int simdLanes = 1;
 
 /* Number of Pipe delimiters in the FASTA header after which the seq ID starts */
 int nbPipes = 2;
 
+/* Thread pool (set by the --threads option)                      */
+int nbThreads = 1;
+pthread_t *Workers;
+wsq_t *Queues;
+chunk_t *Chunks;
+int nbChunks = 0;
+int maxChunks = 0;
+
+pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t PoolWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t PoolDone = PTHREAD_COND_INITIALIZER;
+unsigned int JobId = 0;
+int Busy = 0;
+int Quit = 0;
+
+/* Match output (stdout). With the --writer option, full buffers are */
+/* queued and written out by a background thread.                    */
+obuf_t Out = {NULL, 0, 0, STDOUT_FILENO, NULL};
+int bgWriter = 0;
+int binOut = 0;     /* Binary match records (-B), see hitrec.h      */
+int pvalOut = 0;    /* Matrix name and p-value columns (-p)         */
+char *pwmName = NULL; /* Matrix name with -m (-N)                */
+int nonOverlap = 0; /* Keep the best of overlapping matches (-o)    */
+int softMask = 0;   /* Skip soft-masked (lowercase) bases (-s)      */
+/* Top-K selection (--top): heaps of thread t are TopHeaps[t*nbPwms] */
+/* When a heap is full, the shared cut-off of its PWM (TopCut) is    */
+/* raised to the score of its worst match under TopLock, so that     */
+/* scanning prunes harder as better matches are found. Threads pick  */
+/* up the raised cut-off into their heaps when they start a chunk.   */
+int topK = 0;
+topk_t *TopHeaps;
+pthread_mutex_t TopLock = PTHREAD_MUTEX_INITIALIZER;
+int planMb = 0;     /* Profile length (Mb) of the adaptive strategy (-a) */
+char *planFile = NULL; /* Search plans to reuse (-P)               */
+int planned = 0;
+/* Regions to scan (--regions), sorted by sequence name. The bases  */
+/* of a window outside the regions are masked by merging the gaps   */
+/* into its N-runs (MaskRuns).                                      */
+char *regionFile = NULL;
+reglist_t *Regions;
+int nbRegions = 0;
+nrun_t *MaskRuns;
+int mMask = 0;
+pthread_t Writer;
+pthread_mutex_t WriterLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t WriterWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t WriterRoom = PTHREAD_COND_INITIALIZER;
+obuf_t WriterQueue[OBUF_QUEUED];
+int wqHead = 0;
+int wqCount = 0;
+int WriterQuit = 0;
+
+/* Packed byte to bases (forward and reverse complement)             */
+char Quad[256][4];
+char QuadRc[256][4];
+
 /* Input process functions  */
+static pwm_p_t
+new_pwm(char *hdr)
+{
+  /* Append a new (empty) matrix to the matrix array. In library mode, */
+  /* the matrix name is taken from the header line, e.g.:              */
+  /* >log-odds matrix AHR_HUMAN.H11MO.0.B: alength= 4 w= 9 ...         */
+  static int maxPwms = 0;
+  char name[HDR_MAX];
+  char *end, *p;
+  pwm_p_t m;
+  int i = 0;
+
+  if (nbPwms == maxPwms) {
+    maxPwms = (maxPwms == 0) ? 16 : maxPwms * 2;
+    if ((Pwms = (pwm_t *)realloc(Pwms, (size_t)maxPwms * sizeof(pwm_t))) == NULL) {
+      perror("Pwms: realloc");
+      exit(1);
+    }
+  }
+  m = &Pwms[nbPwms++];
+  memset(m, 0, sizeof(pwm_t));
+  if (hdr != NULL) {
+    hdr++;
+    while (isspace(*hdr))
+      hdr++;
+    if (strncmp(hdr, "log-odds matrix", 15) == 0)
+      hdr += 15;
+    while (isspace(*hdr))
+      hdr++;
+    /* The name ends at the last ':' before the alength= field, as */
+    /* in the library scripts, so that "Ahr::Arnt" is kept whole.  */
+    if ((end = strstr(hdr, " alength=")) == NULL)
+      end = hdr + strlen(hdr);
+    for (p = end; p > hdr && p[-1] != ':'; p--)
+      ;
+    if (p > hdr)
+      end = p - 1;
+    while (hdr < end && i < HDR_MAX - 2) {
+      name[i++] = isspace(*hdr) ? '_' : *hdr;
+      hdr++;
+    }
+    while (i > 0 && name[i-1] == '_')
+      i--;
+  }
+  if (i == 0)
+    i = sprintf(name, "PWM_%d", nbPwms);
+  name[i] = 0;
+  m->name = strdup(name);
+  if (hdr != NULL) {
+    if ((m->tag = malloc(strlen(name) + 2)) != NULL)
+      sprintf(m->tag, "\t%s", name);
+  } else {
+    m->tag = strdup("");
+  }
+  if (m->name == NULL || m->tag == NULL) {
+    perror("new_pwm: malloc");
+    exit(1);
+  }
+  /* Allocate rows (PWM length + 1) and columns (NUCL=5) */
+  m->pwmLen = 10;
+  if ((m->pwm = (int **)calloc((size_t)m->pwmLen+1, sizeof(int *))) == NULL) {
+    fprintf(stderr, "Could not allocate matrix array: %s(%d)\n",
+        strerror(errno), errno);
+    exit(1);
+  }
+  for (i = 0; i <= m->pwmLen; i++) {
+    if ((m->pwm[i] = calloc((size_t)NUCL, sizeof(int))) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+  }
+  return m;
+}
+
+static int
+end_pwm(pwm_p_t m, int l)
+{
+  /* Set PWM length and make reverse-complement PWM */
+#ifdef DEBUG
+  fprintf(stderr, "PWM %s length: %d\n", m->name, l);
+#endif
+  if (l == 0) {
+    fprintf(stderr, "Matrix %s is empty\n", m->name);
+    return -1;
+  }
+  m->pwmLen = l;
+  if (l > maxLen)
+    maxLen = l;
+  if ((m->pwm_r = (int **)calloc((size_t)l+1, sizeof(int *))) == NULL) {
+    fprintf(stderr, "Could not allocate matrix array: %s(%d)\n",
+        strerror(errno), errno);
+    exit(1);
+  }
+  for (int k = 0; k <= l; k++) {
+    if ((m->pwm_r[k] = calloc((size_t)NUCL, sizeof(int))) == NULL) {
+      fprintf(stderr, "Out of memory\n");
+      exit(1);
+    }
+    if (k > 0) {
+      for (int i = 1; i < NUCL; i++)
+        m->pwm_r[k][i] = m->pwm[l-k+1][NUCL-i];
+    }
+  }
+  return 0;
+}
+
 static int
-read_pwm(char *iFile)
+read_pwm(char *iFile, int library)
 {
+  /* Read a single matrix, or a library of matrices, each starting with */
+  /* a '>' header line (library mode)                                   */
   FILE *f = fopen(iFile, "r");
   int l = 0;
   char *s, *res, *buf;
   size_t bLen = LINE_SIZE;
-  int p_len = pwmLen + 1;
+  int p_len = 0;
   char mval[MVAL_MAX] = "";
   int i;
+  pwm_p_t m = NULL;
 
   if (f == NULL) {
     fprintf(stderr, "Could not open file %s: %s(%d)\n",
@@ -148,6 +495,20 @@ read_pwm(char *iFile)
     perror("process_sga: malloc");
     exit(1);
   }
+  if (!library) {
+    /* Matrix name (-N), or file name without directory and extension */
+    char *base = strrchr(iFile, '/');
+    char *ext;
+    m = new_pwm(NULL);
+    p_len = m->pwmLen + 1;
+    free(m->name);
+    if ((m->name = strdup(pwmName != NULL ? pwmName : (base != NULL ? base + 1 : iFile))) == NULL) {
+      perror("read_pwm: strdup");
+      exit(1);
+    }
+    if (pwmName == NULL && (ext = strrchr(m->name, '.')) != NULL && ext != m->name)
+      *ext = 0;
+  }
   /* Read Matrix file line by line */
   while ((res = fgets(s, (int) bLen, f)) != NULL) {
     size_t cLen = strlen(s);
@@ -169,22 +530,37 @@ read_pwm(char *iFile)
 
     buf = s;
     /* Get PWM fields */
-    /* Get first character: if # or > skip line */
-    if (*buf == '#' || *buf == '>')
+    /* Get first character: if # skip line                   */
+    /* In library mode, > starts a new matrix, else skip line */
+    if (*buf == '#')
+      continue;
+    if (*buf == '>') {
+      if (library) {
+        if (m != NULL && end_pwm(m, l) != 0)
+          return -1;
+        m = new_pwm(buf);
+        p_len = m->pwmLen + 1;
+        l = 0;
+      }
       continue;
+    }
+    if (m == NULL) {
+      fprintf(stderr, "Matrix library %s must start with a '>' header line\n", iFile);
+      return -1;
+    }
 
     l++;
     if (l == p_len) {
       /* Reallocate Matrix rows */
-      pwm = realloc(pwm, p_len*2*sizeof(int *));
-      if (pwm == NULL) {
+      m->pwm = realloc(m->pwm, p_len*2*sizeof(int *));
+      if (m->pwm == NULL) {
         fprintf(stderr, "Out of memory\n");
         return 1;
       }
       /* Allocate columns       */
-      for ( int i = p_len; i <= p_len*2; i++) {
-        pwm[i] = calloc((size_t)NUCL, sizeof(int));
-        if (pwm[i] == NULL) {
+      for ( int i = p_len; i < p_len*2; i++) {
+        m->pwm[i] = calloc((size_t)NUCL, sizeof(int));
+        if (m->pwm[i] == NULL) {
           fprintf(stderr, "Out of memory\n");
           return 1;
         }
@@ -203,7 +579,7 @@ read_pwm(char *iFile)
       mval[i++] = *buf++;
     }
     mval[i] = 0;
-    pwm[l][1] = atoi(mval);
+    m->pwm[l][1] = atoi(mval);
     while (isspace(*buf))
       buf++;
     /* Read Second column value */
@@ -216,7 +592,7 @@ read_pwm(char *iFile)
       mval[i++] = *buf++;
     }
     mval[i] = 0;
-    pwm[l][2] = atoi(mval);
+    m->pwm[l][2] = atoi(mval);
     while (isspace(*buf))
       buf++;
     /* Read Third column value */
@@ -229,7 +605,7 @@ read_pwm(char *iFile)
       mval[i++] = *buf++;
     }
     mval[i] = 0;
-    pwm[l][3] = atoi(mval);
+    m->pwm[l][3] = atoi(mval);
     while (isspace(*buf))
       buf++;
     /* Read fourth column value */
@@ -242,43 +618,153 @@ read_pwm(char *iFile)
       mval[i++] = *buf++;
     }
     mval[i] = 0;
-    pwm[l][4] = atoi(mval);
+    m->pwm[l][4] = atoi(mval);
 #ifdef DEBUG
-    fprintf(stderr, "%3d   %7d   %7d   %7d   %7d\n", l, pwm[l][1], pwm[l][2], pwm[l][3], pwm[l][4]);
+    fprintf(stderr, "%3d   %7d   %7d   %7d   %7d\n", l, m->pwm[l][1], m->pwm[l][2], m->pwm[l][3], m->pwm[l][4]);
 #endif
   }
   fclose(f);
-#ifdef DEBUG
-  fprintf(stderr, "PWM length: %d\n", l);
-#endif
-  if (!options.forward) {
-    p_len = pwmLen + 1;
-    /* Make reverse-complement PWM */
-    for (int k = 1; k <= l; k++) {
-      for (i = 1; i < NUCL; i++)
-        pwm_r[k][i] = pwm[l-k+1][NUCL-i];
+  free(s);
+  if (m == NULL) {
+    fprintf(stderr, "No matrix found in file %s\n", iFile);
+    return -1;
+  }
+  return end_pwm(m, l);
+}
 
-      if (k == p_len -1) {
-      /* Reallocate Matrix rows */
-        pwm_r = realloc(pwm_r, p_len*2*sizeof(int *));
-        if (pwm_r == NULL) {
-          fprintf(stderr, "Out of memory\n");
-          return 1;
-        }
-        /* Allocate columns       */
-        for ( int i = p_len; i <= p_len*2; i++) {
-          pwm_r[i] = calloc((size_t)NUCL, sizeof(int));
-          if (pwm_r[i] == NULL) {
-            fprintf(stderr, "Out of memory\n");
-            return 1;
+static int
+read_cutoffs(char *iFile)
+{
+  /* Read per-matrix cut-offs: one line per matrix with the matrix */
+  /* name and the cut-off score, separated by white space          */
+  FILE *f = fopen(iFile, "r");
+  char buf[LINE_SIZE];
+  char name[HDR_MAX];
+  int score;
+
+  if (f == NULL) {
+    fprintf(stderr, "Could not open file %s: %s(%d)\n",
+            iFile, strerror(errno), errno);
+    return -1;
+  }
+  while (fgets(buf, LINE_SIZE, f) != NULL) {
+    if (buf[0] == '#' || sscanf(buf, "%255s %d", name, &score) != 2)
+      continue;
+    for (int k = 0; k < nbPwms; k++) {
+      if (strcmp(Pwms[k].name, name) == 0)
+        Pwms[k].cutOff = score;
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static int
+cmp_region(const void *a, const void *b)
+{
+  const region_t *x = a;
+  const region_t *y = b;
+  return (x->beg > y->beg) - (x->beg < y->beg);
+}
+
+static int
+cmp_reglist(const void *a, const void *b)
+{
+  return strcmp(((const reglist_t *)a)->name, ((const reglist_t *)b)->name);
+}
+
+static int
+read_regions(char *iFile)
+{
+  /* Read the regions to scan from a BED file (sequence name, start   */
+  /* and end, 0-based with the end excluded), then sort and merge the */
+  /* intervals of each sequence                                       */
+  FILE *f = fopen(iFile, "r");
+  char buf[LINE_SIZE];
+  char name[HDR_MAX];
+  long b, e;
+  int mRegions = 0;
+  int k = -1;
+
+  if (f == NULL) {
+    fprintf(stderr, "Could not open file %s: %s(%d)\n",
+            iFile, strerror(errno), errno);
+    return -1;
+  }
+  while (fgets(buf, LINE_SIZE, f) != NULL) {
+    if (buf[0] == '#' || strncmp(buf, "track", 5) == 0 || strncmp(buf, "browser", 7) == 0
+        || sscanf(buf, "%255s %ld %ld", name, &b, &e) != 3)
+      continue;
+    if (b < 0 || e < b || e > (long)UINT_MAX) {
+      fprintf(stderr, "Invalid BED interval %s:%ld-%ld in file %s\n", name, b, e, iFile);
+      fclose(f);
+      return -1;
+    }
+    if (e == b)
+      continue;
+    /* BED files are usually grouped by sequence */
+    if (k < 0 || strcmp(Regions[k].name, name) != 0) {
+      for (k = 0; k < nbRegions && strcmp(Regions[k].name, name) != 0; k++)
+        ;
+      if (k == nbRegions) {
+        if (nbRegions == mRegions) {
+          mRegions = mRegions ? 2 * mRegions : 64;
+          if ((Regions = (reglist_t *) realloc(Regions, (size_t)mRegions * sizeof(reglist_t))) == NULL) {
+            perror("read_regions: realloc");
+            exit(1);
           }
         }
-        p_len *= 2;
+        if ((Regions[k].name = strdup(name)) == NULL) {
+          perror("read_regions: strdup");
+          exit(1);
+        }
+        Regions[k].reg = NULL;
+        Regions[k].nb = 0;
+        Regions[k].size = 0;
+        nbRegions++;
+      }
+    }
+    reglist_p_t rl = &Regions[k];
+    if (rl->nb == rl->size) {
+      rl->size = rl->size ? 2 * rl->size : 256;
+      if ((rl->reg = (region_t *) realloc(rl->reg, (size_t)rl->size * sizeof(region_t))) == NULL) {
+        perror("read_regions: realloc");
+        exit(1);
       }
     }
+    rl->reg[rl->nb].beg = (unsigned int)b;
+    rl->reg[rl->nb].end = (unsigned int)e;
+    rl->nb++;
   }
-  if ( l == 0 ) return -1;
-  return l;
+  fclose(f);
+  for (k = 0; k < nbRegions; k++) {
+    reglist_p_t rl = &Regions[k];
+    int n = 0;
+    qsort(rl->reg, (size_t)rl->nb, sizeof(region_t), cmp_region);
+    /* Merge overlapping and adjacent intervals */
+    for (int r = 1; r < rl->nb; r++) {
+      if (rl->reg[r].beg <= rl->reg[n].end) {
+        if (rl->reg[r].end > rl->reg[n].end)
+          rl->reg[n].end = rl->reg[r].end;
+      } else {
+        rl->reg[++n] = rl->reg[r];
+      }
+    }
+    rl->nb = n + 1;
+    if (options.debug)
+      fprintf(stderr, "Regions of sequence %s: %d\n", rl->name, rl->nb);
+  }
+  qsort(Regions, (size_t)nbRegions, sizeof(reglist_t), cmp_reglist);
+  return 0;
+}
+
+static reglist_p_t
+find_regions(const char *name)
+{
+  /* Regions to scan in sequence name (NULL if none) */
+  reglist_t key;
+  key.name = (char *)name;
+  return (reglist_p_t) bsearch(&key, Regions, (size_t)nbRegions, sizeof(reglist_t), cmp_reglist);
 }
 
 static int
@@ -311,32 +797,32 @@ max_score(int **m, int k)
 }
 
 static void
-process_pwm() {
+process_pwm(pwm_p_t m) {
   /* Rescale weights to have zero as a maximum value at each position */
   /* Compute Offset and re-define cutOff                              */
   int max;
-  for (int k = 1; k <= pwmLen; k++) {
-    max = max_score(pwm, k);
+  for (int k = 1; k <= m->pwmLen; k++) {
+    max = max_score(m->pwm, k);
     for (int i = 1; i < NUCL; i++)
-      pwm[k][i] -= max;
-    Offset += max;
+      m->pwm[k][i] -= max;
+    m->Offset += max;
   }
-  cutOff = cutOff - Offset;
+  m->cutOff = m->cutOff - m->Offset;
   if (options.debug)
-    fprintf(stderr, "rescaled cutOff: %d\n", cutOff);
+    fprintf(stderr, "rescaled cutOff: %d\n", m->cutOff);
   if (!options.forward) {
   /* Rescale reverse PWM */
-    for (int k = 1; k <= pwmLen; k++) {
-      max = max_score(pwm_r, k);
+    for (int k = 1; k <= m->pwmLen; k++) {
+      max = max_score(m->pwm_r, k);
       for (int i = 1; i < NUCL; i++)
-        pwm_r[k][i] -= max;
+        m->pwm_r[k][i] -= max;
     }
   }
   if (options.debug) {
     fprintf(stderr, "Re-scaled Weight Matrix: original representation \n\n");
-    for (int k = 1; k <= pwmLen; k++) {
+    for (int k = 1; k <= m->pwmLen; k++) {
       for ( int i = 1; i < NUCL; i++) {
-        int mval = pwm[k][i];
+        int mval = m->pwm[k][i];
         fprintf(stderr, " %7d ", mval);
       }
       fprintf(stderr, "\n");
@@ -344,9 +830,9 @@ process_pwm() {
     fprintf(stderr, "\n");
     if (!options.forward) {
       fprintf(stderr, "Re-scaled Reverse Weight Matrix:\n\n");
-      for (int k = 1; k <= pwmLen; k++) {
+      for (int k = 1; k <= m->pwmLen; k++) {
         for ( int i = 1; i < NUCL; i++) {
-          int mval = pwm_r[k][i];
+          int mval = m->pwm_r[k][i];
           fprintf(stderr, " %7d ", mval);
         }
         fprintf(stderr, "\n");
@@ -356,6 +842,68 @@ process_pwm() {
   }
 }
 
+static void
+make_pvalues(pwm_p_t m)
+{
+  /* Compute the score distribution of the rescaled PWM under the   */
+  /* background model (same dynamic programming as matrix_prob), and */
+  /* format the p-value (cumulative probability) of each score above */
+  /* the cut-off.                                                    */
+  int range = 0;
+  int smin = 0;
+  int max = 0;
+  double *p, *q;
+  double prob = 0;
+
+  /* Row values are shifted to have zero as a minimum at each position */
+  int *rmin = (int *) calloc((size_t)m->pwmLen+1, sizeof(int));
+  for (int k = 1; k <= m->pwmLen; k++) {
+    rmin[k] = m->pwm[k][1];
+    for (int i = 2; i < NUCL; i++)
+      if (m->pwm[k][i] < rmin[k])
+        rmin[k] = m->pwm[k][i];
+    range -= rmin[k];
+    smin += rmin[k];
+  }
+  p = (double *)calloc((size_t)range + 1, sizeof(double));
+  q = (double *)calloc((size_t)range + 1, sizeof(double));
+  if (rmin == NULL || p == NULL || q == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (int i = 1; i < NUCL; i++)
+    p[m->pwm[1][i] - rmin[1]] += bgcomp[i];
+  max = -rmin[1];
+  for (int k = 2; k <= m->pwmLen; k++) {
+    for (int j = 0; j <= max; j++) {
+      if (p[j] != 0) {
+        for (int i = 1; i < NUCL; i++)
+          q[j + m->pwm[k][i] - rmin[k]] += p[j]*bgcomp[i];
+      }
+    }
+    max -= rmin[k];
+    for (int j = 0; j <= max; j++) {
+      p[j] = q[j];
+      q[j] = 0;
+    }
+  }
+  /* Rescaled scores go from smin to 0: index j = score - smin */
+  m->PvalMax = (m->cutOff > smin) ? -m->cutOff : -smin;
+  if (m->PvalMax < 0)
+    m->PvalMax = 0;
+  if ((m->Pval = calloc((size_t)(m->PvalMax + 1), PVAL_LEN)) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    exit(1);
+  }
+  for (int s = 0; s <= m->PvalMax; s++) {
+    prob += p[range - s];
+    snprintf(m->Pval + (size_t)s * PVAL_LEN, PVAL_LEN, "P-value=%.2e", prob);
+  }
+  free(rmin);
+  free(p);
+  free(q);
+}
+
 static void
 process_bgcomp() {
   float sum = 0;
@@ -375,43 +923,111 @@ compfunc(const void *e1, const void *e2) {
 }
 
 /* Prepare Word index and Score tables and define search strategy */
+static int
+flank_blocks(int B, int E, int len, int *first, int *last)
+{
+  /* Cut the flanks [1..B-1] and [E+1..len] of the core region into */
+  /* blocks [first..last] of up to LAT_BLOCK positions (from the    */
+  /* core outwards). Return the number of blocks.                   */
+  int n = 0;
+
+  for (int e = B - 1; e >= 1; e -= LAT_BLOCK, n++) {
+    first[n] = (e > LAT_BLOCK) ? e - LAT_BLOCK + 1 : 1;
+    last[n] = e;
+  }
+  for (int b = E + 1; b <= len; b += LAT_BLOCK, n++) {
+    first[n] = b;
+    last[n] = (b + LAT_BLOCK - 1 < len) ? b + LAT_BLOCK - 1 : len;
+  }
+  return n;
+}
+
+static latblk_t *
+lateral_blocks(int **pwm, const int *R, int B, int E, int len, int *nb)
+{
+  /* Lateral blocks of the core region [B..E], ordered by the rank  */
+  /* (R) of their best position                                     */
+  int diff = len - (E - B + 1);
+  int rank[len+1];
+  arr_idx_t key[diff+1];
+  int first[diff+1];
+  int last[diff+1];
+  int n = flank_blocks(B, E, len, first, last);
+
+  for (int k = 0; k < diff; k++)
+    rank[R[k]] = k;
+  for (int k = 0; k < n; k++) {
+    key[k].value = (float)diff;
+    key[k].index = k;
+    for (int p = first[k]; p <= last[k]; p++)
+      if (rank[p] < key[k].value)
+        key[k].value = (float)rank[p];
+  }
+  qsort(key, (size_t)n, sizeof(key[0]), compfunc);
+  latblk_t *blk = (latblk_t *) calloc((size_t)(n > 0 ? n : 1), sizeof(latblk_t));
+  if (blk == NULL) {
+    perror("lateral_blocks: calloc");
+    exit(1);
+  }
+  for (int k = 0; k < n; k++) {
+    int b = first[key[k].index];
+    int l = last[key[k].index] - b + 1;
+    unsigned int size = 1u << (2 * l);
+    blk[k].off = b - len;
+    blk[k].mask = size - 1;
+    if ((blk[k].tab = (int *) malloc((size_t)size * sizeof(int))) == NULL) {
+      perror("lateral_blocks: malloc");
+      exit(1);
+    }
+    for (unsigned int x = 0; x < size; x++) {
+      blk[k].tab[x] = 0;
+      for (int t = 0; t < l; t++)
+        blk[k].tab[x] += pwm[b+t][((x >> (2 * t)) & 3) + 1];
+    }
+    if (options.debug)
+      fprintf(stderr, "Lateral block %d: positions %d to %d\n", k, b, b + l - 1);
+  }
+  *nb = n;
+  return blk;
+}
+
 static void
-define_search_strategy() {
+define_search_strategy(pwm_p_t m) {
   /* Definition of a core region within the PWM */
   /* and ranking of the positions outside the   */
   /* the core region by decreasing importance   */
-  float wf[pwmLen+1];
-  arr_idx_t wfobj[pwmLen+1];
+  float wf[m->pwmLen+1];
+  arr_idx_t wfobj[m->pwmLen+1];
   /* Allocate forward ranked index array */
-  Rfw = (int *) calloc((size_t)pwmLen+1, sizeof(int));
+  m->Rfw = (int *) calloc((size_t)m->pwmLen+1, sizeof(int));
   wf[0] = 1.0;
-  for (int k = 1; k <= pwmLen; k++) {
+  for (int k = 1; k <= m->pwmLen; k++) {
     wf[k] = 0.0;
     for (int i = 1; i < NUCL; i++)
-      wf[k] += bgcomp[i]*pwm[k][i];
+      wf[k] += bgcomp[i]*m->pwm[k][i];
   }
   /* Determine core region [Bfw-Efw] minimizing the sum of weights       */
   float x = 0.0;
-  for (int j = 1; j <= wordLen; j++)
+  for (int j = 1; j <= m->wordLen; j++)
     x += wf[j];
   float min = x;
-  int pos = wordLen;
-  for (int j = wordLen+1; j <= pwmLen; j++) {
-    x = x - wf[j-wordLen] + wf[j];
+  int pos = m->wordLen;
+  for (int j = m->wordLen+1; j <= m->pwmLen; j++) {
+    x = x - wf[j-m->wordLen] + wf[j];
     if (x < min) {
       min = x;
       pos = j;
     }
   }
-  Bfw = pos - wordLen + 1;
-  Efw = pos;
+  m->Bfw = pos - m->wordLen + 1;
+  m->Efw = pos;
   if (options.debug)
-    fprintf (stderr, "Core region FW: from %d to %d\n", Bfw, Efw);
+    fprintf (stderr, "Core region FW: from %d to %d\n", m->Bfw, m->Efw);
   /* Mask core region and rank lateral positions by weigth               */
-  for (int j = Bfw; j <= Efw; j++)
+  for (int j = m->Bfw; j <= m->Efw; j++)
     wf[j] = 1.0;
   /* Fill weight array structure  */
-  for (int j = 0; j <= pwmLen; j++) {
+  for (int j = 0; j <= m->pwmLen; j++) {
     wfobj[j].value = wf[j];
     wfobj[j].index = j;
     if (options.debug)
@@ -419,48 +1035,39 @@ define_search_strategy() {
   }
   if (options.debug)
     fprintf(stderr, "\n");
-  qsort(wfobj, pwmLen+1, sizeof(wfobj[0]), compfunc);
+  qsort(wfobj, m->pwmLen+1, sizeof(wfobj[0]), compfunc);
   /* Extract sorted index array   */
-  for (int j = 0; j <= pwmLen; j++) {
-    Rfw[j] = wfobj[j].index;
+  for (int j = 0; j <= m->pwmLen; j++) {
+    m->Rfw[j] = wfobj[j].index;
     if (options.debug)
-      fprintf (stderr, " %d ", Rfw[j]);
+      fprintf (stderr, " %d ", m->Rfw[j]);
   }
   if (options.debug)
     fprintf(stderr, "\n");
   if (!options.forward) {  /* Reverse PWM  */
-    float wr[pwmLen+1];
-    arr_idx_t wrobj[pwmLen+1];
+    float wr[m->pwmLen+1];
+    arr_idx_t wrobj[m->pwmLen+1];
     /* Allocate reverse ranked index array */
-    Rrv = (int *) calloc((size_t)pwmLen+1, sizeof(int));
+    m->Rrv = (int *) calloc((size_t)m->pwmLen+1, sizeof(int));
     wr[0] = 1.0;
-    for (int k = 1; k <= pwmLen; k++) {
+    for (int k = 1; k <= m->pwmLen; k++) {
       wr[k] = 0.0;
       for (int i = 1; i < NUCL; i++)
-        wr[k] += bgcomp[i]*pwm_r[k][i];
-    }
-    /* Determine core region [Brv-Erv] minimizing the sum of weights       */
-    float x = 0.0;
-    for (int j = 1; j <= wordLen; j++)
-      x += wr[j];
-    float min = x;
-    int pos = wordLen;
-    for (int j = wordLen+1; j <= pwmLen; j++) {
-      x = x - wr[j-wordLen] + wr[j];
-      if (x < min) {
-        min = x;
-        pos = j;
-      }
+        wr[k] += bgcomp[i]*m->pwm_r[k][i];
     }
-    Brv = pos - wordLen + 1;
-    Erv = pos;
+    /* The reverse core region [Brv-Erv] is the mirror image of the       */
+    /* forward one: the reverse PWM core then scores the reverse          */
+    /* complement of a word as the forward core scores the word, so that  */
+    /* both strands share the forward score table.                        */
+    m->Brv = m->pwmLen + 1 - m->Efw;
+    m->Erv = m->pwmLen + 1 - m->Bfw;
     if (options.debug)
-      fprintf (stderr, "Core region RV: from %d to %d\n", Brv, Erv);
+      fprintf (stderr, "Core region RV: from %d to %d\n", m->Brv, m->Erv);
     /* Mask core region and rank lateral positions by weigth               */
-    for (int j = Brv; j <= Erv; j++)
+    for (int j = m->Brv; j <= m->Erv; j++)
       wr[j] = 1.0;
     /* Fill weight array structure  */
-    for (int j = 0; j <= pwmLen; j++) {
+    for (int j = 0; j <= m->pwmLen; j++) {
       wrobj[j].value = wr[j];
       wrobj[j].index = j;
       if (options.debug)
@@ -468,16 +1075,20 @@ define_search_strategy() {
     }
     if (options.debug)
       fprintf(stderr, "\n");
-    qsort(wrobj, pwmLen+1, sizeof(wrobj[0]), compfunc);
+    qsort(wrobj, m->pwmLen+1, sizeof(wrobj[0]), compfunc);
     /* Extract sorted index array   */
-    for (int j = 0; j <= pwmLen; j++) {
-      Rrv[j] = wrobj[j].index;
+    for (int j = 0; j <= m->pwmLen; j++) {
+      m->Rrv[j] = wrobj[j].index;
       if (options.debug)
-        fprintf (stderr, " %d ", Rrv[j]);
+        fprintf (stderr, " %d ", m->Rrv[j]);
     }
     if (options.debug)
       fprintf(stderr, "\n");
   }
+  /* Lateral blocks (the reverse ones mirror the forward ones)          */
+  m->Kfw = lateral_blocks(m->pwm, m->Rfw, m->Bfw, m->Efw, m->pwmLen, &m->nbBlk);
+  if (!options.forward)
+    m->Krv = lateral_blocks(m->pwm_r, m->Rrv, m->Brv, m->Erv, m->pwmLen, &m->nbBlk);
 }
 
 unsigned int
@@ -494,491 +1105,1872 @@ power(unsigned int base, unsigned int degree)
   return result;
 }
 
-static int
-make_tables()
-{
-  /* Make Word index and score tables                                           */
-  /* Words of length wordLen are encoded as integers between 1 and 4^(wordLen), */
-  /* e.g. for wordLen=4 index(AAAA)=1, and index(TTTT)=256.                     */
-  /* The PWM scores for these words in forward and reverse orientation are      */
-  /* stored in ScoreR and ScoreF (integer array variables).                     */
-  unsigned int i; /* word index 1..4^(wordLen) */
-  int j;
-  int n;
-  /* Allocate memory for score arrays  */
-  unsigned int wsize = power(4, wordLen);
-  /* Allocate forward score and navigation link arrays                          */
-  if ( (ScoreF = (int *)malloc((size_t)(wsize+1) * sizeof(int))) == NULL ) {
+static void
+alloc_scores(pwm_p_t m, size_t size)
+{
+  /* Allocate the score table, with 16-bit scores if the cut-off fits */
+  if (m->cutOff > SCORE16_FAIL) {
+    if ((m->Score16 = (int16_t *)malloc(size * sizeof(int16_t))) == NULL) {
+      perror("Score16: malloc");
+      exit(1);
+    }
+  } else if ((m->ScoreF = (int *)malloc(size * sizeof(int))) == NULL) {
     perror("ScoreF: malloc");
     exit(1);
   }
-  /* Variable z is used to set the word idx e.g.: z={0,64,128,192} for wordLen=4*/
-  if ( (z = (unsigned int *) calloc((size_t)NUCL, sizeof(unsigned int))) == NULL ) {
-    perror("z: calloc");
+  if (options.debug)
+    fprintf(stderr, "Matrix %s: %d-bit score table\n", m->name,
+        (m->Score16 != NULL) ? 16 : 32);
+}
+
+static inline void
+set_score(pwm_p_t m, unsigned int r, int score)
+{
+  if (m->Score16 != NULL)
+    m->Score16[r] = (score < m->cutOff) ? SCORE16_FAIL : (int16_t)score;
+  else
+    m->ScoreF[r] = score;
+}
+
+static unsigned int
+viable_words(pwm_p_t m, int b, int n, unsigned int index, int score)
+{
+  /* Depth-first enumeration of the words that may reach the cut-off,  */
+  /* in increasing index order. As all weights are <= 0 after          */
+  /* rescaling, a prefix scoring below the cut-off is a dead end.      */
+  /* Viable words are only counted until the bitmap is allocated.      */
+  unsigned int nb = 0;
+
+  if (score < m->cutOff)
+    return 0;
+  if (n > m->wordLen) {
+    if (m->Viable != NULL) {
+      /* The rank of a block is set by its first viable word: blocks   */
+      /* (and bitmap pages) without viable words are never touched     */
+      uint64_t *blk = m->Viable + ((index >> 6) & ~7u);
+      uint64_t any = 0;
+      for (int k = 0; k < 8; k++)
+        any |= blk[k];
+      if (any == 0)
+        m->Rank[index >> 9] = m->nbViable;
+      m->Viable[index >> 6] |= 1ULL << (index & 63);
+      set_score(m, m->nbViable++, score);
+    }
+    return 1;
+  }
+  for (int i = 1; i < NUCL; i++)
+    nb += viable_words(m, b, n + 1, (index << 2) | (unsigned int)(i - 1), score + m->pwm[b+n][i]);
+  return nb;
+}
+
+static int
+make_bitmap(pwm_p_t m, int b, unsigned int wsize)
+{
+  /* Make the viable word bitmap and the score array of viable words    */
+  unsigned int nb = viable_words(m, b, 1, 0, 0);
+
+  if ((m->Viable = (uint64_t *)calloc((size_t)wsize / 64, sizeof(uint64_t))) == NULL) {
+    perror("Viable: calloc");
     exit(1);
   }
-  for (j = 0; j < NUCL-1; j++) {
-    z[j+1] = j * (power(4, wordLen-1));
-    if (options.debug)
-      fprintf(stderr, "z[%d] = %d\n", j+1, z[j+1]);
+  if ((m->Rank = (unsigned int *)malloc((size_t)wsize / 512 * sizeof(unsigned int))) == NULL) {
+    perror("Rank: malloc");
+    exit(1);
   }
+  alloc_scores(m, (size_t)(nb > 0 ? nb : 1));
+  m->nbViable = 0;
+  viable_words(m, b, 1, 0, 0);
+  if (options.debug)
+    fprintf(stderr, "Matrix %s: %u viable words of length %d out of %u\n",
+        m->name, m->nbViable, m->wordLen, wsize);
+  return 0;
+}
+
+static int
+make_tables(pwm_p_t m)
+{
+  /* Make Word index and score table                                            */
+  /* Words of length wordLen are encoded as integers between 0 and 4^(wordLen)-1,*/
+  /* e.g. for wordLen=4 index(AAAA)=0, and index(TTTT)=255.                     */
+  /* The forward PWM (core region) scores of these words are stored in ScoreF.  */
+  /* The reverse score of a word is the forward score of its reverse complement */
+  /* (the reverse core region is the mirror image of the forward one), so that  */
+  /* a single table serves both strands.                                        */
+  unsigned int i; /* word index 0..4^(wordLen)-1 */
+  int j;
+  int n;
+  /* First PWM position of the word (core region, if any) minus one             */
+  int b = (m->wordLen != m->pwmLen) ? m->Bfw - 1 : 0;
+  /* Allocate memory for score array   */
+  unsigned int wsize = power(4, m->wordLen);
+  /* WordMask keeps the last wordLen bases of the word index e.g.: 0xff for wordLen=4 */
+  m->WordMask = wsize - 1;
+  /* The next reverse complement base enters the word index at bit RcShift      */
+  m->RcShift = 2 * (unsigned int)(m->wordLen - 1);
+  /* Long words: viable word bitmap (see make_bitmap)                           */
+  if (m->wordLen >= BITMAP_WORDLEN)
+    return make_bitmap(m, b, wsize);
+  /* Allocate forward score array                                               */
+  alloc_scores(m, (size_t)wsize);
   /* Allocate word array s[0..wordLen+1]: it stores the sequence (numerical form)*/
-  int *s = (int *) calloc((size_t)wordLen+1, sizeof(int));
+  int *s = (int *) calloc((size_t)m->wordLen+1, sizeof(int));
   if (s == NULL) {
     perror("s: calloc");
     exit(1);
   }
-  /* Allocate temp word score array xf[0..wordLen+1]/xr[0..wordLen+1]            */
-  int *xf = (int *) calloc((size_t)wordLen+1, sizeof(int));
+  /* Allocate temp word score array xf[0..wordLen+1]                            */
+  int *xf = (int *) calloc((size_t)m->wordLen+1, sizeof(int));
   if (xf == NULL) {
     perror("xf: calloc");
     exit(1);
   }
-  int *xr = (int *) calloc((size_t)wordLen+1, sizeof(int));
-  if (xr == NULL) {
-    perror("xr: calloc");
-    exit(1);
-  }
-  if (wordLen != pwmLen) {
-    if (options.forward) {
-      s[1] = 0;
-      n = 1; /* partial word lenght (1..wordLen)      */
-      xf[0] = 0;
-      i = 1;
-      while (n > 0) {
-        /* Loop over the entire word index            */
-        s[n]++;
-        /* Compute word score up to wordlen n         */
-        xf[n] = xf[n-1] + pwm[Bfw+n-1][s[n]];
-        /* Compute word score for the remaining part  */
-        for(j = n + 1; j <= wordLen; j++) {
-          n++;
-          s[n] = 1;   /* set character to A           */
-          xf[n] = xf[n-1] + pwm[Bfw+n-1][1];
-        }
-        /* Set word score and navigation link         */
-        ScoreF[i] = xf[n]; /*  n=wordLen              */
-#ifdef DEBUG
-        fprintf(stderr, "%u  ", i);
-        for (int k = 1; k <= wordLen; k++)
-          fprintf(stderr, "%d ", s[k]);
-        fprintf(stderr, "  %8d\n", ScoreF[i]);
-#endif
-        i++;
-        /* Keep decreasing n by 1 while s[n]=T        */
-        while(s[n] == 4)
-          n--;
-      }
-    } else { /* Scan both strands                     */
-      s[1] = 0;
-      n = 1; /* partial word lenght (1..wordLen)      */
-      xf[0] = 0;
-      xr[0] = 0;
-      i = 1;
-      /* Allocate reverse score array                 */
-      if ( (ScoreR = (int *)malloc((size_t)(wsize+1) * sizeof(int))) == NULL) {
-        perror("ScoreF: malloc");
-        exit(1);
-      }
-      while (n > 0) {
-        /* Loop over the entire word index            */
-        s[n]++;
-        /* Compute word score up to wordlen n         */
-        xf[n] = xf[n-1] + pwm[Bfw+n-1][s[n]];
-        xr[n] = xr[n-1] + pwm_r[Brv+n-1][s[n]];
-        /* Compute word score for the remaining part  */
-        for(j = n + 1; j <= wordLen; j++) {
-          n++;
-          s[n] = 1;   /* set character to A           */
-          xf[n] = xf[n-1] + pwm[Bfw+n-1][1];
-          xr[n] = xr[n-1] + pwm_r[Brv+n-1][1];
-        }
-        /* Set word scores and navigation link        */
-        ScoreF[i] = xf[n];  /* n=wordLen              */
-        ScoreR[i] = xr[n];  /* n=wordLen              */
-#ifdef DEBUG
-        fprintf(stderr, "%u  ", i);
-        for (int k = 1; k <= wordLen; k++)
-          fprintf(stderr, "%d ", s[k]);
-        fprintf(stderr, "  %8d  %8d\n", ScoreF[i], ScoreR[i]);
-#endif
-        i++;
-        /* Keep decreasing n by 1 while s[n]=T        */
-        while(s[n] == 4)
-          n--;
-      }
+  s[1] = 0;
+  n = 1; /* partial word lenght (1..wordLen)      */
+  xf[0] = 0;
+  i = 0;
+  while (n > 0) {
+    /* Loop over the entire word index            */
+    s[n]++;
+    /* Compute word score up to wordlen n         */
+    xf[n] = xf[n-1] + m->pwm[b+n][s[n]];
+    /* Compute word score for the remaining part  */
+    for(j = n + 1; j <= m->wordLen; j++) {
+      n++;
+      s[n] = 1;   /* set character to A           */
+      xf[n] = xf[n-1] + m->pwm[b+n][1];
     }
-  } else { /* PWM lenght and word lenght are the same */
-    if (options.forward) {
-      s[1] = 0;
-      n = 1; /* partial word lenght (1..wordLen)      */
-      xf[0] = 0;
-      i = 1;
-      while (n > 0) {
-        /* Loop over the entire word index            */
-        s[n]++;
-        /* Compute word score up to wordlen n         */
-        xf[n] = xf[n-1] + pwm[n][s[n]];
-        /* Compute word score for the remaining part  */
-        for(j = n + 1; j <= wordLen; j++) {
-          n++;
-          s[n] = 1;   /* set character to A           */
-          xf[n] = xf[n-1] + pwm[n][1];
-        }
-        /* Set word score                             */
-        ScoreF[i] = xf[n];  /* n=wordLen              */
-#ifdef DEBUG
-        fprintf(stderr, "%u  ", i);
-        for (int k = 1; k <= wordLen; k++)
-          fprintf(stderr, "%d ", s[k]);
-        fprintf(stderr, "  %8d\n", ScoreF[i]);
-#endif
-        i++;
-        /* Keep decreasing n by 1 while s[n]=T        */
-        while(s[n] == 4)
-          n--;
-      }
-    } else { /* Scan both strands                     */
-      s[1] = 0;
-      n = 1; /* partial word lenght (1..wordLen)      */
-      xf[0] = 0;
-      xr[0] = 0;
-      i = 1;
-      /* Allocate reverse score array                 */
-      if ( (ScoreR = (int *)malloc((size_t)(wsize+1) * sizeof(int))) == NULL) {
-        perror("ScoreF: malloc");
-        exit(1);
-      }
-      while (n > 0) {
-        /* Loop over the entire word index            */
-        s[n]++;
-        /* Compute word score up to wordlen n         */
-        xf[n] = xf[n-1] + pwm[n][s[n]];
-        xr[n] = xr[n-1] + pwm_r[n][s[n]];
-        /* Compute word score for the remaining part  */
-        for(j = n + 1; j <= wordLen; j++) {
-          n++;
-          s[n] = 1;   /* set character to A           */
-          xf[n] = xf[n-1] + pwm[n][1];
-          xr[n] = xr[n-1] + pwm_r[n][1];
-        }
-        /* Set word scores                            */
-        ScoreF[i] = xf[n];  /* n=wordLen              */
-        ScoreR[i] = xr[n];  /* n=wordLen              */
+    /* Set word score                             */
+    set_score(m, i, xf[n]); /*  n=wordLen            */
 #ifdef DEBUG
-        fprintf(stderr, "%u  ", i);
-        for (int k = 1; k <= wordLen; k++)
-          fprintf(stderr, "%d ", s[k]);
-        fprintf(stderr, "  %8d  %8d\n", ScoreF[i], ScoreR[i]);
+    fprintf(stderr, "%u  ", i);
+    for (int k = 1; k <= m->wordLen; k++)
+      fprintf(stderr, "%d ", s[k]);
+    fprintf(stderr, "  %8d\n", xf[n]);
 #endif
-        i++;
-        /* Keep decreasing n by 1 while s[n]=T        */
-        while(s[n] == 4)
-          n--;
-      }
-    }
+    i++;
+    /* Keep decreasing n by 1 while s[n]=T        */
+    while(s[n] == 4)
+      n--;
   }
   free(s);
   free(xf);
-  free(xr);
   return 0;
 }
 
-static unsigned int
-word_index(seq_p_t seq, unsigned int j)
+static void
+free_tables(pwm_p_t m)
 {
-  /* Compute index for word startind at sequence position j */
-  unsigned int k = j + wordLen -1;
-  unsigned int index = 1;
-  int base = 1;
-  while(k >= j) {
-    index += (seq->seq[k] -1) * base;
-    k--;
-    base = base << 2;
+  /* Free the word score tables and the lateral blocks */
+  free(m->ScoreF);
+  free(m->Score16);
+  free(m->Viable);
+  free(m->Rank);
+  m->ScoreF = NULL;
+  m->Score16 = NULL;
+  m->Viable = NULL;
+  m->Rank = NULL;
+  for (int k = 0; k < m->nbBlk; k++) {
+    free(m->Kfw[k].tab);
+    if (m->Krv != NULL)
+      free(m->Krv[k].tab);
   }
-  return index;
+  free(m->Kfw);
+  free(m->Krv);
+  m->Kfw = NULL;
+  m->Krv = NULL;
+  m->nbBlk = 0;
 }
 
-/* Scanning functions */
+/* Automatic word length (-i auto)                                      */
+/* The cost per base of each word length is predicted from the size of  */
+/* the score table against the data cache sizes, and from the expected  */
+/* number of lateral block lookups under the background model.          */
 static void
-scan_seq_1f(seq_p_t seq)
-{
-  if (seq->len >= (unsigned long)pwmLen) { /*      Forward Scanning          */
-    unsigned int j = 0;
-    seq->seq[0] = 0;
-    unsigned int i = 0;
-
-    while (j <= seq->len) {    /* Loop through the entire sequence           */
-      if (seq->seq[j] == 0) {  /* Check if beginning of the process          */
-        int n = 0;             /* or we found an N                           */
-        while ((n < pwmLen) && (j < seq->len)) {
-          /* This loop serves to find the end position (j) of the next       */
-          /* that doesn's contain any N's (i.e. seq[j]=0)                    */
-          /* The loop terminates when either a word without N's is found     */
-          /* (i.e. n=8) or the end of teh sequence (j=seq->len) is reached   */
-          j++;
-          if (seq->seq[j] == 0) /* Check whether we have N's and keep        */
-            n = 0;              /* incrementing j (n stays at 0 if N)        */
-          else
-            n++;                /* increment n if found ACGT base            */
-        }
-        if (n < pwmLen)   /* It is used to break the scanning loop           */
-          break;          /* in case the last characters are N's             */
-        /* Compute word index */
-        i = word_index(seq, j - pwmLen + 1);
-      } else { /* We are not at the beginning of the scanning process        */
-               /* Compute next word index (after shifting by 1 bp)           */
-               /* using the previous word index and the z link array         */
-        i = ((i -z[seq->seq[j-pwmLen]] -1)<<2) + seq->seq[j];
-      }
-      /* Check for match (j points to the end of candidate sequence)         */
-      int score = ScoreF[i];
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j-pwmLen+1; k <= j; k++)
-          printf("%c", nucleotide[seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t+\n", score);
-      }
-      /* Move on to the next position                                        */
-      j++;
-    } /* Scanning loop                                                       */
+read_cache_sizes()
+{
+  /* Read the data cache sizes of cpu0 from sysfs (the defaults are */
+  /* kept if they are not available)                                */
+  for (int k = 0; k < 8; k++) {
+    char path[128];
+    char buf[64];
+    int level = 0;
+    double size = 0;
+    char unit = 0;
+    FILE *f;
+
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/type", k);
+    if ((f = fopen(path, "r")) == NULL)
+      break;
+    if (fgets(buf, sizeof(buf), f) == NULL || strncmp(buf, "Instruction", 11) == 0) {
+      fclose(f);
+      continue;
+    }
+    fclose(f);
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/level", k);
+    if ((f = fopen(path, "r")) != NULL) {
+      if (fscanf(f, "%d", &level) != 1)
+        level = 0;
+      fclose(f);
+    }
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu0/cache/index%d/size", k);
+    if ((f = fopen(path, "r")) != NULL) {
+      if (fscanf(f, "%lf%c", &size, &unit) < 1)
+        size = 0;
+      fclose(f);
+    }
+    if (unit == 'K')
+      size *= 1024;
+    else if (unit == 'M')
+      size *= 1024 * 1024;
+    if (level >= 1 && level <= 3 && size > 0)
+      cacheSize[level] = size;
   }
+  if (options.debug)
+    fprintf(stderr, "Data cache sizes: L1 %.0fK, L2 %.0fK, L3 %.0fK\n",
+        cacheSize[1] / 1024, cacheSize[2] / 1024, cacheSize[3] / 1024);
 }
 
-static void
-scan_seq_1(seq_p_t seq)
-{
-  if (seq->len >= (unsigned long)pwmLen) { /*    Bidirectional Scanning      */
-    unsigned int j = 0;
-    seq->seq[0] = 0;
-    unsigned int i = 0;
-
-    while (j <= seq->len) {    /* Loop through the entire sequence           */
-      if (seq->seq[j] == 0) {  /* Check if beginning of the process          */
-        int n = 0;             /* or we found an N                           */
-        while ((n < pwmLen) && (j < seq->len)) {
-          /* This loop serves to find the end position (j) of the next       */
-          /* that doesn's contain any N's (i.e. seq[j]=0)                    */
-          /* The loop terminates when either a word without N's is found     */
-          /* (i.e. n=8) or the end of teh sequence (j=seq->len) is reached   */
-          j++;
-          if (seq->seq[j] == 0) /* Check whether we have N's and keep        */
-            n = 0;              /* incrementing j (n stays at 0 if N)        */
-          else
-            n++;                /* increment n if found ACGT base            */
-        }
-        if (n < pwmLen)   /* It is used to break the scanning loop           */
-          break;          /* in case the last characters are N's             */
-        /* Compute word index */
-        i = word_index(seq, j - pwmLen + 1);
-      } else { /* We are not at the beginning of the scanning process        */
-               /* Compute next word index (after shifting by 1 bp)           */
-               /* using the previous word index and the z link array         */
-        i = ((i -z[seq->seq[j-pwmLen]] -1)<<2) + seq->seq[j];
-      }
-      /* Check for match (j points to the end of candidate sequence)         */
-      /* Score in forward direction                                          */
-      int score = ScoreF[i];
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j-pwmLen+1; k <= j; k++)
-          printf("%c", nucleotide[seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t+\n", score);
-      }
-      /* Score in reverse direction                                          */
-      score = ScoreR[i];
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j; k > j-pwmLen; k--)
-          printf("%c", nucleotide[NUCL-seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t-\n", score);
-      }
-      /* Move on to the next position                                        */
-      j++;
-    } /* Scanning loop                                                       */
+static double
+table_cost(double size)
+{
+  /* Average cost of a random lookup in a table of size bytes. The   */
+  /* tables get half of each cache (the other half holds the          */
+  /* sequence and the output), shared by the tables of a library.    */
+  static const double lat[4] = {0, COST_L1, COST_L2, COST_L3};
+  double cost = 0;
+  double hit = 0;
+
+  for (int k = 1; k <= 3; k++) {
+    double h = cacheSize[k] / 2 / nbPwms / size;
+    if (h > 1)
+      h = 1;
+    if (h > hit) {
+      cost += (h - hit) * lat[k];
+      hit = h;
+    }
   }
+  return cost + (1 - hit) * COST_MEM;
 }
 
-static void
-scan_seq_2f(seq_p_t seq)  /* Word index length is smaller than pwm length    */
-{
-  if (seq->len >= (unsigned long)pwmLen) { /*      Forward Scanning          */
-    int diff = pwmLen - wordLen;
-    /* Indexes of most relevant PWM positions relative to the end of the PWM */
-    int *Ifw = (int *) calloc((size_t)diff, sizeof(int));
-    for (int k = 0; k < diff; k++)
-      Ifw[k] = Rfw[k] - pwmLen;
-    /* Re-define forward core region relative to the end of the PWM          */
-    int Bfw_rel = Bfw - pwmLen;
-    int Efw_rel = Efw - pwmLen;
-
-    unsigned int j = 0;
-    seq->seq[0] = 0;
-    unsigned int i = 0;
-
-    while (j <= seq->len) {    /* Loop through the entire sequence           */
-      if (seq->seq[j] == 0) {  /* Check if beginning of the process          */
-        int n = 0;             /* or we found an N                           */
-        while ((n < pwmLen) && (j < seq->len)) {
-          /* This loop serves to find the end position (j) of the next       */
-          /* that doesn's contain any N's (i.e. seq[j]=0)                    */
-          /* The loop terminates when either a word without N's is found     */
-          /* (i.e. n=8) or the end of teh sequence (j=seq->len) is reached   */
-          j++;
-          if (seq->seq[j] == 0) /* Check whether we have N's and keep        */
-            n = 0;              /* incrementing j (n stays at 0 if N)        */
-          else
-            n++;                /* increment n if found ACGT base            */
-        }
-        if (n < pwmLen)   /* It is used to break the scanning loop           */
-          break;          /* in case the last characters are N's             */
-        /* Compute word index */
-        i = word_index(seq, j + Bfw_rel);
-      } else { /* We are not at the beginning of the scanning process        */
-               /* Compute next word index (after shifting by 1 bp)           */
-               /* using the previous word index and the z link array         */
-        i = ((i -z[seq->seq[j+Bfw_rel-1]] -1)<<2) + seq->seq[j+Efw_rel];
-      }
-      /* Check for match (j points to the end of candidate sequence)         */
-      int score = ScoreF[i];
-      /* Complete score computation with the remaining PWM positions         */
-      int k = 0;
-      while (score >= cutOff && k < diff) {
-        score += pwm[Rfw[k]][seq->seq[j+Ifw[k]]];
-        k++;
-      }
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j-pwmLen+1; k <= j; k++)
-          printf("%c", nucleotide[seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t+\n", score);
+static double
+survival(double *dist, double *tmp, int nbins, int g, int **pwm, int b, int e)
+{
+  /* Add PWM positions b..e to the distribution of the score deficit  */
+  /* (bins of g score units below zero), dropping the candidates that */
+  /* fall below the cut-off. Return the probability mass left.        */
+  double left = 0;
+
+  for (int p = b; p <= e; p++) {
+    for (int d = 0; d < nbins; d++)
+      tmp[d] = 0;
+    for (int d = 0; d < nbins; d++) {
+      if (dist[d] == 0)
+        continue;
+      for (int i = 1; i < NUCL; i++) {
+        int d2 = d + (-pwm[p][i] + g / 2) / g;
+        if (d2 < nbins)
+          tmp[d2] += dist[d] * bgcomp[i];
       }
-      /* Move on to the next position                                        */
-      j++;
-    } /* Scanning loop                                                       */
+    }
+    memcpy(dist, tmp, (size_t)nbins * sizeof(double));
   }
+  for (int d = 0; d < nbins; d++)
+    left += dist[d];
+  return left;
 }
 
-static void
-scan_seq_2(seq_p_t seq)   /* Word index length is smaller than pwm length    */
-{
-  if (seq->len >= (unsigned long)pwmLen) { /*   Bidirectional Scanning       */
-    int diff = pwmLen - wordLen;
-    /* Indexes of most relevant PWM positions relative to the end of the PWM */
-    int *Ifw = (int *) calloc((size_t)diff, sizeof(int));
-    int *Irv = (int *) calloc((size_t)diff, sizeof(int));
-    for (int k = 0; k < diff; k++) {
-      Ifw[k] = Rfw[k] - pwmLen;
-      Irv[k] = Rrv[k] - pwmLen;
-    }
-    /* Re-define forward/rev core regions relative to the end of the PWM     */
-    int Bfw_rel = Bfw - pwmLen;
-    int Efw_rel = Efw - pwmLen;
-    int Brv_rel = Brv - pwmLen;
-    int Erv_rel = Erv - pwmLen;
-
-    unsigned int j = 0;
-    seq->seq[0] = 0;
-    unsigned int ifw = 0;
-    unsigned int irv = 0;
-
-    while (j <= seq->len) {    /* Loop through the entire sequence           */
-      if (seq->seq[j] == 0) {  /* Check if beginning of the process          */
-        int n = 0;             /* or we found an N                           */
-        while ((n < pwmLen) && (j < seq->len)) {
-          /* This loop serves to find the end position (j) of the next       */
-          /* that doesn's contain any N's (i.e. seq[j]=0)                    */
-          /* The loop terminates when either a word without N's is found     */
-          /* (i.e. n=8) or the end of teh sequence (j=seq->len) is reached   */
-          j++;
-          if (seq->seq[j] == 0) /* Check whether we have N's and keep        */
-            n = 0;              /* incrementing j (n stays at 0 if N)        */
-          else
-            n++;                /* increment n if found ACGT base            */
-        }
-        if (n < pwmLen)   /* It is used to break the scanning loop           */
-          break;          /* in case the last characters are N's             */
-        /* Compute word index */
-        ifw = word_index(seq, j + Bfw_rel);
-        irv = word_index(seq, j + Brv_rel);
-      } else { /* We are not at the beginning of the scanning process        */
-               /* Compute next word index (after shifting by 1 bp)           */
-               /* using the previous word index and the z link array         */
-        ifw = ((ifw -z[seq->seq[j+Bfw_rel-1]] -1)<<2) + seq->seq[j+Efw_rel];
-        irv = ((irv -z[seq->seq[j+Brv_rel-1]] -1)<<2) + seq->seq[j+Erv_rel];
-      }
-      /* Check for match (j points to the end of candidate sequence)         */
-
-      /* Score in forward direction                                          */
-      int score = ScoreF[ifw];
-      /* Complete score computation with the remaining PWM positions         */
-      int k = 0;
-      while (score >= cutOff && k < diff) {
-        score += pwm[Rfw[k]][seq->seq[j+Ifw[k]]];
-        k++;
-      }
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j-pwmLen+1; k <= j; k++)
-          printf("%c", nucleotide[seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t+\n", score);
-      }
+static double
+any_alive(double alive)
+{
+  /* Probability that one of simdLanes candidates is left */
+  double none = 1;
+  for (int l = 0; l < simdLanes; l++)
+    none *= 1 - alive;
+  return 1 - none;
+}
 
-      /* Score in reverse direction                                          */
-      score = ScoreR[irv];
-      /* Complete score computation with the remaining PWM positions         */
-      k = 0;
-      while (score >= cutOff && k < diff) {
-        score += pwm_r[Rrv[k]][seq->seq[j+Irv[k]]];
-        k++;
-      }
-      if (score >= cutOff) {
-        score = score + Offset;
-        unsigned int pos = j;
-        printf("%s\t%u\t%u\t", seq->hdr, pos-pwmLen, pos);
-        /* print word */
-        unsigned int k = 0;
-        for (k = j; k > j-pwmLen; k--)
-          printf("%c", nucleotide[NUCL-seq->seq[k]]);
-        /* print score */
-        printf("\t%d\t-\n", score);
-      }
-      /* Move on to the next position                                        */
-      j++;
-    } /* Scanning loop                                                       */
+static double
+predict_cost(pwm_p_t m, int L, double *dist, double *tmp, int nbins, int g)
+{
+  /* Predicted cost per base (both strands) of word length L */
+  int strands = options.forward ? 1 : 2;
+  double pass = 0;
+  double cost = 0;
+  double size;
+
+  m->wordLen = L;
+  if (L < m->pwmLen)
+    define_search_strategy(m);
+  for (int r = 0; r < strands; r++) {
+    int **pwm = r ? m->pwm_r : m->pwm;
+    latblk_t *blk = r ? m->Krv : m->Kfw;
+    int b = 1;
+    int e = m->pwmLen;
+
+    if (L < m->pwmLen) {
+      b = r ? m->Brv : m->Bfw;
+      e = r ? m->Erv : m->Efw;
+    }
+    for (int d = 0; d < nbins; d++)
+      dist[d] = 0;
+    dist[0] = 1;
+    double alive = survival(dist, tmp, nbins, g, pwm, b, e);
+    if (r == 0)
+      pass = alive;
+    /* The lateral blocks are looked up for simdLanes candidates at */
+    /* once, as long as one of them is left                         */
+    if (m->nbBlk > 0)
+      cost += COST_DROP * any_alive(alive) / simdLanes;
+    for (int k = 0; k < m->nbBlk && alive > 0; k++) {
+      cost += COST_BLOCK * any_alive(alive) / simdLanes;
+      int first = blk[k].off + m->pwmLen;
+      alive = survival(dist, tmp, nbins, g, pwm, first, first + __builtin_popcount(blk[k].mask) / 2 - 1);
+    }
+  }
+  if (L >= BITMAP_WORDLEN) {
+    /* Bitmap and (estimated) viable word scores */
+    size = (double)power(4, (unsigned int)L) / 8 + (double)power(4, (unsigned int)L) * pass * 2;
+    cost += strands * COST_BITMAP;
+  } else {
+    size = (double)power(4, (unsigned int)L) * ((m->cutOff > SCORE16_FAIL) ? 2 : 4);
   }
+  cost += strands * table_cost(size);
+  free_tables(m);
+  free(m->Rfw);
+  free(m->Rrv);
+  m->Rfw = NULL;
+  m->Rrv = NULL;
+  return cost;
 }
 
-/* String parser function */
-char** str_split(char* a_str, const char a_delim)
+static int
+auto_wordlen(pwm_p_t m)
 {
-    char** result = 0;
-    size_t count = 0;
+  /* Word length of PWM m with the lowest predicted cost per base */
+  int maxL = (m->pwmLen < 15) ? m->pwmLen : 15;
+  int minL = (m->pwmLen < AUTO_MINLEN) ? m->pwmLen : AUTO_MINLEN;
+  int best = (m->pwmLen < 7) ? m->pwmLen : 7;
+  double min = 0;
+
+  if (m->cutOff > 0)  /* No match is possible */
+    return best;
+  int g = -m->cutOff / AUTO_BINS + 1;
+  int nbins = -m->cutOff / g + 1;
+  double *dist = (double *) malloc((size_t)nbins * sizeof(double));
+  double *tmp = (double *) malloc((size_t)nbins * sizeof(double));
+  if (dist == NULL || tmp == NULL) {
+    perror("auto_wordlen: malloc");
+    exit(1);
+  }
+  for (int L = minL; L <= maxL; L++) {
+    double cost = predict_cost(m, L, dist, tmp, nbins, g);
+    if (options.debug)
+      fprintf(stderr, "Matrix %s: word length %d, predicted cost %.1f cycles/base\n",
+          m->name, L, cost);
+    if (L == minL || cost < min) {
+      min = cost;
+      best = L;
+    }
+  }
+  free(dist);
+  free(tmp);
+  return best;
+}
+
+/* Packed sequence access functions */
+static inline unsigned int
+get_base(seq_p_t seq, unsigned int j)
+{
+  /* Return the 2-bit code (A=0,C=1,G=2,T=3) of the base at position j */
+  return PACK_BASE(seq->seq, j);
+}
+
+static int
+first_nrun(seq_p_t seq, unsigned int pos)
+{
+  /* Binary search for the first N-run that ends at or after pos */
+  int lo = 0;
+  int hi = seq->nbRuns;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (seq->nrun[mid].end < pos)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  return lo;
+}
+
+static int
+next_segment(seq_p_t seq, int *r, unsigned int *beg, unsigned int *end, unsigned int to, int len)
+{
+  /* Find the next stretch [beg..end] of ACGT bases within [beg..to]    */
+  /* that is long enough to hold a match of length len (r is the index  */
+  /* of the next N-run). Return 0 if there is no such stretch.          */
+  while (1) {
+    /* Skip N-runs covering the beginning of the stretch */
+    while (*r < seq->nbRuns && seq->nrun[*r].beg <= *beg) {
+      if (seq->nrun[*r].end >= *beg)
+        *beg = seq->nrun[*r].end + 1;
+      (*r)++;
+    }
+    if (*beg > to || to - *beg + 1 < (unsigned int)len)
+      return 0;
+    *end = to;
+    if (*r < seq->nbRuns && seq->nrun[*r].beg <= to)
+      *end = seq->nrun[*r].beg - 1;
+    if (*end - *beg + 1 >= (unsigned int)len)
+      return 1;
+    *beg = *end + 1;
+  }
+}
+
+static unsigned int
+word_index(pwm_p_t m, seq_p_t seq, unsigned int j)
+{
+  /* Compute index for word startind at sequence position j */
+  unsigned int index = 0;
+  for (unsigned int k = j; k < j + m->wordLen; k++)
+    index = (index << 2) | get_base(seq, k);
+  return index;
+}
+
+static inline int
+score_at(pwm_p_t m, unsigned int r)
+{
+  /* A 16-bit SCORE16_FAIL is below the cut-off, as is SCORE_FAIL      */
+  return (m->Score16 != NULL) ? m->Score16[r] : m->ScoreF[r];
+}
+
+static inline int
+word_score(pwm_p_t m, unsigned int i)
+{
+  /* Core score of word i, or SCORE_FAIL if the word cannot reach the */
+  /* cut-off (viable word bitmap)                                     */
+  if (m->Viable == NULL)
+    return score_at(m, i);
+  const uint64_t *blk = m->Viable + ((i >> 6) & ~7u);
+  unsigned int w = (i >> 6) & 7;
+  uint64_t bit = 1ULL << (i & 63);
+  if ((blk[w] & bit) == 0)
+    return SCORE_FAIL;
+  unsigned int r = m->Rank[i >> 9];
+  for (unsigned int k = 0; k < w; k++)
+    r += (unsigned int)__builtin_popcountll(blk[k]);
+  r += (unsigned int)__builtin_popcountll(blk[w] & (bit - 1));
+  return score_at(m, r);
+}
+
+static unsigned int
+word_index_rc(pwm_p_t m, seq_p_t seq, unsigned int j)
+{
+  /* Compute index of the reverse complement of the word starting at j */
+  unsigned int index = 0;
+  for (unsigned int k = j + m->wordLen; k > j; k--)
+    index = (index << 2) | (3 - get_base(seq, k - 1));
+  return index;
+}
+
+static inline int
+block_score(const latblk_t *blk, const unsigned char *s, unsigned int j)
+{
+  /* Weight of the bases of lateral block blk for the candidate ending */
+  /* at j, read from a single 32-bit load of the packed sequence       */
+  unsigned int p = j + (unsigned int)blk->off;
+  uint32_t w;
+  memcpy(&w, s + (p >> 2), sizeof(w));
+  return blk->tab[(w >> ((p & 3) << 1)) & blk->mask];
+}
+
+#ifdef HAVE_SIMD
+/* Vectorized lateral scoring kernels                                   */
+/* Candidates ending at positions j..j+n-1 (n = 8 for AVX2, 4 for SSE4) */
+/* are completed with the lateral blocks, in rank order. The bases of   */
+/* block k for all candidates are read from a single 32-bit load of the */
+/* packed sequence and used to look up the block weights                */
+/* (blk[k].tab). Since all weights are <= 0 after rescaling, a          */
+/* candidate that falls below the cut-off can be dropped: the loop      */
+/* stops as soon as no candidate is left. Returns the bit mask of the   */
+/* candidates whose score (updated in score[]) reaches the cut-off.     */
+__attribute__((target("avx2")))
+static unsigned int
+lateral_avx2(const latblk_t *blk, int nb,
+    const unsigned char *s, unsigned int j, int *score, int cutOff)
+{
+  const __m256i shift = _mm256_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14);
+  const __m256i co = _mm256_set1_epi32(cutOff);
+  __m256i sc = _mm256_loadu_si256((const __m256i *)score);
+  unsigned int alive = ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(co, sc))) & 0xFF;
+
+  for (int k = 0; k < nb && alive; k++) {
+    unsigned int p = j + (unsigned int)blk[k].off;
+    uint32_t w;
+    memcpy(&w, s + (p >> 2), sizeof(w));
+    w >>= (p & 3) << 1;
+    __m256i x = _mm256_and_si256(_mm256_srlv_epi32(_mm256_set1_epi32((int)w), shift),
+        _mm256_set1_epi32((int)blk[k].mask));
+    sc = _mm256_add_epi32(sc, _mm256_i32gather_epi32(blk[k].tab, x, 4));
+    alive = ~(unsigned int)_mm256_movemask_ps(_mm256_castsi256_ps(_mm256_cmpgt_epi32(co, sc))) & 0xFF;
+  }
+  _mm256_storeu_si256((__m256i *)score, sc);
+  return alive;
+}
+
+__attribute__((target("sse4.1")))
+static unsigned int
+lateral_sse4(const latblk_t *blk, int nb,
+    const unsigned char *s, unsigned int j, int *score, int cutOff)
+{
+  /* No gather: the 4 block weights are looked up one by one          */
+  const __m128i co = _mm_set1_epi32(cutOff);
+  __m128i sc = _mm_loadu_si128((const __m128i *)score);
+  unsigned int alive = ~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(co, sc))) & 0xF;
+
+  for (int k = 0; k < nb && alive; k++) {
+    unsigned int p = j + (unsigned int)blk[k].off;
+    uint32_t w;
+    memcpy(&w, s + (p >> 2), sizeof(w));
+    w >>= (p & 3) << 1;
+    const int *t = blk[k].tab;
+    unsigned int mask = blk[k].mask;
+    __m128i x = _mm_setr_epi32(t[w & mask], t[(w >> 2) & mask],
+        t[(w >> 4) & mask], t[(w >> 6) & mask]);
+    sc = _mm_add_epi32(sc, x);
+    alive = ~(unsigned int)_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(co, sc))) & 0xF;
+  }
+  _mm_storeu_si128((__m128i *)score, sc);
+  return alive;
+}
+#endif
+
+static void
+init_lateral()
+{
+  /* Select the lateral scoring kernel supported by the CPU */
+#ifdef HAVE_SIMD
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    lateral = lateral_avx2;
+    simdLanes = 8;
+  } else if (__builtin_cpu_supports("sse4.1")) {
+    lateral = lateral_sse4;
+    simdLanes = 4;
+  }
+#endif
+  if (options.debug)
+    fprintf(stderr, "Lateral scoring kernel: %s\n",
+        simdLanes == 8 ? "AVX2" : simdLanes == 4 ? "SSE4.1" : "scalar");
+}
+
+/* Output functions                                                     */
+static void
+write_out(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      exit(1);
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}
+
+static void *
+writer(void *arg)
+{
+  /* Background writer: write out queued buffers in order */
+  (void)arg;
+  pthread_mutex_lock(&WriterLock);
+  while (1) {
+    while (wqCount == 0 && !WriterQuit)
+      pthread_cond_wait(&WriterWork, &WriterLock);
+    if (wqCount == 0)
+      break;
+    obuf_t b = WriterQueue[wqHead];
+    pthread_mutex_unlock(&WriterLock);
+    write_out(b.fd, b.buf, b.len);
+    free(b.buf);
+    pthread_mutex_lock(&WriterLock);
+    wqHead = (wqHead + 1) % OBUF_QUEUED;
+    wqCount--;
+    pthread_cond_signal(&WriterRoom);
+  }
+  pthread_mutex_unlock(&WriterLock);
+  return NULL;
+}
+
+static void
+ob_release(obuf_p_t ob, int fd)
+{
+  /* Hand the buffer contents over to fd and detach the buffer */
+  if (ob->len > 0 && bgWriter) {
+    pthread_mutex_lock(&WriterLock);
+    while (wqCount == OBUF_QUEUED)
+      pthread_cond_wait(&WriterRoom, &WriterLock);
+    obuf_p_t b = &WriterQueue[(wqHead + wqCount) % OBUF_QUEUED];
+    b->buf = ob->buf;
+    b->len = ob->len;
+    b->fd = fd;
+    wqCount++;
+    pthread_cond_signal(&WriterWork);
+    pthread_mutex_unlock(&WriterLock);
+  } else {
+    if (ob->len > 0)
+      write_out(fd, ob->buf, ob->len);
+    free(ob->buf);
+  }
+  ob->buf = NULL;
+  ob->len = 0;
+  ob->size = 0;
+}
+
+static void
+ob_flush(obuf_p_t ob)
+{
+  /* Write out the buffer contents (fd >= 0) */
+  if (ob->len == 0)
+    return;
+  if (bgWriter) {
+    size_t size = ob->size;
+    ob_release(ob, ob->fd);
+    if ((ob->buf = malloc(size)) == NULL) {
+      perror("ob_flush: malloc");
+      exit(1);
+    }
+    ob->size = size;
+  } else {
+    write_out(ob->fd, ob->buf, ob->len);
+    ob->len = 0;
+  }
+}
+
+static inline void
+ob_reserve(obuf_p_t ob, size_t n)
+{
+  /* Make room for n more bytes */
+  if (ob->len + n <= ob->size)
+    return;
+  if (ob->fd >= 0)
+    ob_flush(ob);
+  if (ob->len + n > ob->size) {
+    size_t size = (ob->size < 65536) ? 65536 : ob->size * 2;
+    while (size < ob->len + n)
+      size *= 2;
+    if ((ob->buf = realloc(ob->buf, size)) == NULL) {
+      perror("ob_reserve: realloc");
+      exit(1);
+    }
+    ob->size = size;
+  }
+}
+
+static void
+init_output()
+{
+  /* Build base decoding tables and allocate the output buffer */
+  for (int b = 0; b < 256; b++) {
+    for (int l = 0; l < 4; l++) {
+      Quad[b][l] = nucleotide[((b >> (2*l)) & 3) + 1];
+      QuadRc[b][3-l] = nucleotide[NUCL-1-((b >> (2*l)) & 3)];
+    }
+  }
+  if ((Out.buf = malloc(OBUF_SIZE)) == NULL) {
+    perror("init_output: malloc");
+    exit(1);
+  }
+  Out.size = OBUF_SIZE;
+  if (bgWriter && pthread_create(&Writer, NULL, writer, NULL) != 0) {
+    fprintf(stderr, "Could not create writer thread\n");
+    exit(1);
+  }
+}
+
+static void
+end_output()
+{
+  /* Flush the output and wait for the background writer */
+  ob_flush(&Out);
+  free(Out.buf);
+  if (bgWriter) {
+    pthread_mutex_lock(&WriterLock);
+    WriterQuit = 1;
+    pthread_cond_signal(&WriterWork);
+    pthread_mutex_unlock(&WriterLock);
+    pthread_join(Writer, NULL);
+  }
+}
+
+static inline char *
+put_uint(char *p, unsigned int v)
+{
+  char tmp[10];
+  int n = 0;
+  do {
+    tmp[n++] = (char)('0' + v % 10);
+    v /= 10;
+  } while (v);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
+
+static inline char *
+put_int(char *p, int v)
+{
+  if (v < 0) {
+    *p++ = '-';
+    return put_uint(p, 0u - (unsigned int)v);
+  }
+  return put_uint(p, (unsigned int)v);
+}
+
+static void
+put_match(obuf_p_t ob, pwm_p_t m, seq_p_t seq, unsigned int j, int score, int rev)
+{
+  /* Format the match ending at position j:                      */
+  /* seq_id  start  end  word  score  strand  [name  [p-value]]  */
+  /* or store it as a binary match record (-B)                   */
+  if (binOut) {
+    hit_t hit;
+    memset(&hit, 0, sizeof(hit));
+    hit.chrom = seq->id;
+    hit.start = seq->off + j - (unsigned int)m->pwmLen;
+    hit.score = score + m->Offset;
+    hit.pwm = (uint16_t)(m - Pwms);
+    hit.strand = rev ? '-' : '+';
+    ob_reserve(ob, sizeof(hit));
+    memcpy(ob->buf + ob->len, &hit, sizeof(hit));
+    ob->len += sizeof(hit);
+    return;
+  }
+  size_t hlen = strlen(seq->hdr);
+  size_t tlen = strlen(m->tag);
+  unsigned int first = j - m->pwmLen + 1;
+  unsigned int k;
+  char *p;
+
+  ob_reserve(ob, hlen + tlen + (size_t)m->pwmLen + 48 + PVAL_LEN);
+  p = ob->buf + ob->len;
+  memcpy(p, seq->hdr, hlen);
+  p += hlen;
+  *p++ = '\t';
+  p = put_uint(p, seq->off + first - 1);
+  *p++ = '\t';
+  p = put_uint(p, seq->off + j);
+  *p++ = '\t';
+  /* Word: copy 4 bases per packed byte where possible */
+  if (!rev) {
+    for (k = first; k <= j && (k & 3); k++)
+      *p++ = nucleotide[get_base(seq, k) + 1];
+    for (; k + 3 <= j; k += 4, p += 4)
+      memcpy(p, Quad[seq->seq[k >> 2]], 4);
+    for (; k <= j; k++)
+      *p++ = nucleotide[get_base(seq, k) + 1];
+  } else {
+    for (k = j; k >= first && (k & 3) != 3; k--)
+      *p++ = nucleotide[NUCL-1-get_base(seq, k)];
+    for (; k >= first + 3; k -= 4, p += 4)
+      memcpy(p, QuadRc[seq->seq[k >> 2]], 4);
+    for (; k >= first; k--)
+      *p++ = nucleotide[NUCL-1-get_base(seq, k)];
+  }
+  *p++ = '\t';
+  p = put_int(p, score + m->Offset);
+  *p++ = '\t';
+  *p++ = rev ? '-' : '+';
+  memcpy(p, m->tag, tlen);
+  p += tlen;
+  if (m->Pval != NULL) {
+    const char *pv = m->Pval + (size_t)(-score) * PVAL_LEN;
+    *p++ = '\t';
+    while (*pv)
+      *p++ = *pv++;
+  }
+  *p++ = '\n';
+  ob->len = (size_t)(p - ob->buf);
+}
+
+static void
+filter_match(obuf_p_t ob, pwm_p_t m, seq_p_t seq, unsigned int j, int score, int rev)
+{
+  /* Non-overlapping mode, same selection as filterOverlaps: a match  */
+  /* starting at most pwmLen bases after the pending match replaces   */
+  /* it if it scores higher, and is dropped otherwise. Matches of a   */
+  /* PWM come in position order (forward strand first), so that only  */
+  /* the pending match needs to be kept.                              */
+  if (m->BestJ != 0 && j <= m->BestJ + (unsigned int)m->pwmLen) {
+    if (score > m->BestScore) {
+      m->BestJ = j;
+      m->BestScore = score;
+      m->BestRev = rev;
+    }
+    return;
+  }
+  if (m->BestJ != 0)
+    put_match(ob, m, seq, m->BestJ, m->BestScore, m->BestRev);
+  m->BestJ = j;
+  m->BestScore = score;
+  m->BestRev = rev;
+}
+
+static void
+flush_matches(obuf_p_t ob, seq_p_t seq)
+{
+  /* Output the pending matches at the end of a sequence */
+  for (int k = 0; k < nbPwms; k++) {
+    pwm_p_t m = &Pwms[k];
+    if (m->BestJ != 0)
+      put_match(ob, m, seq, m->BestJ, m->BestScore, m->BestRev);
+    m->BestJ = 0;
+  }
+}
+
+static int
+top_cmp(const topm_t *a, const topm_t *b)
+{
+  /* Rank order: > 0 if match a ranks after match b */
+  if (a->score != b->score)
+    return (a->score < b->score) ? 1 : -1;
+  if (a->id != b->id)
+    return (a->id > b->id) ? 1 : -1;
+  if (a->pos != b->pos)
+    return (a->pos > b->pos) ? 1 : -1;
+  return a->rev - b->rev;
+}
+
+static int
+top_sort(const void *a, const void *b)
+{
+  return top_cmp((const topm_t *)a, (const topm_t *)b);
+}
+
+static void
+top_match(topk_p_t t, pwm_p_t m, seq_p_t seq, unsigned int j, int score, int rev)
+{
+  /* Keep the match if it ranks among the K best of heap t */
+  topm_t x = {score, seq->id, seq->off + j, rev, NULL, 0};
+  topm_p_t h = t->heap;
+  int i;
+
+  if (t->nb == topK && top_cmp(&x, &h[0]) >= 0)
+    return;
+  /* Format the match into a buffer of its own */
+  size_t size = strlen(seq->hdr) + strlen(m->tag) + (size_t)m->pwmLen + 48 + PVAL_LEN + sizeof(hit_t);
+  obuf_t ob = {NULL, 0, size, -1, NULL};
+  if ((ob.buf = malloc(size)) == NULL) {
+    perror("top_match: malloc");
+    exit(1);
+  }
+  put_match(&ob, m, seq, j, score, rev);
+  x.line = ob.buf;
+  x.len = ob.len;
+  if (t->nb < topK) {
+    /* Sift up from a new leaf */
+    i = t->nb++;
+    while (i > 0 && top_cmp(&x, &h[(i-1)/2]) > 0) {
+      h[i] = h[(i-1)/2];
+      i = (i-1)/2;
+    }
+  } else {
+    /* Replace the root and sift down */
+    free(h[0].line);
+    i = 0;
+    while (2*i+1 < t->nb) {
+      int c = 2*i+1;
+      if (c+1 < t->nb && top_cmp(&h[c+1], &h[c]) > 0)
+        c++;
+      if (top_cmp(&h[c], &x) <= 0)
+        break;
+      h[i] = h[c];
+      i = c;
+    }
+  }
+  h[i] = x;
+  if (t->nb == topK && h[0].score > t->cut) {
+    /* Matches below the worst one kept cannot make it to the top K */
+    pthread_mutex_lock(&TopLock);
+    if (h[0].score > m->TopCut)
+      m->TopCut = h[0].score;
+    t->cut = m->TopCut;
+    pthread_mutex_unlock(&TopLock);
+  }
+}
+
+static inline int
+scan_cutoff(obuf_p_t ob, pwm_p_t m)
+{
+  /* Cut-off of the scan of m by the thread owning buffer ob */
+  return (ob->top != NULL) ? ob->top[m - Pwms].cut : m->cutOff;
+}
+
+static void
+put_top()
+{
+  /* Merge the heaps of the threads and output the K best matches */
+  /* of each PWM, by decreasing score                             */
+  topm_p_t all = (topm_p_t) malloc((size_t)nbThreads * (size_t)topK * sizeof(topm_t));
+
+  if (all == NULL) {
+    perror("put_top: malloc");
+    exit(1);
+  }
+  for (int k = 0; k < nbPwms; k++) {
+    int n = 0;
+    for (int t = 0; t < nbThreads; t++) {
+      topk_p_t h = &TopHeaps[t * nbPwms + k];
+      memcpy(all + n, h->heap, (size_t)h->nb * sizeof(topm_t));
+      n += h->nb;
+      free(h->heap);
+    }
+    qsort(all, (size_t)n, sizeof(topm_t), top_sort);
+    for (int i = 0; i < n; i++) {
+      if (i < topK) {
+        ob_reserve(&Out, all[i].len);
+        memcpy(Out.buf + Out.len, all[i].line, all[i].len);
+        Out.len += all[i].len;
+      }
+      free(all[i].line);
+    }
+  }
+  free(all);
+  free(TopHeaps);
+}
+
+static inline void
+report_match(obuf_p_t ob, pwm_p_t m, seq_p_t seq, unsigned int j, int score, int rev)
+{
+  if (ob->top != NULL) {
+    top_match(&ob->top[m - Pwms], m, seq, j, score, rev);
+  } else if (!nonOverlap) {
+    put_match(ob, m, seq, j, score, rev);
+  } else if (ob->fd < 0) {
+    /* Chunk buffer: store a match record, filtered on release */
+    mrec_t rec = {j, score, (unsigned short)(m - Pwms), (unsigned short)rev};
+    ob_reserve(ob, sizeof(rec));
+    memcpy(ob->buf + ob->len, &rec, sizeof(rec));
+    ob->len += sizeof(rec);
+  } else {
+    filter_match(ob, m, seq, j, score, rev);
+  }
+}
+
+/* Scanning functions                                                   */
+/* The chunk [from..to] is scanned one N-free stretch at a time. Within */
+/* a stretch, the word index is updated by shifting in the next packed  */
+/* base and masking out the base that falls off the word.               */
+static void
+scan_seq_1f(pwm_p_t m, seq_p_t seq, unsigned int from, unsigned int to, obuf_p_t out)
+{
+  int r = first_nrun(seq, from);
+  unsigned int beg = from;
+  unsigned int end = 0;
+
+  while (next_segment(seq, &r, &beg, &end, to, m->pwmLen)) { /*   Forward Scanning    */
+    int cut = scan_cutoff(out, m);
+    /* Compute word index of the first word of the stretch                 */
+    unsigned int j = beg + m->pwmLen - 1;
+    unsigned int i = word_index(m, seq, beg);
+
+    while (1) {
+      /* Check for match (j points to the end of candidate sequence)       */
+      int score = word_score(m, i);
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 0);
+      if (j == end)
+        break;
+      /* Move on to the next position and compute next word index        */
+      j++;
+      i = ((i << 2) | get_base(seq, j)) & m->WordMask;
+    } /* Scanning loop                                                     */
+    beg = end + 1;
+  }
+}
+
+static void
+scan_seq_1(pwm_p_t m, seq_p_t seq, unsigned int from, unsigned int to, obuf_p_t out)
+{
+  int r = first_nrun(seq, from);
+  unsigned int beg = from;
+  unsigned int end = 0;
+
+  while (next_segment(seq, &r, &beg, &end, to, m->pwmLen)) { /* Bidirectional Scanning */
+    int cut = scan_cutoff(out, m);
+    /* Compute word index of the first word of the stretch                 */
+    unsigned int j = beg + m->pwmLen - 1;
+    unsigned int i = word_index(m, seq, beg);
+    unsigned int irc = word_index_rc(m, seq, beg);
+
+    while (1) {
+      /* Check for match (j points to the end of candidate sequence)       */
+      /* Score in forward direction                                        */
+      int score = word_score(m, i);
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 0);
+      /* Score in reverse direction (reverse complement word)              */
+      score = word_score(m, irc);
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 1);
+      if (j == end)
+        break;
+      /* Move on to the next position and compute next word indexes      */
+      j++;
+      unsigned int base = get_base(seq, j);
+      i = ((i << 2) | base) & m->WordMask;
+      irc = (irc >> 2) | ((3 - base) << m->RcShift);
+    } /* Scanning loop                                                     */
+    beg = end + 1;
+  }
+}
+
+static void
+scan_seq_2f(pwm_p_t m, seq_p_t seq, unsigned int from, unsigned int to, obuf_p_t out)  /* Word index length is smaller than pwm length    */
+{
+  /* Re-define forward core region relative to the end of the PWM            */
+  int Bfw_rel = m->Bfw - m->pwmLen;
+  int Efw_rel = m->Efw - m->pwmLen;
+  int r = first_nrun(seq, from);
+  unsigned int beg = from;
+  unsigned int end = 0;
+
+  while (next_segment(seq, &r, &beg, &end, to, m->pwmLen)) { /*   Forward Scanning    */
+    int cut = scan_cutoff(out, m);
+    /* Compute word index of the first word of the stretch                 */
+    unsigned int j = beg + m->pwmLen - 1;
+    unsigned int i = word_index(m, seq, j + Bfw_rel);
+
+    while (1) {
+      if (lateral != NULL && end - j >= (unsigned int)simdLanes) {
+        /* Vectorized scoring of the candidates ending at j..j+lanes-1    */
+        int sc[8];
+        for (int l = 0; l < simdLanes; l++) {
+          sc[l] = word_score(m, i);
+          i = ((i << 2) | get_base(seq, j + l + 1 + Efw_rel)) & m->WordMask;
+        }
+        unsigned int hits = lateral(m->Kfw, m->nbBlk, seq->seq, j, sc, cut);
+        for (int l = 0; hits; l++, hits >>= 1) {
+          if (hits & 1)
+            report_match(out, m, seq, j + l, sc[l], 0);
+        }
+        j += simdLanes;
+        continue;
+      }
+      /* Check for match (j points to the end of candidate sequence)       */
+      int score = word_score(m, i);
+      /* Complete score computation with the lateral blocks                */
+      int k = 0;
+      while (score >= cut && k < m->nbBlk) {
+        score += block_score(&m->Kfw[k], seq->seq, j);
+        k++;
+      }
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 0);
+      if (j == end)
+        break;
+      /* Move on to the next position and compute next word index        */
+      j++;
+      i = ((i << 2) | get_base(seq, j + Efw_rel)) & m->WordMask;
+    } /* Scanning loop                                                     */
+    beg = end + 1;
+  }
+}
+
+static void
+scan_seq_2(pwm_p_t m, seq_p_t seq, unsigned int from, unsigned int to, obuf_p_t out)   /* Word index length is smaller than pwm length    */
+{
+  /* Re-define forward/rev core regions relative to the end of the PWM       */
+  int Bfw_rel = m->Bfw - m->pwmLen;
+  int Efw_rel = m->Efw - m->pwmLen;
+  int Brv_rel = m->Brv - m->pwmLen;
+  int Erv_rel = m->Erv - m->pwmLen;
+  int r = first_nrun(seq, from);
+  unsigned int beg = from;
+  unsigned int end = 0;
+
+  while (next_segment(seq, &r, &beg, &end, to, m->pwmLen)) { /* Bidirectional Scanning */
+    int cut = scan_cutoff(out, m);
+    /* Compute word indexes of the first word of the stretch               */
+    unsigned int j = beg + m->pwmLen - 1;
+    unsigned int ifw = word_index(m, seq, j + Bfw_rel);
+    unsigned int irv = word_index_rc(m, seq, j + Brv_rel);
+
+    while (1) {
+      if (lateral != NULL && end - j >= (unsigned int)simdLanes) {
+        /* Vectorized scoring of the candidates ending at j..j+lanes-1    */
+        int scf[8];
+        int scr[8];
+        for (int l = 0; l < simdLanes; l++) {
+          scf[l] = word_score(m, ifw);
+          scr[l] = word_score(m, irv);
+          ifw = ((ifw << 2) | get_base(seq, j + l + 1 + Efw_rel)) & m->WordMask;
+          irv = (irv >> 2) | ((3 - get_base(seq, j + l + 1 + Erv_rel)) << m->RcShift);
+        }
+        unsigned int hfw = lateral(m->Kfw, m->nbBlk, seq->seq, j, scf, cut);
+        unsigned int hrv = lateral(m->Krv, m->nbBlk, seq->seq, j, scr, cut);
+        for (int l = 0; hfw | hrv; l++, hfw >>= 1, hrv >>= 1) {
+          if (hfw & 1)
+            report_match(out, m, seq, j + l, scf[l], 0);
+          if (hrv & 1)
+            report_match(out, m, seq, j + l, scr[l], 1);
+        }
+        j += simdLanes;
+        continue;
+      }
+      /* Check for match (j points to the end of candidate sequence)       */
+
+      /* Score in forward direction                                        */
+      int score = word_score(m, ifw);
+      /* Complete score computation with the lateral blocks                */
+      int k = 0;
+      while (score >= cut && k < m->nbBlk) {
+        score += block_score(&m->Kfw[k], seq->seq, j);
+        k++;
+      }
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 0);
+
+      /* Score in reverse direction                                        */
+      score = word_score(m, irv);
+      /* Complete score computation with the lateral blocks                */
+      k = 0;
+      while (score >= cut && k < m->nbBlk) {
+        score += block_score(&m->Krv[k], seq->seq, j);
+        k++;
+      }
+      if (score >= cut)
+        report_match(out, m, seq, j, score, 1);
+      if (j == end)
+        break;
+      /* Move on to the next position and compute next word indexes      */
+      j++;
+      ifw = ((ifw << 2) | get_base(seq, j + Efw_rel)) & m->WordMask;
+      irv = (irv >> 2) | ((3 - get_base(seq, j + Erv_rel)) << m->RcShift);
+    } /* Scanning loop                                                     */
+    beg = end + 1;
+  }
+}
+
+static void
+scan_pwm(pwm_p_t m, seq_p_t seq, unsigned int from, unsigned int to, obuf_p_t out)
+{
+  /* Scan [from..to] for matches to PWM m */
+  if (out->top != NULL) {
+    /* Pick up the cut-off raised by the other threads */
+    topk_p_t t = &out->top[m - Pwms];
+    pthread_mutex_lock(&TopLock);
+    if (m->TopCut > t->cut)
+      t->cut = m->TopCut;
+    pthread_mutex_unlock(&TopLock);
+  }
+  if (options.forward) {
+    if (m->wordLen == m->pwmLen) {
+      scan_seq_1f(m, seq, from, to, out);
+    } else {
+      scan_seq_2f(m, seq, from, to, out);
+    }
+  } else { /* Scan both strands */
+    if (m->wordLen == m->pwmLen) {
+      scan_seq_1(m, seq, from, to, out);
+    } else {
+      scan_seq_2(m, seq, from, to, out);
+    }
+  }
+}
+
+/* Adaptive search strategy (-a option)                                 */
+/* The rejection rates of the core region and of the lateral blocks are */
+/* counted on a sample of candidates taken from the beginning of the    */
+/* first sequence. For each word length, the core region and the order  */
+/* of the lateral blocks that minimize the number of lateral lookups    */
+/* are chosen; the word length is then chosen by timing the scan of the */
+/* sample with each of these plans.                                     */
+static int
+sample_prefix(pwm_p_t m, seq_p_t seq, unsigned int to, int **pf, int **pr)
+{
+  /* Prefix sums of the forward and reverse PWM weights of up to       */
+  /* PLAN_SAMPLE candidates ending within [pwmLen..to]. Return the     */
+  /* number of candidates.                                             */
+  int len = m->pwmLen;
+  unsigned int step = to / PLAN_SAMPLE + 1;
+  int r = first_nrun(seq, 1);
+  unsigned int beg = 1;
+  unsigned int end = 0;
+  int nc = 0;
+
+  *pf = (int *) malloc((size_t)PLAN_SAMPLE * (size_t)(len + 1) * sizeof(int));
+  *pr = (int *) malloc((size_t)PLAN_SAMPLE * (size_t)(len + 1) * sizeof(int));
+  if (*pf == NULL || *pr == NULL) {
+    perror("sample_prefix: malloc");
+    exit(1);
+  }
+  while (nc < PLAN_SAMPLE && next_segment(seq, &r, &beg, &end, to, len)) {
+    for (unsigned int j = beg + len - 1; j <= end && nc < PLAN_SAMPLE; j += step) {
+      int *f = *pf + (size_t)nc * (size_t)(len + 1);
+      int *q = *pr + (size_t)nc * (size_t)(len + 1);
+      f[0] = 0;
+      q[0] = 0;
+      for (int p = 1; p <= len; p++) {
+        int b = (int)get_base(seq, j - (unsigned int)(len - p)) + 1;
+        f[p] = f[p-1] + m->pwm[p][b];
+        q[p] = q[p-1] + m->pwm_r[p][b];
+      }
+      nc++;
+    }
+    beg = end + 1;
+  }
+  return nc;
+}
+
+static unsigned long
+plan_order(const int *P, int nc, int len, int B, int E, int cutOff, int *R)
+{
+  /* Greedy order of the lateral blocks of the core region [B..E]: the */
+  /* next block is the one that rejects most of the candidates left.   */
+  /* Fill R with the lateral positions in block order and return the   */
+  /* number of block lookups made for the nc candidates (P).           */
+  int first[len+1];
+  int last[len+1];
+  int used[len+1];
+  int n = flank_blocks(B, E, len, first, last);
+  int *alive = (int *) malloc((size_t)(nc + 1) * sizeof(int));
+  int *score = (int *) malloc((size_t)(nc + 1) * sizeof(int));
+  unsigned long lookups = 0;
+  int na = 0;
+  int nr = 0;
+
+  if (alive == NULL || score == NULL) {
+    perror("plan_order: malloc");
+    exit(1);
+  }
+  for (int c = 0; c < nc; c++) {
+    const int *q = P + (size_t)c * (size_t)(len + 1);
+    if (q[E] - q[B-1] >= cutOff) {
+      alive[na] = c;
+      score[na++] = q[E] - q[B-1];
+    }
+  }
+  for (int b = 0; b < n; b++)
+    used[b] = 0;
+  for (int k = 0; k < n; k++) {
+    int best = -1;
+    int most = -1;
+    for (int b = 0; b < n; b++) {
+      if (used[b])
+        continue;
+      int rejected = 0;
+      for (int a = 0; a < na; a++) {
+        const int *q = P + (size_t)alive[a] * (size_t)(len + 1);
+        if (score[a] + q[last[b]] - q[first[b]-1] < cutOff)
+          rejected++;
+      }
+      if (rejected > most) {
+        best = b;
+        most = rejected;
+      }
+    }
+    used[best] = 1;
+    lookups += (unsigned long)na;
+    for (int p = first[best]; p <= last[best]; p++)
+      R[nr++] = p;
+    /* Keep the candidates that pass the block */
+    int left = 0;
+    for (int a = 0; a < na; a++) {
+      const int *q = P + (size_t)alive[a] * (size_t)(len + 1);
+      int sc = score[a] + q[last[best]] - q[first[best]-1];
+      if (sc >= cutOff) {
+        alive[left] = alive[a];
+        score[left++] = sc;
+      }
+    }
+    na = left;
+  }
+  free(alive);
+  free(score);
+  return lookups;
+}
+
+static void
+apply_plan(pwm_p_t m, int L, int B, const int *Rf, const int *Rr)
+{
+  /* Set the word length, the core region [B..B+L-1] and the lateral  */
+  /* order (Rf, Rr) of PWM m, and build its tables                    */
+  m->wordLen = L;
+  if (L < m->pwmLen) {
+    int diff = m->pwmLen - L;
+    m->Bfw = B;
+    m->Efw = B + L - 1;
+    if (m->Rfw == NULL && (m->Rfw = (int *) calloc((size_t)m->pwmLen+1, sizeof(int))) == NULL) {
+      perror("apply_plan: calloc");
+      exit(1);
+    }
+    memcpy(m->Rfw, Rf, (size_t)diff * sizeof(int));
+    m->Kfw = lateral_blocks(m->pwm, m->Rfw, m->Bfw, m->Efw, m->pwmLen, &m->nbBlk);
+    if (!options.forward) {
+      m->Brv = m->pwmLen + 1 - m->Efw;
+      m->Erv = m->pwmLen + 1 - m->Bfw;
+      if (m->Rrv == NULL && (m->Rrv = (int *) calloc((size_t)m->pwmLen+1, sizeof(int))) == NULL) {
+        perror("apply_plan: calloc");
+        exit(1);
+      }
+      memcpy(m->Rrv, Rr, (size_t)diff * sizeof(int));
+      m->Krv = lateral_blocks(m->pwm_r, m->Rrv, m->Brv, m->Erv, m->pwmLen, &m->nbBlk);
+    }
+  }
+  make_tables(m);
+}
+
+static void
+print_blocks(const latblk_t *blk, int nb, int len)
+{
+  if (blk == NULL || nb == 0) {
+    fputc('-', stderr);
+    return;
+  }
+  for (int k = 0; k < nb; k++) {
+    int b = blk[k].off + len;
+    fprintf(stderr, "%s%d-%d", k ? "," : "", b, b + __builtin_popcount(blk[k].mask) / 2 - 1);
+  }
+}
+
+static void
+print_plan(pwm_p_t m)
+{
+  /* Print the search plan of PWM m, in the format read by -P: name,   */
+  /* word length, core region, forward and reverse lateral block order */
+  int B = (m->wordLen < m->pwmLen) ? m->Bfw : 1;
+  fprintf(stderr, "%s\t%d\t%d-%d\t", m->name, m->wordLen, B, B + m->wordLen - 1);
+  print_blocks(m->Kfw, m->nbBlk, m->pwmLen);
+  fputc('\t', stderr);
+  print_blocks(m->Krv, m->nbBlk, m->pwmLen);
+  fputc('\n', stderr);
+}
+
+static double
+plan_time(pwm_p_t m, seq_p_t seq, unsigned int to, obuf_p_t ob)
+{
+  /* Best of two timed scans of [1..to] (seconds) */
+  double best = 0;
+  for (int k = 0; k < 2; k++) {
+    struct timespec t0, t1;
+    ob->len = 0;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+    scan_pwm(m, seq, 1, to, ob);
+    clock_gettime(CLOCK_MONOTONIC, &t1);
+    double t = (double)(t1.tv_sec - t0.tv_sec) + (double)(t1.tv_nsec - t0.tv_nsec) * 1e-9;
+    if (k == 0 || t < best)
+      best = t;
+  }
+  return best;
+}
+
+static void
+plan_pwm(pwm_p_t m, seq_p_t seq, unsigned int to, obuf_p_t ob)
+{
+  /* Choose the search plan of PWM m on the sample [1..to] */
+  int len = m->pwmLen;
+  int Rf[len+1], Rr[len+1];
+  int planRf[len+1], planRr[len+1];
+  int bestRf[len+1], bestRr[len+1];
+  int *pf, *pr;
+  int nc = sample_prefix(m, seq, to, &pf, &pr);
+  int minL = (len < PLAN_MINLEN) ? len : PLAN_MINLEN;
+  int maxL = (len < PLAN_MAXLEN) ? len : PLAN_MAXLEN;
+  int bestL = 0;
+  int bestB = 1;
+  double best = 0;
+
+  if (nc == 0) {
+    /* No candidate in the sample: default strategy */
+    m->wordLen = (len < wordLen) ? len : wordLen;
+    if (len > m->wordLen)
+      define_search_strategy(m);
+    make_tables(m);
+    free(pf);
+    free(pr);
+    print_plan(m);
+    return;
+  }
+  for (int L = minL; L <= maxL; L++) {
+    int B = 1;
+    if (L < len) {
+      unsigned long min = ULONG_MAX;
+      for (int b = 1; b + L - 1 <= len; b++) {
+        unsigned long n = plan_order(pf, nc, len, b, b + L - 1, m->cutOff, Rf);
+        if (!options.forward)
+          n += plan_order(pr, nc, len, len + 2 - b - L, len + 1 - b, m->cutOff, Rr);
+        if (n < min) {
+          min = n;
+          B = b;
+          memcpy(planRf, Rf, sizeof(Rf));
+          memcpy(planRr, Rr, sizeof(Rr));
+        }
+      }
+    }
+    apply_plan(m, L, B, planRf, planRr);
+    double t = plan_time(m, seq, to, ob);
+    if (options.debug)
+      fprintf(stderr, "Matrix %s: word length %d, core region %d-%d: %.2f ns/base\n",
+          m->name, L, B, B + L - 1, t * 1e9 / to);
+    if (bestL == 0 || t < best) {
+      best = t;
+      bestL = L;
+      bestB = B;
+      memcpy(bestRf, planRf, sizeof(Rf));
+      memcpy(bestRr, planRr, sizeof(Rr));
+    }
+    free_tables(m);
+  }
+  apply_plan(m, bestL, bestB, bestRf, bestRr);
+  free(pf);
+  free(pr);
+  print_plan(m);
+}
+
+static void
+plan_pwms(seq_p_t seq)
+{
+  /* Choose the search plans on the first planMb Mb of the sequence */
+  unsigned long size = (unsigned long)planMb * 1000000ul;
+  unsigned int to = (seq->len < size) ? seq->len : (unsigned int)size;
+  obuf_t ob = {NULL, 0, 0, -1, NULL};
+
+  for (int k = 0; k < nbPwms; k++)
+    plan_pwm(&Pwms[k], seq, to, &ob);
+  free(ob.buf);
+  planned = 1;
+}
+
+static int
+parse_order(char *str, int B, int E, int len, int *R)
+{
+  /* Parse a lateral block order ("b-e,b-e,...", or "-" for none) into */
+  /* R; the lateral positions that are not given are ranked last       */
+  int seen[len+1];
+  int nr = 0;
+
+  for (int p = 1; p <= len; p++)
+    seen[p] = (p >= B && p <= E);
+  for (char *t = strtok(str, ","); t != NULL; t = strtok(NULL, ",")) {
+    int b, e;
+    if (strcmp(t, "-") == 0)
+      continue;
+    if (sscanf(t, "%d-%d", &b, &e) != 2 || b < 1 || e < b || e > len)
+      return -1;
+    for (int p = b; p <= e; p++) {
+      if (seen[p])
+        return -1;
+      seen[p] = 1;
+      R[nr++] = p;
+    }
+  }
+  for (int p = 1; p <= len; p++)
+    if (!seen[p])
+      R[nr++] = p;
+  return 0;
+}
+
+static int
+read_plans(char *iFile)
+{
+  /* Read search plans, as printed with -a: one line per matrix with  */
+  /* the matrix name, word length, core region and forward/reverse    */
+  /* lateral block orders, separated by white space                   */
+  FILE *f = fopen(iFile, "r");
+  char buf[LINE_SIZE];
+  char name[HDR_MAX];
+  char fw[LINE_SIZE];
+  char rv[LINE_SIZE];
+  int L, B, E;
+
+  if (f == NULL) {
+    fprintf(stderr, "Could not open file %s: %s(%d)\n",
+            iFile, strerror(errno), errno);
+    return -1;
+  }
+  while (fgets(buf, LINE_SIZE, f) != NULL) {
+    if (buf[0] == '#' || sscanf(buf, "%255s %d %d-%d %1023s %1023s", name, &L, &B, &E, fw, rv) != 6)
+      continue;
+    for (int k = 0; k < nbPwms; k++) {
+      pwm_p_t m = &Pwms[k];
+      int Rf[m->pwmLen+1], Rr[m->pwmLen+1];
+      if (strcmp(m->name, name) != 0)
+        continue;
+      if (L < 1 || L > 15 || L > m->pwmLen || B < 1 || E != B + L - 1 || E > m->pwmLen
+          || parse_order(fw, B, E, m->pwmLen, Rf) != 0
+          || parse_order(rv, m->pwmLen + 1 - E, m->pwmLen + 1 - B, m->pwmLen, Rr) != 0) {
+        fprintf(stderr, "Invalid search plan for matrix %s\n", name);
+        fclose(f);
+        return -1;
+      }
+      free_tables(m);
+      apply_plan(m, L, B, Rf, Rr);
+    }
+  }
+  fclose(f);
+  return 0;
+}
+
+static void
+scan_chunk(chunk_p_t c, obuf_p_t out)
+{
+  /* Scan the sequence chunk for matches to each PWM. A chunk owns the */
+  /* matches starting at [from..to-maxLen+1] (up to the sequence end   */
+  /* for the last chunk), so that shorter PWMs do not report matches  */
+  /* twice within the overlap between consecutive chunks.             */
+  for (int k = 0; k < nbPwms; k++) {
+    pwm_p_t m = &Pwms[k];
+    unsigned int to = c->to;
+
+    if (c->to < c->seq->len || c->seq->more)
+      to -= (unsigned int)(maxLen - m->pwmLen);
+    scan_pwm(m, c->seq, c->from, to, out);
+  }
+}
+
+static unsigned int
+make_chunks(seq_p_t seq, unsigned int size)
+{
+  /* Split sequence into chunks overlapping by maxLen-1 bases      */
+  unsigned int overlap = (unsigned int)maxLen - 1;
+  unsigned int from = seq->beg;
+  unsigned int to;
+
+  if (size <= 2 * overlap)
+    size = 2 * overlap + 1;
+  nbChunks = 0;
+  while (1) {
+    to = from + size - 1;
+    if (to >= seq->len)
+      to = seq->len;
+    if (nbChunks == maxChunks) {
+      maxChunks = (maxChunks == 0) ? 64 : maxChunks * 2;
+      if ((Chunks = (chunk_p_t)realloc(Chunks, (size_t)maxChunks * sizeof(chunk_t))) == NULL) {
+        perror("Chunks: realloc");
+        exit(1);
+      }
+    }
+    Chunks[nbChunks].seq = seq;
+    Chunks[nbChunks].from = from;
+    Chunks[nbChunks].to = to;
+    Chunks[nbChunks].out.buf = NULL;
+    Chunks[nbChunks].out.len = 0;
+    Chunks[nbChunks].out.size = 0;
+    Chunks[nbChunks].out.fd = -1;
+    Chunks[nbChunks].out.top = NULL;
+    nbChunks++;
+    if (to == seq->len)
+      break;
+    from = to - overlap + 1;
+  }
+  return size;
+}
+
+/* Multi-threaded scanning functions                                  */
+/* Each sequence is split into overlapping chunks. Each thread owns a */
+/* contiguous range of chunks, which it processes from the front.     */
+/* Idle threads steal chunks from the back of the largest range left. */
+static int
+next_chunk(int self)
+{
+  wsq_p_t q = &Queues[self];
+  int c = -1;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->lo < q->hi)
+    c = q->lo++;
+  pthread_mutex_unlock(&q->lock);
+  while (c < 0) {
+    int victim = -1;
+    int left = 0;
+    for (int k = 0; k < nbThreads; k++) {
+      pthread_mutex_lock(&Queues[k].lock);
+      if (Queues[k].hi - Queues[k].lo > left) {
+        left = Queues[k].hi - Queues[k].lo;
+        victim = k;
+      }
+      pthread_mutex_unlock(&Queues[k].lock);
+    }
+    if (victim < 0)  /* No work left */
+      break;
+    q = &Queues[victim];
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi)
+      c = --q->hi;
+    pthread_mutex_unlock(&q->lock);
+  }
+  return c;
+}
+
+static void
+run_chunks(int self)
+{
+  int c;
+
+  while ((c = next_chunk(self)) >= 0) {
+    if (topK)
+      Chunks[c].out.top = &TopHeaps[self * nbPwms];
+    scan_chunk(&Chunks[c], &Chunks[c].out);
+  }
+}
+
+static void *
+worker(void *arg)
+{
+  int self = (int)(long)arg;
+  unsigned int job = 0;
+
+  pthread_mutex_lock(&PoolLock);
+  while (1) {
+    while (JobId == job && !Quit)
+      pthread_cond_wait(&PoolWork, &PoolLock);
+    if (Quit)
+      break;
+    job = JobId;
+    pthread_mutex_unlock(&PoolLock);
+    run_chunks(self);
+    pthread_mutex_lock(&PoolLock);
+    if (--Busy == 0)
+      pthread_cond_signal(&PoolDone);
+  }
+  pthread_mutex_unlock(&PoolLock);
+  return NULL;
+}
+
+static void
+start_pool()
+{
+  /* Thread 0 is the main thread, which also scans chunks */
+  if ((Queues = (wsq_p_t)calloc((size_t)nbThreads, sizeof(wsq_t))) == NULL) {
+    perror("Queues: calloc");
+    exit(1);
+  }
+  if ((Workers = (pthread_t *)calloc((size_t)nbThreads, sizeof(pthread_t))) == NULL) {
+    perror("Workers: calloc");
+    exit(1);
+  }
+  for (int k = 0; k < nbThreads; k++)
+    pthread_mutex_init(&Queues[k].lock, NULL);
+  for (int k = 1; k < nbThreads; k++) {
+    if (pthread_create(&Workers[k], NULL, worker, (void *)(long)k) != 0) {
+      fprintf(stderr, "Could not create thread %d\n", k);
+      exit(1);
+    }
+  }
+}
+
+static void
+stop_pool()
+{
+  pthread_mutex_lock(&PoolLock);
+  Quit = 1;
+  pthread_cond_broadcast(&PoolWork);
+  pthread_mutex_unlock(&PoolLock);
+  for (int k = 1; k < nbThreads; k++)
+    pthread_join(Workers[k], NULL);
+  for (int k = 0; k < nbThreads; k++)
+    pthread_mutex_destroy(&Queues[k].lock);
+  free(Workers);
+  free(Queues);
+  free(Chunks);
+}
+
+static void
+scan_seq_mt(seq_p_t seq)
+{
+  unsigned int size = CHUNK_SIZE;
+
+  if (seq->len / size < 4 * (unsigned int)nbThreads) {
+    size = seq->len / (4 * (unsigned int)nbThreads);
+    if (size < CHUNK_MIN)
+      size = CHUNK_MIN;
+  }
+  size = make_chunks(seq, size);
+  if (options.debug)
+    fprintf(stderr, "Scanning %s: %d chunks of %u bp on %d threads\n", seq->hdr, nbChunks, size, nbThreads);
+  /* Assign a contiguous range of chunks to each thread            */
+  for (int k = 0; k < nbThreads; k++) {
+    Queues[k].lo = (int)((long)nbChunks * k / nbThreads);
+    Queues[k].hi = (int)((long)nbChunks * (k + 1) / nbThreads);
+  }
+  pthread_mutex_lock(&PoolLock);
+  Busy = nbThreads - 1;
+  JobId++;
+  pthread_cond_broadcast(&PoolWork);
+  pthread_mutex_unlock(&PoolLock);
+  run_chunks(0);
+  pthread_mutex_lock(&PoolLock);
+  while (Busy > 0)
+    pthread_cond_wait(&PoolDone, &PoolLock);
+  pthread_mutex_unlock(&PoolLock);
+  /* Write out matches in sequence order                           */
+  if (nonOverlap) {
+    for (int c = 0; c < nbChunks; c++) {
+      obuf_p_t ob = &Chunks[c].out;
+      for (size_t k = 0; k < ob->len; k += sizeof(mrec_t)) {
+        mrec_t rec;
+        memcpy(&rec, ob->buf + k, sizeof(rec));
+        filter_match(&Out, &Pwms[rec.pwm], seq, rec.j, rec.score, rec.rev);
+      }
+      free(ob->buf);
+      ob->buf = NULL;
+      ob->len = 0;
+    }
+    return;
+  }
+  ob_flush(&Out);
+  for (int c = 0; c < nbChunks; c++)
+    ob_release(&Chunks[c].out, Out.fd);
+}
+
+static void
+mask_add(int *n, unsigned int beg, unsigned int end)
+{
+  /* Append [beg..end] to MaskRuns, merging it with the last run */
+  if (*n > 0 && beg <= MaskRuns[*n-1].end + 1) {
+    if (end > MaskRuns[*n-1].end)
+      MaskRuns[*n-1].end = end;
+  } else {
+    MaskRuns[*n].beg = beg;
+    MaskRuns[*n].end = end;
+    (*n)++;
+  }
+}
+
+static int
+mask_regions(seq_p_t seq)
+{
+  /* Mask the bases of the window that lie outside the regions to     */
+  /* scan: the gaps between the regions are merged with the N-runs    */
+  /* into MaskRuns, which replace the N-runs of the window while it   */
+  /* is scanned. Return 0 if no region overlaps the window.           */
+  reglist_p_t rl = seq->reg;
+  unsigned long off = seq->off;
+  unsigned long last = off + seq->len;
+  int lo = 0;
+  int hi;
+  int r = 0;
+  int n = 0;
+  long pos = 1;
+
+  if (rl == NULL)
+    return 0;
+  /* First region ending after the window start */
+  hi = rl->nb;
+  while (lo < hi) {
+    int mid = (lo + hi) / 2;
+    if (rl->reg[mid].end <= off)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  if (lo == rl->nb || rl->reg[lo].beg >= last)
+    return 0;
+  if (mMask < seq->nbRuns + rl->nb - lo + 1) {
+    mMask = seq->nbRuns + rl->nb - lo + 1;
+    if ((MaskRuns = (nrun_t *) realloc(MaskRuns, (size_t)mMask * sizeof(nrun_t))) == NULL) {
+      perror("mask_regions: realloc");
+      exit(1);
+    }
+  }
+  for (int k = lo; ; k++) {
+    /* Gap [pos..end] before region k (or up to the window end) */
+    int done = (k == rl->nb || rl->reg[k].beg >= last);
+    long end = done ? (long)seq->len : (long)rl->reg[k].beg - (long)off;
+    if (end >= pos) {
+      while (r < seq->nbRuns && (long)seq->nrun[r].beg < pos) {
+        mask_add(&n, seq->nrun[r].beg, seq->nrun[r].end);
+        r++;
+      }
+      mask_add(&n, (unsigned int)pos, (unsigned int)end);
+    }
+    if (done)
+      break;
+    pos = (long)rl->reg[k].end - (long)off + 1;
+  }
+  while (r < seq->nbRuns) {
+    mask_add(&n, seq->nrun[r].beg, seq->nrun[r].end);
+    r++;
+  }
+  seq->nrun = MaskRuns;
+  seq->nbRuns = n;
+  return 1;
+}
+
+static void
+scan_seq(seq_p_t seq)
+{
+  /* Scan the sequence for matches to the given PWM(s) */
+  nrun_p_t nrun = seq->nrun;
+  int nbRuns = seq->nbRuns;
+
+  if (regionFile == NULL || mask_regions(seq)) {
+    if (planMb > 0 && !planned)
+      plan_pwms(seq);
+    if (nbThreads > 1 && seq->len > CHUNK_MIN) {
+      scan_seq_mt(seq);
+    } else if (nbPwms > 1 && seq->len > CHUNK_MIN) {
+      /* Library: scan cache-sized chunks through all the PWMs in turn, */
+      /* so that the sequence is read from memory only once            */
+      make_chunks(seq, CHUNK_MIN);
+      for (int c = 0; c < nbChunks; c++)
+        scan_chunk(&Chunks[c], &Out);
+    } else {
+      chunk_t c = {seq, seq->beg, seq->len, {NULL, 0, 0, -1, NULL}};
+      scan_chunk(&c, &Out);
+    }
+  }
+  seq->nrun = nrun;
+  seq->nbRuns = nbRuns;
+  if (nonOverlap && !seq->more)
+    flush_matches(&Out, seq);
+}
+
+static void
+next_window(seq_p_t seq)
+{
+  /* Move on to the next window of a streamed sequence. The last       */
+  /* bases are kept (at least 2*maxLen-1, so that the pending matches  */
+  /* of the non-overlapping filter that may still be replaced stay in  */
+  /* the window), shifted by a multiple of 4 bases so that the packed  */
+  /* bytes are moved as they are.                                      */
+  unsigned int keep = 2 * (unsigned int)maxLen - 1;
+  unsigned int shift = (seq->len - keep) & ~3u;
+  int k = 0;
+
+  /* Output the pending matches that are shifted out */
+  for (int p = 0; p < nbPwms; p++) {
+    pwm_p_t m = &Pwms[p];
+    if (m->BestJ == 0)
+      continue;
+    if (m->BestJ - (unsigned int)m->pwmLen < shift) {
+      put_match(&Out, m, seq, m->BestJ, m->BestScore, m->BestRev);
+      m->BestJ = 0;
+    } else {
+      m->BestJ -= shift;
+    }
+  }
+  memmove(seq->seq, seq->seq + shift / 4, (size_t)((seq->len - shift) >> 2) + 1);
+  for (int r = 0; r < seq->nbRuns; r++) {
+    if (seq->nrun[r].end <= shift)
+      continue;
+    seq->nrun[k].beg = (seq->nrun[r].beg > shift) ? seq->nrun[r].beg - shift : 1;
+    seq->nrun[k].end = seq->nrun[r].end - shift;
+    k++;
+  }
+  seq->nbRuns = k;
+  seq->len -= shift;
+  seq->off += shift;
+  seq->beg = seq->len - (unsigned int)maxLen + 2;
+}
+
+/* String parser function */
+char** str_split(char* a_str, const char a_delim)
+{
+    char** result = 0;
+    size_t count = 0;
     char* tmp = a_str;
     char* last_comma = 0;
     char delim[2];
@@ -1015,49 +3007,83 @@ char** str_split(char* a_str, const char a_delim)
     return result;
 }
 
+static void
+set_seq_id(char *hdr)
+{
+  /* Extract sequence identifier from FASTA header               */
+  /* The header is expected to have pipe delimiters              */
+  /* By default, the seq identifier should start after the 2nd   */
+  /* pipe (nbPipes=2), and be followed by a space                */
+  /* The parameter nbPipes can be change by the user via the     */
+  /* command line arguments                                      */
+  int pipe_cnt = 0;
+  int i;
+  if (nbPipes) {
+    /* Count number of '|' delimiters and detect the correct one */
+    for (i = 0; hdr[i] != '\0'; i++) {
+      if (hdr[i] == '|')
+        pipe_cnt++;
+      if (pipe_cnt == nbPipes) {
+        /* Extract word after pipe delimiter  */
+        char *s = &hdr[i+1];
+        char tmp[HDR_MAX];
+        int j = 0;
+        while (*s && !isspace(*s)) {
+          tmp[j++] = *s++;
+        }
+        tmp[j] = 0;
+        /* Copy seq identifier to seq header  */
+        strcpy (hdr, tmp);
+        break;
+      }
+    }
+    /* If pipe_cnt = 0 leave header as it is  */
+    if (pipe_cnt && pipe_cnt < nbPipes) {
+      strcpy(hdr, "chrN");
+    }
+  }
+}
+
 /* Process Sequence file - Main Loop */
 static int
-process_seq(FILE *input, char *iFile)
+process_seq(zfile_t *input, char *iFile)
 {
   char buf[BUF_SIZE], *res;
   seq_t seq;
-  unsigned int mLen;
+  int mRuns;
+  unsigned int nbSeqs = 0;
 
-  if (input == NULL) {
-    FILE *f = fopen(iFile, "r");
-    if (f == NULL) {
-      fprintf(stderr, "Could not open file %s: %s(%d)\n",
-        iFile, strerror(errno), errno);
-      return -1;
-    }
-    input = f;
-  }
+  if (input == NULL && (input = zfile_open(iFile, 0)) == NULL)
+    return -1;
   if (options.debug != 0) {
     if (iFile == NULL)
       fprintf(stderr, "Processing file from STDIN\n");
     else
       fprintf(stderr, "Processing file %s\n", iFile);
   }
-  while ((res = fgets(buf, BUF_SIZE, input)) != NULL
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL
         && buf[0] != '>')
     ;
   if (res == NULL || buf[0] != '>') {
     fprintf(stderr, "Could not find a sequence in file %s\n", iFile);
-    if (input != stdin) {
-      fclose(input);
-    }
+    zfile_close(input);
     return -1;
   }
   seq.hdr = malloc(HDR_MAX * sizeof(char));
-  seq.seq = malloc(THIRTY_TWO_MEG * sizeof(short int));
-  mLen = THIRTY_TWO_MEG;
+  /* Packed bases of the window (+ slack for the 32-bit loads of the */
+  /* SIMD kernels)                                                   */
+  seq.seq = malloc((WINDOW_SIZE / 4 + 8) * sizeof(unsigned char));
+  seq.nrun = malloc(RUNS_MAX * sizeof(nrun_t));
+  mRuns = RUNS_MAX;
+  if (seq.hdr == NULL || seq.seq == NULL || seq.nrun == NULL) {
+    perror("process_seq: malloc");
+    exit(1);
+  }
   while (res != NULL) {
     /* Get the header */
     if (buf[0] != '>') {
       fprintf(stderr, "Could not find a sequence header in file %s\n", iFile);
-      if (input != stdin) {
-        fclose(input);
-      }
+      zfile_close(input);
       return -1;
     }
     char *s = buf;
@@ -1066,120 +3092,190 @@ process_seq(FILE *input, char *iFile)
     while (*s && !isspace(*s)) {
       if (i >= HDR_MAX) {
         fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return -1;
       }
       seq.hdr[i++] = *s++;
     }
     if (i < HDR_MAX)
       seq.hdr[i] = 0;
-    /* Extract sequence identifier from FASTA header               */
-    /* The header is expected to have pipe delimiters              */
-    /* By default, the seq identifier should start after the 2nd   */
-    /* pipe (nbPipes=2), and be followed by a space                */
-    /* The parameter nbPipes can be change by the user via the     */
-    /* command line arguments                                      */
-    int pipe_cnt = 0;
-    if (nbPipes) {
-      /* Count number of '|' delimiters and detect the correct one */
-      for (i = 0; seq.hdr[i] != '\0'; i++) {
-        if (seq.hdr[i] == '|')
-          pipe_cnt++;
-        if (pipe_cnt == nbPipes) {
-          /* Extract word after pipe delimiter  */
-          char *s = &seq.hdr[i+1];
-          char tmp[HDR_MAX];
-          int j = 0;
-          while (*s && !isspace(*s)) {
-            tmp[j++] = *s++;
-          }
-          tmp[j] = 0;
-          /* Copy seq identifier to seq header  */
-          strcpy (seq.hdr, tmp);
-          break;
-        }
-      }
-      /* If pipe_cnt = 0 leave header as it is  */
-      if (pipe_cnt && pipe_cnt < nbPipes) {
-        strcpy(seq.hdr, "chrN");
-      }
-    }
+    set_seq_id(seq.hdr);
     if (options.debug)
       fprintf(stderr, "Sequence ID: %s\n", seq.hdr);
-    /* Gobble sequence  */
+    seq.id = nbSeqs++;
+    seq.reg = find_regions(seq.hdr);
+    if (regionFile != NULL && seq.reg == NULL) {
+      /* No region to scan: skip the sequence */
+      while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>')
+        ;
+      continue;
+    }
+    /* Gobble sequence, one window at a time  */
     seq.len = 0;
-    while ((res = fgets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
+    seq.nbRuns = 0;
+    seq.seq[0] = 0;
+    seq.off = 0;
+    seq.beg = 1;
+    seq.more = 0;
+    while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
       char c;
-      short int n;
+      unsigned char n;
       s = buf;
       while ((c = *s++) != 0) {
         if (isalpha(c)) {
+          /* Soft-masked bases (-s) are recorded in the N-runs */
+          if (softMask && islower(c))
+            c = 'N';
           c = (char) toupper(c);
           switch (c) {
             case 'A':
-              n = 1;
+              n = 0;
               break;
             case 'C':
-              n = 2;
+              n = 1;
               break;
             case 'G':
-              n = 3;
+              n = 2;
               break;
             case 'T':
-              n = 4;
-              break;
-            case 'N':
-              n = 0;
+              n = 3;
               break;
-            default:
-              n = 0;
-           ;
+            default: /* N or any other letter */
+              n = 4;
+          }
+          if (seq.len == WINDOW_SIZE) {
+            /* Full window: scan it and keep its end */
+            seq.more = 1;
+            scan_seq(&seq);
+            next_window(&seq);
           }
           seq.len++;
-          if (seq.len >= mLen) {
-            mLen += BUF_SIZE;
-            seq.seq = realloc(seq.seq, (size_t)mLen * sizeof(short int));
+          /* Clear each byte before storing its first base */
+          if ((seq.len & 3) == 0)
+            seq.seq[seq.len >> 2] = 0;
+          if (n == 4) {
+            /* Extend the last N-run or start a new one */
+            if (seq.nbRuns && seq.nrun[seq.nbRuns-1].end == seq.len - 1) {
+              seq.nrun[seq.nbRuns-1].end = seq.len;
+            } else {
+              if (seq.nbRuns == mRuns) {
+                mRuns *= 2;
+                seq.nrun = realloc(seq.nrun, (size_t)mRuns * sizeof(nrun_t));
+                if (seq.nrun == NULL) {
+                  perror("process_seq: realloc");
+                  exit(1);
+                }
+              }
+              seq.nrun[seq.nbRuns].beg = seq.len;
+              seq.nrun[seq.nbRuns].end = seq.len;
+              seq.nbRuns++;
+            }
+          } else {
+            seq.seq[seq.len >> 2] |= (unsigned char)(n << ((seq.len & 3) << 1));
           }
-          seq.seq[seq.len] = n; /* sequence starts at seq.seq[1]  */
         }
       }
     }
     if (options.debug)
-      fprintf(stderr, "Sequence length: %u\n", seq.len);
-    /* We now have the (not nul terminated) sequence.
+      fprintf(stderr, "Sequence length: %u\n", seq.off + seq.len);
+    /* We now have the (last window of the) sequence.
        Process it: on both or only forward directions   */
-    if (seq.len != 0) {
-      /* Scan the sequence for matches to the given PWM */
-      if (options.forward) {
-        if (wordLen == pwmLen) {
-          scan_seq_1f(&seq);
-        } else {
-          scan_seq_2f(&seq);
-        }
-      } else { /* Scan both strands */
-        if (wordLen == pwmLen) {
-          scan_seq_1(&seq);
-        } else {
-          scan_seq_2(&seq);
-        }
-      }
-    }
+    seq.more = 0;
+    if (seq.len != 0)
+      scan_seq(&seq);
   }
   free(seq.hdr);
   free(seq.seq);
-  if (input != stdin) {
-    fclose(input);
-  }
+  free(seq.nrun);
+  zfile_close(input);
   return 0;
 }
 
+/* Process Genome pack file (built by genome_pack) */
+static void
+put_hit_header(genome_t *g)
+{
+  /* Write the binary match stream header and matrix table */
+  hit_hdr_t h;
+  hit_pwm_t p;
+
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, HIT_MAGIC, sizeof(h.magic));
+  h.version = HIT_VERSION;
+  h.flags = (Pwms[0].tag[0] != 0) ? HIT_NAMED : 0;
+  h.nb_pwms = (uint32_t)nbPwms;
+  h.nb_chroms = g->hdr->nb_chroms;
+  memcpy(h.assembly, g->hdr->assembly, sizeof(h.assembly));
+  h.genome_sum = hit_genome_sum(g);
+  ob_reserve(&Out, sizeof(h));
+  memcpy(Out.buf + Out.len, &h, sizeof(h));
+  Out.len += sizeof(h);
+  for (int k = 0; k < nbPwms; k++) {
+    memset(&p, 0, sizeof(p));
+    strncpy(p.name, Pwms[k].name, HIT_NAME_MAX - 1);
+    p.len = (uint32_t)Pwms[k].pwmLen;
+    ob_reserve(&Out, sizeof(p));
+    memcpy(Out.buf + Out.len, &p, sizeof(p));
+    Out.len += sizeof(p);
+  }
+}
+
+static int
+process_genome(char *iFile)
+{
+  genome_t g;
+  seq_t seq;
+
+  if (genome_open(&g, iFile) != 0)
+    return -1;
+  if (options.debug != 0)
+    fprintf(stderr, "Processing genome pack file %s (%u sequences)\n", iFile, g.hdr->nb_chroms);
+  if (binOut)
+    put_hit_header(&g);
+  if ((seq.hdr = malloc(HDR_MAX * sizeof(char))) == NULL) {
+    perror("process_genome: malloc");
+    exit(1);
+  }
+  for (unsigned int k = 0; k < g.hdr->nb_chroms; k++) {
+    /* Sequences are scanned in place from the mapped file */
+    strcpy(seq.hdr, g.chrom[k].id);
+    set_seq_id(seq.hdr);
+    seq.seq = (unsigned char *)genome_seq(&g, (int)k);
+    seq.len = g.chrom[k].len;
+    seq.nrun = (nrun_p_t)genome_nruns(&g, (int)k);
+    seq.nbRuns = (int)g.chrom[k].nb_runs;
+    seq.id = k;
+    seq.off = 0;
+    seq.beg = 1;
+    seq.more = 0;
+    /* Regions are looked up by sequence identifier, then by chromosome */
+    /* name (e.g. chr1 or 1)                                            */
+    seq.reg = find_regions(seq.hdr);
+    if (seq.reg == NULL && g.chrom[k].chr[0] != 0) {
+      char chr[PACK_NAME_MAX + 4];
+      snprintf(chr, sizeof(chr), "chr%s", g.chrom[k].chr);
+      if ((seq.reg = find_regions(chr)) == NULL)
+        seq.reg = find_regions(g.chrom[k].chr);
+    }
+    if (options.debug)
+      fprintf(stderr, "Sequence ID: %s\nSequence length: %u (%d N-runs)\n", seq.hdr, seq.len, seq.nbRuns);
+    if (seq.len != 0)
+      scan_seq(&seq);
+  }
+  free(seq.hdr);
+  genome_close(&g);
+  return 0;
+}
 
 int
 main(int argc, char *argv[])
 {
   char *pwmFile = NULL;
+  char *libFile = NULL;
   char *bgProb = NULL;
   char** tokens;
+  char *end;
+  long mb;
   int i = 0;
 
 #ifdef DEBUG
@@ -1196,16 +3292,30 @@ main(int argc, char *argv[])
           {"help",    no_argument,       0, 'h'},
           {"coff",    required_argument, 0, 'c'},
           {"matrix",  required_argument, 0, 'm'},
+          {"library", required_argument, 0, 'l'},
+          {"cutoffs", required_argument, 0, 'k'},
           {"forward", no_argument,       0, 'f'},
           {"wordlen", required_argument, 0, 'i'},
           {"bgcomp",  required_argument, 0, 'b'},
           {"pipes",   required_argument, 0, 'n'},
           {"seqnorm", no_argument,       0, 'q'},
+          {"threads", required_argument, 0, 't'},
+          {"genome",  required_argument, 0, 'g'},
+          {"writer",  no_argument,       0, 'w'},
+          {"binary",  no_argument,       0, 'B'},
+          {"pvalue",  no_argument,       0, 'p'},
+          {"name",    required_argument, 0, 'N'},
+          {"non-overlapping", no_argument, 0, 'o'},
+          {"adaptive", required_argument, 0, 'a'},
+          {"plan",    required_argument, 0, 'P'},
+          {"regions", required_argument, 0, 'r'},
+          {"softmask", no_argument,      0, 's'},
+          {"top",     required_argument, 0, 'T'},
           {0, 0, 0, 0}
       };
 
   while (1) {
-    int c = getopt_long(argc, argv, "dhfc:m:n:i:b:", long_options, &option_index);
+    int c = getopt_long(argc, argv, "dhfwBposc:m:l:k:n:i:b:t:g:N:a:P:r:T:", long_options, &option_index);
     if (c == -1)
       break;
     switch (c) {
@@ -1224,85 +3334,163 @@ main(int argc, char *argv[])
     case 'm':
       pwmFile = optarg;
       break;
+    case 'l':
+      libFile = optarg;
+      break;
+    case 'k':
+      cutoffFile = optarg;
+      break;
     case 'n':
       nbPipes = atoi(optarg);
       break;
     case 'i':
-      wordLen = atoi(optarg);
+      if (strcmp(optarg, "auto") == 0)
+        autoWordLen = 1;
+      else
+        wordLen = atoi(optarg);
       break;
     case 'b':
       bgProb = optarg;
       break;
+    case 't':
+      nbThreads = atoi(optarg);
+      break;
+    case 'g':
+      genomeFile = optarg;
+      break;
+    case 'w':
+      bgWriter = 1;
+      break;
+    case 'B':
+      binOut = 1;
+      break;
+    case 'p':
+      pvalOut = 1;
+      break;
+    case 'N':
+      pwmName = optarg;
+      break;
+    case 'o':
+      nonOverlap = 1;
+      break;
+    case 'a':
+      mb = strtol(optarg, &end, 10);
+      if (*end != 0 || mb <= 0 || mb > PLAN_MB_MAX) {
+        fprintf(stderr, "Invalid profile length %s (1 to %d Mb)\n", optarg, PLAN_MB_MAX);
+        return 1;
+      }
+      planMb = (int)mb;
+      break;
+    case 'P':
+      planFile = optarg;
+      break;
+    case 'r':
+      regionFile = optarg;
+      break;
+    case 's':
+      softMask = 1;
+      break;
+    case 'T':
+      topK = atoi(optarg);
+      if (topK <= 0) {
+        fprintf(stderr, "Invalid number of top matches %s\n", optarg);
+        return 1;
+      }
+      break;
     case '?':
       break;
     default:
       printf ("?? getopt returned character code 0%o ??\n", c);
     }
   }
-  if (optind > argc || pwmFile == NULL || cutOff == INT_MIN) {
+  if (optind > argc || (pwmFile == NULL) == (libFile == NULL)
+      || (cutOff == INT_MIN && cutoffFile == NULL) || (binOut && genomeFile == NULL)
+      || (binOut && pvalOut) || (planMb > 0 && planFile != NULL)
+      || (softMask && genomeFile != NULL) || (topK && nonOverlap)) {
     fprintf(stderr,
         "Usage: %s [options] -m <pwm_file> -c <cut-off> [<] [< file_in] [> file_out]\n"
+        "       %s [options] -l <pwm_library> -k <cut-off_file> [-c <cut-off>] [<] [< file_in] [> file_out]\n"
         "      where options are:\n"
         "        -d[--debug]            Print debug information\n"
         "        -h[--help]             Show this help text\n"
         "        -f[--forward]          Scan sequences in forward direction [def=bidirectional]\n"
         "        -i[--wordlen] <len>    Length of the words in the word index array [def=%d]\n"
+        "                               (from 12 on, only the words able to reach the cut-off are stored)\n"
+        "                               With 'auto', the length is chosen for each PWM from its cut-off\n"
+        "                               and the CPU cache sizes\n"
         "        -b[--bgcomp]           Background model (residue priors), e.g. : 25,25,25,25\n"
         "        -n[--pipes]            Number of pipe delimiters in FASTA header after which\n"
         "                               The sequence identifier is expected to start [def=%d]\n"
+        "        -t[--threads] <n>      Number of threads scanning sequence chunks in parallel [def=%d]\n"
+        "        -g[--genome] <file>    Scan the sequences of a genome pack file (built by genome_pack)\n"
+        "                               instead of FASTA input\n"
+        "        -l[--library] <file>   Scan for matches to all the PWMs of a library in a single pass\n"
+        "                               (each matrix starts with a '>' header line giving its name)\n"
+        "        -k[--cutoffs] <file>   Per-matrix cut-offs: one 'name cut-off' pair per line\n"
+        "                               (-c is used for matrices not listed)\n"
+        "        -w[--writer]           Write the output from a background thread, so that scanning\n"
+        "                               does not wait on the output pipe\n"
+        "        -B[--binary]           Write binary match records (requires -g), to be read by\n"
+        "                               filterOverlaps, mscan2bed, mscan_bed2sga and mscan_bin2txt\n"
+        "        -p[--pvalue]           Append the matrix name and the match p-value (computed under\n"
+        "                               the background model -b) as extra columns (not with -B)\n"
+        "        -N[--name] <name>      Matrix name (-m) [def=matrix file name without extension]\n"
+        "        -o[--non-overlapping]  Report the best of overlapping matches only (per PWM, both\n"
+        "                               strands), as filterOverlaps does on sorted matches\n"
+        "        -a[--adaptive] <Mb>    Choose the word length, core region and lateral order of each\n"
+        "                               PWM by profiling the scan of the first <Mb> megabases of the\n"
+        "                               first sequence (overrides -i); the plans are printed on stderr\n"
+        "        -P[--plan] <file>      Use the search plans printed by -a (not with -a)\n"
+        "        -r[--regions] <file>   Only scan the regions of a BED file (matches must lie within\n"
+        "                               a region; sequences are named as in the output)\n"
+        "        -s[--softmask]         Skip soft-masked (lowercase) bases, e.g. repeats, like N's\n"
+        "                               (FASTA input; use genome_pack -m for genome pack files)\n"
+        "        -T[--top] <K>          Report the K best matches of each PWM only, by decreasing score\n"
+        "                               (the cut-off is raised as better matches are found; not with -o)\n"
         "\n\tScan a DNA sequence file for matches to an INTEGER position weight matrix (PWM).\n"
         "\tThe DNA sequence file must be in FASTA format (<fasta_file>).\n"
         "\tThe matrix format is integer log-odds, where each column represents a nucleotide base\n"
-        "\tin the following order: A, C, G, T. The program returns a list of matches in BED format.\n\n",
-        argv[0], wordLen, nbPipes);
+        "\tin the following order: A, C, G, T. The program returns a list of matches in BED format.\n"
+        "\tIn library mode (-l), the matrix name is appended to each match as an extra column.\n"
+        "\tWith -m -p, the matrix name (-N) and the p-value of each match are appended.\n\n",
+        argv[0], argv[0], wordLen, nbPipes, nbThreads);
     return 1;
   }
-  /* Allocate space for both PWM and reverse PWM */
-  pwm = (int **)calloc((size_t)pwmLen+1, sizeof(int *));   /* Allocate rows (PWM length + 1) */
-  if (pwm == NULL) {
-    fprintf(stderr, "Could not allocate matrix array: %s(%d)\n",
-        strerror(errno), errno);
+  /* Read Matrix (or Matrix library) from file */
+  if (read_pwm(libFile != NULL ? libFile : pwmFile, libFile != NULL) != 0)
     return 1;
-  }
-  for (i = 0; i <= pwmLen; i++) {
-    pwm[i] = calloc((size_t)NUCL, sizeof(int));                 /* Allocate columns (NUCL=5) */
-    if (pwm[i] == NULL) {
-      fprintf(stderr, "Out of memory\n");
-      return 1;
-    }
-  }
-  pwm_r = (int **)calloc((size_t)pwmLen+1, sizeof(int *)); /* Allocate rows (PWM length + 1) */
-  if (pwm_r == NULL) {
-    fprintf(stderr, "Could not allocate matrix array: %s(%d)\n",
-        strerror(errno), errno);
+  if (binOut && nbPwms > UINT16_MAX) {
+    fprintf(stderr, "Too many matrices for binary output (max %d)\n", UINT16_MAX);
     return 1;
   }
-  for (i = 0; i <= pwmLen; i++) {
-    pwm_r[i] = calloc((size_t)NUCL, sizeof(int));                  /* Allocate rows (NUCL=5) */
-    if (pwm_r[i] == NULL) {
-      fprintf(stderr, "Out of memory\n");
+  /* Set per-matrix cut-offs */
+  for (i = 0; i < nbPwms; i++)
+    Pwms[i].cutOff = cutOff;
+  if (cutoffFile != NULL && read_cutoffs(cutoffFile) != 0)
+    return 1;
+  if (regionFile != NULL && read_regions(regionFile) != 0)
+    return 1;
+  for (i = 0; i < nbPwms; i++) {
+    if (Pwms[i].cutOff == INT_MIN) {
+      fprintf(stderr, "No cut-off value for matrix %s\n", Pwms[i].name);
       return 1;
     }
   }
-  /* Read Matrix from file */
-  if ((pwmLen = read_pwm(pwmFile)) < 0)
-    return 1;
 
-  if (argc > optind) {
+  if (genomeFile != NULL) {
+      fasta_in = NULL;
+  } else if (argc > optind) {
       if(!strcmp(argv[optind],"-")) {
-          fasta_in = stdin;
+          fasta_in = zfile_open(NULL, 0);
       } else {
-          fasta_in = fopen(argv[optind], "r");
-          if (fasta_in == NULL) {
-              fprintf(stderr, "Unable to open '%s': %s(%d)\n",
-                  argv[optind], strerror(errno), errno);
+          fasta_in = zfile_open(argv[optind], 0);
+          if (fasta_in == NULL)
              exit(EXIT_FAILURE);
-          }
           if (options.debug)
              fprintf(stderr, "Processing file %s\n", argv[optind]);
       }
   } else {
-      fasta_in = stdin;
+      fasta_in = zfile_open(NULL, 0);
   }
   /* Word index length */
   if (wordLen > 15) {
@@ -1311,8 +3499,6 @@ main(int argc, char *argv[])
   if (wordLen <= 0) {
     wordLen = 7;
   }
-  if (pwmLen < wordLen)
-    wordLen = pwmLen;
   /* Read background model */
   if (bgProb != NULL) {
     tokens = str_split(bgProb, ',');
@@ -1331,64 +3517,139 @@ main(int argc, char *argv[])
     }
   }
   process_bgcomp();
+  init_lateral();
+  if (autoWordLen)
+    read_cache_sizes();
+  /* Number of scanning threads */
+  if (nbThreads < 1)
+    nbThreads = 1;
+  if (nbThreads > THREADS_MAX)
+    nbThreads = THREADS_MAX;
   if (options.debug != 0) {
-    if (fasta_in != stdin) {
+    if (genomeFile != NULL) {
+      fprintf(stderr, "Genome pack File : %s\n", genomeFile);
+    } else if (argc > optind && strcmp(argv[optind], "-") != 0) {
       fprintf(stderr, "Fasta File : %s\n", argv[optind]);
     } else {
       fprintf(stderr, "Sequence File from STDIN\n");
     }
-    fprintf(stderr, "Motif length: %d\n", pwmLen);
-    fprintf(stderr, "Word index length: %d\n", wordLen);
-    fprintf(stderr, "Weight Matrix: \n\n");
-    for (int j = 1; j <= pwmLen; j++) {
-      for ( int i = 1; i < NUCL; i++) {
-        int mval = pwm[j][i];
-        fprintf(stderr, " %7d ", mval);
-      }
-      fprintf(stderr, "\n");
-    }
-    fprintf(stderr, "\n");
-    if (!options.forward) {
-    fprintf(stderr, "Reverse Weight Matrix:\n\n");
-      for (int j = 1; j <= pwmLen; j++) {
+    fprintf(stderr, "Number of matrices: %d\n", nbPwms);
+    if (autoWordLen)
+      fprintf(stderr, "Word index length: auto\n");
+    else
+      fprintf(stderr, "Word index length: %d\n", wordLen);
+    fprintf(stderr, "Number of threads: %d\n", nbThreads);
+    for (int k = 0; k < nbPwms; k++) {
+      pwm_p_t m = &Pwms[k];
+      fprintf(stderr, "Matrix %s: length %d, cut-off %d\n", m->name, m->pwmLen, m->cutOff);
+      fprintf(stderr, "Weight Matrix: \n\n");
+      for (int j = 1; j <= m->pwmLen; j++) {
         for ( int i = 1; i < NUCL; i++) {
-          int mval = pwm_r[j][i];
+          int mval = m->pwm[j][i];
           fprintf(stderr, " %7d ", mval);
         }
         fprintf(stderr, "\n");
       }
       fprintf(stderr, "\n");
+      if (!options.forward) {
+      fprintf(stderr, "Reverse Weight Matrix:\n\n");
+        for (int j = 1; j <= m->pwmLen; j++) {
+          for ( int i = 1; i < NUCL; i++) {
+            int mval = m->pwm_r[j][i];
+            fprintf(stderr, " %7d ", mval);
+          }
+          fprintf(stderr, "\n");
+        }
+        fprintf(stderr, "\n");
+      }
     }
     fprintf(stderr, "Background nucleotide frequencies:\n");
     for (int i = 1; i < NUCL; i++)
       fprintf(stderr, "bg[%i]=%1.2f ", i, bgcomp[i]);
     fprintf(stderr, "\n");
   }
-  /* Re-scale matrices */
-  process_pwm();
-  if (pwmLen > wordLen)
-    define_search_strategy();
+  /* Re-scale matrices and build word index tables */
+  for (i = 0; i < nbPwms; i++) {
+    pwm_p_t m = &Pwms[i];
+    m->wordLen = (m->pwmLen < wordLen) ? m->pwmLen : wordLen;
+    process_pwm(m);
+    if (autoWordLen && planMb == 0)
+      m->wordLen = auto_wordlen(m);
+    if (pvalOut) {
+      make_pvalues(m);
+      if (m->tag[0] == 0) {
+        free(m->tag);
+        if ((m->tag = malloc(strlen(m->name) + 2)) == NULL) {
+          perror("main: malloc");
+          return 1;
+        }
+        sprintf(m->tag, "\t%s", m->name);
+      }
+    }
+    /* With -a, the tables are built by plan_pwms() on the first sequence */
+    if (planMb > 0)
+      continue;
+    if (m->pwmLen > m->wordLen)
+      define_search_strategy(m);
 
-  if (make_tables() != 0)
+    if (make_tables(m) != 0)
+      return 1;
+  }
+  if (planFile != NULL && read_plans(planFile) != 0)
     return 1;
 
-  if (process_seq(fasta_in, argv[optind++]) != 0)
-    return 1;
+  if (nbThreads > 1)
+    start_pool();
+  init_output();
+  if (topK) {
+    if ((TopHeaps = (topk_t *) calloc((size_t)nbThreads * (size_t)nbPwms, sizeof(topk_t))) == NULL) {
+      perror("main: calloc");
+      exit(1);
+    }
+    for (int k = 0; k < nbPwms; k++)
+      Pwms[k].TopCut = Pwms[k].cutOff;
+    for (int k = 0; k < nbThreads * nbPwms; k++) {
+      if ((TopHeaps[k].heap = (topm_t *) malloc((size_t)topK * sizeof(topm_t))) == NULL) {
+        perror("main: malloc");
+        exit(1);
+      }
+      TopHeaps[k].cut = Pwms[k % nbPwms].cutOff;
+    }
+    Out.top = TopHeaps;
+  }
 
-  /* Free PWMs structures */
-  for (i = 0; i <= pwmLen; i++)
-    free(pwm[i]);
-  free(pwm);
-  /* Free word index arrays (Scores and z link arrays) */
-  free(z);
-  free(ScoreF);
-  free(Rfw);
-  if (!options.forward) {
-    free(ScoreR);
-    free(Rrv);
-    for (i = 0; i <= pwmLen; i++)
-      free(pwm_r[i]);
-    free(pwm_r);
+  if (genomeFile != NULL) {
+    if (process_genome(genomeFile) != 0)
+      return 1;
+  } else {
+    if (process_seq(fasta_in, argv[optind++]) != 0)
+      return 1;
+  }
+
+  if (nbThreads > 1)
+    stop_pool();
+  if (topK) {
+    Out.top = NULL;
+    put_top();
+  }
+  end_output();
+
+  /* Free PWMs structures and word index arrays */
+  for (int k = 0; k < nbPwms; k++) {
+    pwm_p_t m = &Pwms[k];
+    for (i = 0; i <= m->pwmLen; i++) {
+      free(m->pwm[i]);
+      free(m->pwm_r[i]);
+    }
+    free(m->pwm);
+    free(m->pwm_r);
+    free_tables(m);
+    free(m->Rfw);
+    free(m->Rrv);
+    free(m->Pval);
+    free(m->name);
+    free(m->tag);
   }
+  free(Pwms);
   return 0;
 }
@@ -32,6 +32,21 @@
     The PWM length is computed by the read_profile routine
   - Add a End Of tree Traversal flag (EOT) to control the loop across the tree
 */
+/*
+  - Keep a stack of partial (prefix) scores, updated by next_vertex and
+    by_pass, so that each vertex is scored in constant time
+  - Add a configurable position expansion order (-o option), e.g. most
+    informative positions first, with drop-off values computed for that order
+  - Search subtrees in parallel (-n option): the tree is split at a prefix
+    depth into independent subtrees, which are handed to a pool of threads
+  - Count tags (and letter counts for -m) by dynamic programming over the
+    scores (-x option), without enumerating them
+  - Output tags in FASTA format (-F option), ready for bowtie, or as a
+    binary stream of 2-bit packed tags (-B option, see tagrec.h)
+  - Enumerate strand-canonical tags (-C option): tags of the PWM and of its
+    reverse complement are searched jointly, and each tag is output once
+    for itself and its reverse complement, with both strand scores
+*/
 /*
 #define DEBUG
 */
@@ -44,6 +59,9 @@
 #include <ctype.h>
 #include <assert.h>
 #include <limits.h>
+#include <getopt.h>
+#include <pthread.h>
+#include "tagrec.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -52,14 +70,56 @@
 #define LMAX  100
 #define LINE_SIZE 1024
 #define MVAL_MAX 16
+#define THREADS_MAX 256
+#define TASKS_PER_THREAD 16
+#define OBUF_SIZE 1048576 /* 1MB */
+#define EXACT_LEN_MAX 63  /* 4^63 tags fit in 128 bits */
 
 typedef struct _options_t {
   unsigned int count;
+  char *order;
   int matrix;
+  int unordered;
+  int exact;
+  int fasta;
+  int binary;
+  int canonical;
   int help;
   int debug;
 } options_t;
 
+/* Output buffer: written out to fd when full (fd >= 0), or grown */
+typedef struct _obuf_t {
+  char *buf;
+  size_t len;
+  size_t size;
+  int fd;
+} obuf_t, *obuf_p_t;
+
+/* Tree traversal state of a thread */
+typedef struct _walk_t {
+  int *s;                       /* Vertex: nucleotide codes per level */
+  int *pscore;                  /* Partial score per level            */
+  int *rscore;                  /* Idem, reverse complement PWM (-C)  */
+  char *code;                   /* Tag base codes (-C)                */
+  int eot;                      /* End of Tree Traversal Flag         */
+  unsigned long long cnt;       /* Number of tags above cut-off       */
+  unsigned long *cntmat[NUCL];  /* Count Matrix (-m option)           */
+  obuf_t out;                   /* Thread output buffer               */
+  obuf_p_t dest;                /* Output buffer of the current tags  */
+} walk_t, *walk_p_t;
+
+/* Tag count of exact counting (-x option)                           */
+__extension__ typedef unsigned __int128 count_t;
+
+/* Work-stealing queue: range [lo..hi[ of task indices                */
+/* The owner takes tasks from the front, thieves from the back        */
+typedef struct _wsq_t {
+  pthread_mutex_t lock;
+  int lo;
+  int hi;
+} wsq_t, *wsq_p_t;
+
 /* We use a tree structure to represent all possible L-mers or
    strings of length L.
    Each vertex of the tree is represented as the paring of an
@@ -71,6 +131,13 @@ typedef struct _options_t {
    At each vertex we calculate a bound - the partial score and a
    drop-off value for the current score - and then decide whether
    or not to branch out further.
+   Level i of the tree corresponds to PWM position order[i]: by
+   default positions are expanded from left to right, but expanding
+   the most informative positions first lets the bound prune the
+   tree closer to the root.
+   The partial score of the vertex at level i is kept in pscore[i],
+   so that moving to a neighbouring vertex only adds the score of
+   the base that changed.
 */
 
 static options_t options;
@@ -82,22 +149,44 @@ float **probmat;                /* Letter Probabily Matrix  */
 unsigned long **cntmat;         /* Count Matrix             */
 
 int **profile;
+int *order;      /* Position Expansion Order (level -> pos) */
 
 int cutOff = INT_MIN;
 int K = 1;       /* Pseudo Weight (arbitrary, 1 by default) */
 int pwmLen = 10; /* Matrix Length                           */
-int EOT = 0;     /* End of Tree Traversal Flag              */
+
+int **prow;      /* PWM rows in expansion order             */
+int *doff;       /* Drop-off values per level               */
+int **rrow;      /* Reverse complement PWM rows (-C option) */
+int *rdoff;      /* Reverse complement drop-off values      */
+
+/* Thread pool (set by the --threads option)                  */
+int nbThreads = 1;
+int taskDepth = 0;   /* Prefix length of the subtrees (tasks) */
+walk_t *Walks;
+pthread_t *Workers;
+wsq_t *Queues;
+int *TaskPrefix;
+obuf_t *TaskOut;
+int nbTasks = 0;
+int maxTasks = 0;
+
+pthread_mutex_t PoolLock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t PoolWork = PTHREAD_COND_INITIALIZER;
+pthread_cond_t PoolDone = PTHREAD_COND_INITIALIZER;
+unsigned int JobId = 0;
+int Busy = 0;
+int Quit = 0;
+pthread_mutex_t OutLock = PTHREAD_MUTEX_INITIALIZER;
 
 void
-nucleotide_string(int *s, char *string)
+nucleotide_string(int *s, int len, char *string)
 {
-  int *n = s;
-  char *p = string;
+  int k;
 
-  for (; *n ;) {
-    *p++ = nucleotide[*n - 1];
-    n++;
-  }
+  /* Level k holds the base of PWM position order[k] */
+  for (k = 0; k < len; k++)
+    string[order[k]] = nucleotide[s[k] - 1];
 }
 
 int
@@ -189,22 +278,69 @@ min_score(int **p, int len, int *min)
 }
 
 int
-score(int **p, int *s)
+order_init(int **p, int len, char *spec, int *ord)
 {
-  int *n = s;
-  int value = 0;
-  int k = 0;
+  /* Set the position expansion order ord (tree level -> PWM position):
+       natural    positions from left to right (default)
+       info       most informative positions first, i.e. by decreasing
+                  range (max - min) of the position scores
+       p1,p2,...  explicit comma-separated list of positions (1-based)
+  */
+  int *range;
+  int i, j, k;
 
-  for (; *n ;) {
-    value += p[k][(*n)-1];
-    n++;
-    k++;
+  for (i = 0; i < len; i++)
+    ord[i] = i;
+  if (spec == NULL || strcmp(spec, "natural") == 0)
+    return 0;
+  if (strcmp(spec, "info") == 0) {
+    range = (int *) calloc(len, sizeof(int));
+    if (range == NULL) {
+      fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+      return -1;
+    }
+    for (i = 0; i < len; i++)
+      range[i] = find_max(p[i], NUCL) - find_min(p[i], NUCL);
+    /* Stable insertion sort: ties keep the natural order */
+    for (i = 1; i < len; i++) {
+      k = ord[i];
+      for (j = i; j > 0 && range[ord[j-1]] < range[k]; j--)
+        ord[j] = ord[j-1];
+      ord[j] = k;
+    }
+    free(range);
+    return 0;
+  }
+  char *seen = calloc(len, sizeof(char));
+  char *buf = strdup(spec);
+  char *tok, *end;
+  if (seen == NULL || buf == NULL) {
+    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+    return -1;
+  }
+  i = 0;
+  for (tok = strtok(buf, ","); tok != NULL; tok = strtok(NULL, ",")) {
+    k = (int) strtol(tok, &end, 10) - 1;
+    if (*end != 0 || k < 0 || k >= len || seen[k] || i >= len) {
+      fprintf(stderr, "Invalid position \"%s\" in expansion order \"%s\" (PWM length %d)\n", tok, spec, len);
+      free(seen);
+      free(buf);
+      return -1;
+    }
+    seen[k] = 1;
+    ord[i++] = k;
   }
-  return value;
+  free(seen);
+  free(buf);
+  if (i != len) {
+    fprintf(stderr, "Expansion order \"%s\" must list all %d PWM positions\n", spec, len);
+    return -1;
+  }
+  return 0;
 }
 
 void
-next_vertex(int *s, int *i, int len, int k)
+next_vertex(walk_p_t w, int *i, int top, int len, int k)
 {
   /* The integer i indicates the level on which the vertex lies (current vertex)
      the array s represents the vertex at level i, that is the sequence
@@ -212,20 +348,32 @@ next_vertex(int *s, int *i, int len, int k)
      The function returns the next vertex in the tree as a new pairing
      of an array (s) and a level (i).
      At level len, when the traversal is complete the function will return a
-     level number of 0, the root. The k parameter is k=NUCL.
+     level number of top, the root of the subtree being traversed (0 for the
+     whole tree). The k parameter is k=NUCL.
      The function next_vertex is used to navigate vertically through the tree,
      that is to explore a new branch of the tree.
+     The partial score stack ps is updated along: ps[j] is the score of the
+     vertex at level j.
   */
+  int *s = w->s;
+  int *ps = w->pscore;
+  int *rs = w->rscore;
   int j;
 
   if (*i < len) {
     s[*i] = 1;  /* Add nucleotide A, coded by 1 */
+    ps[*i + 1] = ps[*i] + prow[*i][0];
+    if (rs != NULL)
+      rs[*i + 1] = rs[*i] + rrow[*i][0];
     (*i)++;     /* Increment level              */
     return;
   } else {
-    for (j = len -1; j >= 0; j--) {
+    for (j = len -1; j >= top; j--) {
       if ( s[j] < k ) {  /* if A or C or G and last level  */
         s[j] += 1;       /* Change base: A->C, C->G, G->T  */
+        ps[j + 1] = ps[j] + prow[j][s[j] - 1];
+        if (rs != NULL)
+          rs[j + 1] = rs[j] + rrow[j][s[j] - 1];
         *i = j + 1;      /* Set level (to last)            */
         return;
       }
@@ -235,12 +383,12 @@ next_vertex(int *s, int *i, int len, int k)
   /* Complete tree traversal                                        */
   /* Set the complete tree traversal flag (EOT)                     */
   //printf(">>next_vertex: Complete tree traversal\n");
-  EOT = 1;
-  *i = 0;
+  w->eot = 1;
+  *i = top;
 }
 
 void
-by_pass(int *s, int *i, int k)
+by_pass(walk_p_t w, int *i, int top, int k)
 {
   /* The integer i indicates the level on which the vertex lies (current vertex)
      the array s represents the vertex at level i, that is the sequence
@@ -249,15 +397,21 @@ by_pass(int *s, int *i, int k)
      If we skip a vertex at level i of the tree, we can just increment s[i-1],
      unless s[i-1]=4 (T), in which case we need to jump up in the tree.
      At level len=L, when the traversal is complete the function will return a
-     level number of 0, the root.
+     level number of top, the root of the subtree being traversed.
      The function by_pass is used to move horizontally, based on the estimate
      of upper and lower bounds (sequence score).
   */
+  int *s = w->s;
+  int *ps = w->pscore;
+  int *rs = w->rscore;
   int j;
 
-  for (j = *i - 1; j >= 0; j--) {
+  for (j = *i - 1; j >= top; j--) {
     if ( s[j] < k ) {  /* if A or C or G and last level  */
       s[j] += 1;       /* Change base: A->C, C->G, G->T  */
+      ps[j + 1] = ps[j] + prow[j][s[j] - 1];
+      if (rs != NULL)
+        rs[j + 1] = rs[j] + rrow[j][s[j] - 1];
       *i = j + 1;      /* (re)Set level (to current)     */
       return;
     }
@@ -266,8 +420,8 @@ by_pass(int *s, int *i, int k)
   /* Complete tree traversal                                      */
   /* Set the complete tree traversal flag (EOT)                   */
   //printf(">>by_pass: Complete tree traversal\n");
-  EOT = 1;
-  *i = 0;
+  w->eot = 1;
+  *i = top;
 }
 
 int
@@ -415,10 +569,617 @@ read_profile(char *iFile)
   return l;
 }
 
+/* Output functions                                                     */
+static void
+write_out(int fd, const char *buf, size_t len)
+{
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("write");
+      exit(1);
+    }
+    buf += n;
+    len -= (size_t)n;
+  }
+}
+
+static void
+ob_flush(obuf_p_t ob)
+{
+  /* Write out the buffer contents (fd >= 0) */
+  if (ob->len == 0)
+    return;
+  pthread_mutex_lock(&OutLock);
+  write_out(ob->fd, ob->buf, ob->len);
+  pthread_mutex_unlock(&OutLock);
+  ob->len = 0;
+}
+
+static inline void
+ob_reserve(obuf_p_t ob, size_t n)
+{
+  /* Make room for n more bytes */
+  if (ob->len + n <= ob->size)
+    return;
+  if (ob->fd >= 0)
+    ob_flush(ob);
+  if (ob->len + n > ob->size) {
+    size_t size = (ob->size < 65536) ? 65536 : ob->size * 2;
+    while (size < ob->len + n)
+      size *= 2;
+    if ((ob->buf = realloc(ob->buf, size)) == NULL) {
+      perror("ob_reserve: realloc");
+      exit(1);
+    }
+    ob->size = size;
+  }
+}
+
+static inline char *
+put_int(char *p, int v)
+{
+  char tmp[12];
+  unsigned int u = (v < 0) ? 0u - (unsigned int)v : (unsigned int)v;
+  int n = 0;
+
+  if (v < 0)
+    *p++ = '-';
+  do {
+    tmp[n++] = (char)('0' + u % 10);
+    u /= 10;
+  } while (u);
+  while (n)
+    *p++ = tmp[--n];
+  return p;
+}
+
+static inline char *
+put_strands(char *p, int score, int rscore)
+{
+  /* Orientations of a strand-canonical tag that pass the cut-off */
+  if (score >= cutOff)
+    *p++ = '+';
+  if (rscore >= cutOff)
+    *p++ = '-';
+  return p;
+}
+
+static void
+report_tag(walk_p_t w, int score, int rscore)
+{
+  /* Count (and output) the tag of the current leaf (w->s, pwmLen)
+     With the -C option, rscore is the score of its reverse complement */
+  int flags = options.canonical ? TAG_CANONICAL : 0;
+  int k;
+
+  w->cnt++;
+  if ((!options.count) && (!options.matrix)) {
+    obuf_p_t ob = w->dest;
+    ob_reserve(ob, TAG_REC_SIZE(pwmLen, flags) + (size_t)pwmLen + 40);
+    char *p = ob->buf + ob->len;
+    if (options.binary) {
+      /* Score(s) and 2-bit packed bases (see tagrec.h) */
+      int32_t v[2] = {score, rscore};
+      size_t vlen = (flags & TAG_CANONICAL) ? 2 * sizeof(int32_t) : sizeof(int32_t);
+      unsigned char *b = (unsigned char *)p + vlen;
+      memcpy(p, v, vlen);
+      memset(b, 0, TAG_REC_SIZE(pwmLen, flags) - vlen);
+      for (k = 0; k < pwmLen; k++)
+        b[order[k] >> 2] |= (unsigned char)((w->s[k] - 1) << ((order[k] & 3) << 1));
+      p += TAG_REC_SIZE(pwmLen, flags);
+    } else if (options.fasta) {
+      /* >SCORE  (-C: >SCORE:RSCORE:STRANDS)                    */
+      /* TAG                                                    */
+      *p++ = '>';
+      p = put_int(p, score);
+      if (options.canonical) {
+        *p++ = ':';
+        p = put_int(p, rscore);
+        *p++ = ':';
+        p = put_strands(p, score, rscore);
+      }
+      *p++ = '\n';
+      nucleotide_string(w->s, pwmLen, p);
+      p += pwmLen;
+      *p++ = '\n';
+    } else {
+      /* TAG  SCORE  (-C: TAG  SCORE  RSCORE  STRANDS)          */
+      nucleotide_string(w->s, pwmLen, p);
+      p += pwmLen;
+      *p++ = ' ';
+      *p++ = ' ';
+      p = put_int(p, score);
+      if (options.canonical) {
+        *p++ = ' ';
+        *p++ = ' ';
+        p = put_int(p, rscore);
+        *p++ = ' ';
+        *p++ = ' ';
+        p = put_strands(p, score, rscore);
+      }
+      *p++ = '\n';
+    }
+    ob->len = (size_t)(p - ob->buf);
+  }
+  if (options.matrix) {
+    for (k = 0; k < pwmLen; k++)
+      w->cntmat[w->s[k]-1][order[k]]++;
+  }
+}
+
+static void
+add_task(int *s, int depth)
+{
+  /* Record the prefix s[0..depth-1] as the root of a subtree to search */
+  if (nbTasks == maxTasks) {
+    maxTasks = maxTasks ? maxTasks * 2 : 1024;
+    TaskPrefix = realloc(TaskPrefix, (size_t)maxTasks * depth * sizeof(int));
+    TaskOut = realloc(TaskOut, (size_t)maxTasks * sizeof(obuf_t));
+    if (TaskPrefix == NULL || TaskOut == NULL) {
+      fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+      exit(1);
+    }
+  }
+  memcpy(&TaskPrefix[(size_t)nbTasks * depth], s, depth * sizeof(int));
+  memset(&TaskOut[nbTasks], 0, sizeof(obuf_t));
+  TaskOut[nbTasks].fd = -1;
+  nbTasks++;
+}
+
+static void
+report_canonical(walk_p_t w)
+{
+  /* Report the tag of the current leaf if it or its reverse complement
+     passes the cut-off, and it is the smaller of both (so that each pair
+     is reported once, palindromes included) */
+  int score = w->pscore[pwmLen];
+  int rscore = w->rscore[pwmLen];
+  char *code = w->code;
+  int k, c = 0;
+
+  if (score < cutOff && rscore < cutOff)
+    return;
+  for (k = 0; k < pwmLen; k++)
+    code[order[k]] = (char)(w->s[k] - 1);
+  for (k = 0; k < pwmLen; k++) {
+    c = 3 - code[pwmLen - 1 - k];
+    if (code[k] != c)
+      break;
+  }
+  if (k < pwmLen && code[k] > c)
+    return;
+  report_tag(w, score, rscore);
+}
+
+static inline int
+in_bound(walk_p_t w, int i)
+{
+  /* Whether the subtree rooted at vertex (w->s, i) may hold tags */
+  if (w->pscore[i] >= (cutOff - doff[i]))
+    return 1;
+  return w->rscore != NULL && w->rscore[i] >= (cutOff - rdoff[i]);
+}
+
+static void
+traverse(walk_p_t w, int top, int depth)
+{
+  /* Traverse the subtree rooted at vertex (w->s, top) down to level depth.
+     Vertices at level depth are tags (depth = pwmLen) or, when splitting
+     the tree into tasks, prefixes of tags whose bound passes the cut-off.
+     With the -C option, a subtree is searched as long as the bound of
+     either the PWM or its reverse complement passes the cut-off.
+  */
+  int partialScore = 0;
+  int i = top;
+
+  w->eot = 0;
+  while ((i > top) || (!w->eot)) {
+    if (i < depth) {
+      if (!in_bound(w, i)) {
+        /* Bypass the entire subtree rooted at vertex (s,i) */
+        by_pass(w, &i, top, NUCL);
+      } else {
+        /* return next vertex in the tree (s, i) */
+        next_vertex(w, &i, top, depth, NUCL);
+      }
+    } else { /* We are at the last position/level of the tree  */
+      partialScore = w->pscore[depth];
+      if (depth < pwmLen) {
+        if (in_bound(w, depth))
+          add_task(w->s, depth);
+      } else if (w->rscore != NULL) {
+        report_canonical(w);
+      } else if (partialScore >= cutOff) {
+        report_tag(w, partialScore, 0);
+      } /* Score >= cutoff */
+      next_vertex(w, &i, top, depth, NUCL);
+    }
+  } /* While loop on tree traversal */
+}
+
+static void
+walk_init(walk_p_t w)
+{
+  int k;
+
+  w->s = calloc(pwmLen + 1, sizeof(int));
+  w->pscore = calloc(pwmLen + 1, sizeof(int));
+  if (w->s == NULL || w->pscore == NULL) {
+    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+    exit(1);
+  }
+  if (options.canonical) {
+    w->rscore = calloc(pwmLen + 1, sizeof(int));
+    w->code = calloc(pwmLen, sizeof(char));
+    if (w->rscore == NULL || w->code == NULL) {
+      fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+      exit(1);
+    }
+  }
+  w->cnt = 0;
+  if (options.matrix) {
+    for (k = 0; k < NUCL; k++) {
+      if ((w->cntmat[k] = calloc(pwmLen, sizeof(unsigned long))) == NULL) {
+        fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+        exit(1);
+      }
+    }
+  }
+  memset(&w->out, 0, sizeof(obuf_t));
+  w->out.fd = STDOUT_FILENO;
+  ob_reserve(&w->out, OBUF_SIZE);
+  w->dest = &w->out;
+}
+
+static void
+walk_free(walk_p_t w)
+{
+  int k;
+
+  ob_flush(&w->out);
+  free(w->out.buf);
+  free(w->s);
+  free(w->pscore);
+  free(w->rscore);
+  free(w->code);
+  if (options.matrix) {
+    for (k = 0; k < NUCL; k++)
+      free(w->cntmat[k]);
+  }
+}
+
+/* Multi-threaded search functions                                      */
+/* The tree is split into the subtrees rooted at the surviving prefixes */
+/* of taskDepth bases (tasks), in lexicographic order. Each thread owns */
+/* a contiguous range of tasks, which it processes from the front. Idle */
+/* threads steal tasks from the back of the largest range left.         */
+static int
+next_task(int self)
+{
+  wsq_p_t q = &Queues[self];
+  int c = -1;
+
+  pthread_mutex_lock(&q->lock);
+  if (q->lo < q->hi)
+    c = q->lo++;
+  pthread_mutex_unlock(&q->lock);
+  while (c < 0) {
+    int victim = -1;
+    int left = 0;
+    for (int k = 0; k < nbThreads; k++) {
+      pthread_mutex_lock(&Queues[k].lock);
+      if (Queues[k].hi - Queues[k].lo > left) {
+        left = Queues[k].hi - Queues[k].lo;
+        victim = k;
+      }
+      pthread_mutex_unlock(&Queues[k].lock);
+    }
+    if (victim < 0)  /* No work left */
+      break;
+    q = &Queues[victim];
+    pthread_mutex_lock(&q->lock);
+    if (q->lo < q->hi)
+      c = --q->hi;
+    pthread_mutex_unlock(&q->lock);
+  }
+  return c;
+}
+
+static void
+run_tasks(int self)
+{
+  walk_p_t w = &Walks[self];
+  int d = taskDepth;
+  int c, j;
+
+  while ((c = next_task(self)) >= 0) {
+    /* Set the vertex to the task prefix */
+    memcpy(w->s, &TaskPrefix[(size_t)c * d], d * sizeof(int));
+    for (j = 0; j < d; j++)
+      w->pscore[j + 1] = w->pscore[j] + prow[j][w->s[j] - 1];
+    if (w->rscore != NULL) {
+      for (j = 0; j < d; j++)
+        w->rscore[j + 1] = w->rscore[j] + rrow[j][w->s[j] - 1];
+    }
+    /* Tags go to the task buffer, written out in order, or straight */
+    /* to the thread output buffer (unordered output)                */
+    w->dest = options.unordered ? &w->out : &TaskOut[c];
+    traverse(w, d, pwmLen);
+  }
+}
+
+static void *
+worker(void *arg)
+{
+  int self = (int)(long)arg;
+  unsigned int job = 0;
+
+  pthread_mutex_lock(&PoolLock);
+  while (1) {
+    while (JobId == job && !Quit)
+      pthread_cond_wait(&PoolWork, &PoolLock);
+    if (Quit)
+      break;
+    job = JobId;
+    pthread_mutex_unlock(&PoolLock);
+    run_tasks(self);
+    pthread_mutex_lock(&PoolLock);
+    if (--Busy == 0)
+      pthread_cond_signal(&PoolDone);
+  }
+  pthread_mutex_unlock(&PoolLock);
+  return NULL;
+}
+
+static void
+start_pool()
+{
+  /* Thread 0 is the main thread, which also searches subtrees */
+  if ((Queues = (wsq_p_t)calloc((size_t)nbThreads, sizeof(wsq_t))) == NULL) {
+    perror("Queues: calloc");
+    exit(1);
+  }
+  if ((Workers = (pthread_t *)calloc((size_t)nbThreads, sizeof(pthread_t))) == NULL) {
+    perror("Workers: calloc");
+    exit(1);
+  }
+  for (int k = 0; k < nbThreads; k++)
+    pthread_mutex_init(&Queues[k].lock, NULL);
+  for (int k = 1; k < nbThreads; k++) {
+    if (pthread_create(&Workers[k], NULL, worker, (void *)(long)k) != 0) {
+      fprintf(stderr, "Could not create thread %d\n", k);
+      exit(1);
+    }
+  }
+}
+
+static void
+stop_pool()
+{
+  pthread_mutex_lock(&PoolLock);
+  Quit = 1;
+  pthread_cond_broadcast(&PoolWork);
+  pthread_mutex_unlock(&PoolLock);
+  for (int k = 1; k < nbThreads; k++)
+    pthread_join(Workers[k], NULL);
+  for (int k = 0; k < nbThreads; k++)
+    pthread_mutex_destroy(&Queues[k].lock);
+  free(Workers);
+  free(Queues);
+}
+
+static void
+run_batch(int from, int to)
+{
+  /* Search tasks [from..to[ on all threads */
+  int n = to - from;
+
+  for (int k = 0; k < nbThreads; k++) {
+    Queues[k].lo = from + (int)((long)n * k / nbThreads);
+    Queues[k].hi = from + (int)((long)n * (k + 1) / nbThreads);
+  }
+  pthread_mutex_lock(&PoolLock);
+  Busy = nbThreads - 1;
+  JobId++;
+  pthread_cond_broadcast(&PoolWork);
+  pthread_mutex_unlock(&PoolLock);
+  run_tasks(0);
+  pthread_mutex_lock(&PoolLock);
+  while (Busy > 0)
+    pthread_cond_wait(&PoolDone, &PoolLock);
+  pthread_mutex_unlock(&PoolLock);
+}
+
+static void
+search_mt(void)
+{
+  walk_p_t w = &Walks[0];
+  int batch;
+
+  /* Split the tree: choose the smallest depth giving enough tasks   */
+  /* to balance the load (or the depth set by the -D option)         */
+  if (taskDepth <= 0 || taskDepth >= pwmLen) {
+    for (taskDepth = 1; taskDepth < pwmLen - 1; taskDepth++) {
+      nbTasks = 0;
+      maxTasks = 0;  /* Prefix slots depend on the depth */
+      traverse(w, 0, taskDepth);
+      if (nbTasks >= TASKS_PER_THREAD * nbThreads)
+        break;
+    }
+  }
+  nbTasks = 0;
+  maxTasks = 0;
+  traverse(w, 0, taskDepth);
+  if (options.debug)
+    fprintf(stderr, "Searching %d subtrees (prefix length %d) on %d threads\n", nbTasks, taskDepth, nbThreads);
+  /* With ordered output, tasks are searched in batches, whose tags */
+  /* are written out in order once the whole batch is done          */
+  batch = options.unordered ? nbTasks : TASKS_PER_THREAD * nbThreads;
+  start_pool();
+  for (int from = 0; from < nbTasks; from += batch) {
+    int to = (from + batch < nbTasks) ? from + batch : nbTasks;
+    run_batch(from, to);
+    for (int c = from; c < to; c++) {
+      if (TaskOut[c].len > 0)
+        write_out(STDOUT_FILENO, TaskOut[c].buf, TaskOut[c].len);
+      free(TaskOut[c].buf);
+    }
+  }
+  stop_pool();
+  free(TaskPrefix);
+  free(TaskOut);
+}
+
+static char *
+count_str(count_t v, char *buf)
+{
+  /* Decimal representation of a 128-bit count */
+  char tmp[40];
+  int n = 0;
+
+  do {
+    tmp[n++] = (char)('0' + (int)(v % 10));
+    v /= 10;
+  } while (v);
+  for (int i = 0; i < n; i++)
+    buf[i] = tmp[n - 1 - i];
+  buf[n] = 0;
+  return buf;
+}
+
+static int
+exact_count(int **p, int len)
+{
+  /* Count the tags scoring at least cutOff without enumerating them.
+     This is the dynamic programming of matrix_prob over (rescaled) integer
+     scores, with uniform weights instead of background probabilities:
+       F[s]     number of prefixes of k positions scoring s (forward)
+       B[k][t]  number of suffixes from position k scoring at least t
+                (backward, cumulative)
+     The number of tags is B[0][cut] and, for the -m option, the number of
+     tags with base b at position k is sum_s F[s] * B[k+1][cut-s-p[k][b]],
+     computed along the forward pass.
+  */
+  int *lo = calloc(len, sizeof(int));       /* Row min (rescaling offset) */
+  int *srange = calloc(len + 1, sizeof(int)); /* Suffix score ranges      */
+  count_t **B = calloc(len + 1, sizeof(count_t *));
+  count_t *cnt[NUCL];
+  count_t total;
+  char num[48];
+  int cut = cutOff;
+  int range = 0;
+  int i, k, s, t;
+
+  if (len > EXACT_LEN_MAX) {
+    fprintf(stderr, "Exact counting is limited to PWMs of at most %d positions\n", EXACT_LEN_MAX);
+    return 1;
+  }
+  if (lo == NULL || srange == NULL || B == NULL) {
+    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+    return 1;
+  }
+  /* Rescale scores to set min=0 for each position */
+  for (k = 0; k < len; k++) {
+    lo[k] = find_min(p[k], NUCL);
+    cut -= lo[k];
+  }
+  for (k = len - 1; k >= 0; k--)
+    srange[k] = srange[k + 1] + find_max(p[k], NUCL) - lo[k];
+  range = srange[0];
+  if (options.debug)
+    fprintf(stderr, "Exact counting: rescaled cut-off %d, score range %d\n", cut, range);
+  /* Backward pass: suffix score distributions, then cumulated */
+  count_t *G = calloc(range + 1, sizeof(count_t));
+  count_t *H = calloc(range + 1, sizeof(count_t));
+  if (G == NULL || H == NULL) {
+    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+    return 1;
+  }
+  G[0] = 1;
+  for (k = len; k >= 0; k--) {
+    if (k < len) {
+      memset(H, 0, (srange[k] + 1) * sizeof(count_t));
+      for (t = 0; t <= srange[k + 1]; t++) {
+        if (G[t] == 0)
+          continue;
+        for (i = 0; i < NUCL; i++)
+          H[t + p[k][i] - lo[k]] += G[t];
+      }
+      count_t *tmp = G;
+      G = H;
+      H = tmp;
+    }
+    if ((B[k] = calloc(srange[k] + 2, sizeof(count_t))) == NULL) {
+      fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+      return 1;
+    }
+    for (t = srange[k]; t >= 0; t--)
+      B[k][t] = B[k][t + 1] + G[t];
+  }
+  total = (cut <= 0) ? B[0][0] : B[0][cut];
+  /* Forward pass: prefix score distributions and letter counts */
+  if (options.matrix) {
+    count_t *F = G;
+    count_t *N = H;
+    for (i = 0; i < NUCL; i++) {
+      if ((cnt[i] = calloc(len, sizeof(count_t))) == NULL) {
+        fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+        return 1;
+      }
+    }
+    memset(F, 0, (range + 1) * sizeof(count_t));
+    F[0] = 1;
+    for (k = 0; k < len; k++) {
+      int prange = range - srange[k];
+      memset(N, 0, (prange + find_max(p[k], NUCL) - lo[k] + 1) * sizeof(count_t));
+      for (s = 0; s <= prange; s++) {
+        if (F[s] == 0)
+          continue;
+        for (i = 0; i < NUCL; i++) {
+          int q = p[k][i] - lo[k];
+          t = cut - s - q;
+          if (t <= srange[k + 1])
+            cnt[i][k] += F[s] * B[k + 1][(t < 0) ? 0 : t];
+          N[s + q] += F[s];
+        }
+      }
+      count_t *tmp = F;
+      F = N;
+      N = tmp;
+    }
+    printf(">letter-probability matrix: alength= 4 w= %d nsites= %s\n", len, count_str(total, num));
+    if (options.debug)
+      fprintf(stderr,"Pseudo Weight: %d\n", K);
+    for (k = 0; k < len; k++) {
+      for (i = 0; i < NUCL; i++) {
+        if (options.debug)
+          fprintf(stderr,"cntmat[%d][%d]: %s , bg[%d]: %f corr= %f\n", i, k, count_str(cnt[i][k], num), i, bg[i], bg[i]*K);
+        probmat[i][k] = (float)((float)cnt[i][k] + (float)bg[i]*K)/(float)(total + K);
+        printf("%f ", probmat[i][k]);
+      }
+      printf("\n");
+    }
+    for (i = 0; i < NUCL; i++)
+      free(cnt[i]);
+  }
+  if (options.count || !options.matrix)
+    printf("Total nb of tags above cut-off (cutOff) : %s\n", count_str(total, num));
+  for (k = 0; k <= len; k++)
+    free(B[k]);
+  free(B);
+  free(G);
+  free(H);
+  free(lo);
+  free(srange);
+  return 0;
+}
+
 int
 BranchAndBound_motif_search(int **profile, int len)
 {
-  int partialScore = 0;
   unsigned long long lmer_cnt = 0;
   int i = 0;
   int j = 0;
@@ -428,24 +1189,44 @@ BranchAndBound_motif_search(int **profile, int len)
     fprintf(stderr, "BranchAndBound_motif_search:\n");
     fprintf(stderr, "Motif Length : %d\n", len);
   }
-  int *s = calloc(len + 1, sizeof(int));
-  if (s == NULL) {
-    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
-    return 1;
-  }
-  int *doff = calloc(len, sizeof(int));
+  doff = calloc(len, sizeof(int));
   if (doff == NULL) {
     fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
     return 1;
   }
-  char *lmer_str = calloc(len + 1, sizeof(char));
-  if (lmer_str == NULL) {
+  /* PWM rows in expansion order (level -> row) */
+  prow = calloc(len, sizeof(int *));
+  if (prow == NULL) {
     fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
     return 1;
   }
-  lmer_str[len] = '\0';
-  drop_off_init(profile, len, doff);
+  for (j = 0; j < len; j++)
+    prow[j] = profile[order[j]];
+  drop_off_init(prow, len, doff);
+  if (options.canonical) {
+    /* Reverse complement PWM rows in expansion order: the score of base
+       b at position j is that of the complement of b at len-1-j */
+    rdoff = calloc(len, sizeof(int));
+    rrow = calloc(len, sizeof(int *));
+    if (rdoff == NULL || rrow == NULL) {
+      fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+      return 1;
+    }
+    for (j = 0; j < len; j++) {
+      if ((rrow[j] = calloc(NUCL, sizeof(int))) == NULL) {
+        fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+        return 1;
+      }
+      for (k = 0; k < NUCL; k++)
+        rrow[j][k] = profile[len - 1 - order[j]][NUCL - 1 - k];
+    }
+    drop_off_init(rrow, len, rdoff);
+  }
   if (options.debug) {
+    fprintf(stderr, "expansion order: ");
+    for (j = 0; j < len; j++)
+      fprintf(stderr, "%d  ", order[j] + 1);
+    fprintf(stderr, "\n");
     fprintf(stderr, "drop-off values: ");
     for (j = 0; j < len; j++)
       fprintf(stderr, "%d  ", doff[j]);
@@ -458,38 +1239,44 @@ BranchAndBound_motif_search(int **profile, int len)
       fprintf(stderr, "Cut-off is greater than maximal matrix score (%d), exiting...\n", doff[0]);
     return 1;
   }
-  while ((i > 0) || (!EOT)) {
-    if (i < len) {
-      partialScore = score(profile, s);
-      if (partialScore < (cutOff - doff[i])) {
-        /* Bypass the entire subtree rooted at vertex (s,i) */
-        //printf(">>call by_pass for level %d part score %d\n", i, partialScore);
-        by_pass(s, &i, NUCL);
-      } else {
-        /* return next vertex in the tree (s, i) */
-        //printf(">>next_vertex for level %d part score %d\n", i, partialScore);
-        next_vertex(s, &i, len, NUCL);
-      }
-    } else { /* We are at the last position/level of the tree  */
-      partialScore = score(profile, s);
-      //printf(">>LEVEL %d score %d: calling next_vertex for LAST LEVEL ...\n", i, partialScore);
-      if (partialScore >= cutOff) {
-        lmer_cnt +=1;
-        //printf("cnt%d: first base %c score %d\n", lmer_cnt, nucleotide[*s - 1], partialScore);
-        //nucleotide_string(s, lmer_str);
-        if ((!options.count) && (!options.matrix)) {
-            nucleotide_string(s, lmer_str);
-            printf("%s  %d\n", lmer_str, partialScore);
-        }
-        //printf(">>TAG %llu: %s  %d\n", lmer_cnt, lmer_str, partialScore);
-        if (options.matrix) {
-          for (k = 0; k < len; k++)
-            cntmat[s[k]-1][k]++;
-        }
-      } /* Score >= cutoff */
-      next_vertex(s, &i, len, NUCL);
+  if (options.exact) {
+    free(doff);
+    free(prow);
+    return exact_count(profile, len);
+  }
+  /* One traversal state (and output buffer) per thread */
+  if ((Walks = (walk_p_t)calloc((size_t)nbThreads, sizeof(walk_t))) == NULL) {
+    fprintf(stderr, "Out of memory: %s(%d)\n",strerror(errno), errno);
+    return 1;
+  }
+  for (k = 0; k < nbThreads; k++)
+    walk_init(&Walks[k]);
+  if (options.binary && (!options.count) && (!options.matrix)) {
+    tag_hdr_t hdr;
+    memset(&hdr, 0, sizeof(hdr));
+    memcpy(hdr.magic, TAG_MAGIC, sizeof(hdr.magic));
+    hdr.version = TAG_VERSION;
+    hdr.len = (uint32_t)len;
+    hdr.flags = options.canonical ? TAG_CANONICAL : 0;
+    hdr.rec_size = (uint32_t)TAG_REC_SIZE(len, hdr.flags);
+    hdr.cutoff = cutOff;
+    write_out(STDOUT_FILENO, (const char *)&hdr, sizeof(hdr));
+  }
+  if (nbThreads > 1 && len > 1)
+    search_mt();
+  else
+    traverse(&Walks[0], 0, len);
+  /* Merge the per-thread counts */
+  for (k = 0; k < nbThreads; k++) {
+    lmer_cnt += Walks[k].cnt;
+    if (options.matrix) {
+      for (j = 0; j < NUCL; j++)
+        for (i = 0; i < len; i++)
+          cntmat[j][i] += Walks[k].cntmat[j][i];
     }
-  } /* While loop on tree traversal */
+    walk_free(&Walks[k]);
+  }
+  free(Walks);
   if (options.matrix) {
     printf(">letter-probability matrix: alength= 4 w= %d nsites= %llu\n", len, lmer_cnt);
     if (options.debug)
@@ -507,6 +1294,14 @@ BranchAndBound_motif_search(int **profile, int len)
   }
   if (options.count)
     printf("Total nb of tags above cut-off (cutOff) : %llu\n", lmer_cnt);
+  free(doff);
+  free(prow);
+  if (options.canonical) {
+    for (j = 0; j < len; j++)
+      free(rrow[j]);
+    free(rrow);
+    free(rdoff);
+  }
   return 0;
 }
 
@@ -564,8 +1359,29 @@ main(int argc, char *argv[])
   char *bgProb = NULL;
   char** tokens;
 
+  static struct option long_options[] =
+      {
+          {"cutoff",    required_argument, 0, 'c'},
+          {"debug",     no_argument,       0, 'd'},
+          {"help",      no_argument,       0, 'h'},
+          {"matrix",    no_argument,       0, 'm'},
+          {"pseudo",    required_argument, 0, 'k'},
+          {"order",     required_argument, 0, 'o'},
+          {"bg",        required_argument, 0, 'p'},
+          {"count",     no_argument,       0, 't'},
+          {"threads",   required_argument, 0, 'n'},
+          {"depth",     required_argument, 0, 'D'},
+          {"unordered", no_argument,       0, 'u'},
+          {"exact",     no_argument,       0, 'x'},
+          {"fasta",     no_argument,       0, 'F'},
+          {"binary",    no_argument,       0, 'B'},
+          {"canonical", no_argument,       0, 'C'},
+          {0, 0, 0, 0}
+      };
+  int option_index = 0;
+
   while (1) {
-    int c = getopt(argc, argv, "c:dhmk:p:t");
+    int c = getopt_long(argc, argv, "c:dhmk:o:p:tn:D:uxFBC", long_options, &option_index);
     if (c == -1)
       break;
     switch (c) {
@@ -584,12 +1400,36 @@ main(int argc, char *argv[])
       case 'k':
         K = atoi(optarg);
         break;
+      case 'o':
+        options.order = optarg;
+        break;
       case 'p':
         bgProb = optarg;
         break;
       case 't':
         options.count = 1;
         break;
+      case 'n':
+        nbThreads = atoi(optarg);
+        break;
+      case 'D':
+        taskDepth = atoi(optarg);
+        break;
+      case 'u':
+        options.unordered = 1;
+        break;
+      case 'x':
+        options.exact = 1;
+        break;
+      case 'F':
+        options.fasta = 1;
+        break;
+      case 'B':
+        options.binary = 1;
+        break;
+      case 'C':
+        options.canonical = 1;
+        break;
       case '?':
         break;
       default:
@@ -605,9 +1445,26 @@ main(int argc, char *argv[])
          "  \t\t -m        Output a base probability matrix instead of a list of sequences\n"
          "  \t\t -k        Define a pseudo weight distributed according to residue priors\n"
          "  \t\t           (Default is %d)\n"
+         "  \t\t -o <ord>  Define the position expansion order of the search tree:\n"
+         "  \t\t           natural (default), info (most informative positions first)\n"
+         "  \t\t           or a comma-separated list of positions (e.g. 3,4,2,1,5)\n"
          "  \t\t -p <bg>   Define residue priors (<bg>), by default : 0.25,0.25,0.25,0.25\n"
          "  \t\t           Note that nucleotide frequencies MUST BE comma-separated\n"
-         "  \t\t -t        Count all tags above the cut-off (testing mode)\n\n"
+         "  \t\t -t        Count all tags above the cut-off (testing mode)\n"
+         "  \t\t -n <n>    Search the tree with <n> threads [--threads] (default 1)\n"
+         "  \t\t -D <d>    Split the tree into subtrees at prefix length <d> [--depth]\n"
+         "  \t\t           (Default is automatic)\n"
+         "  \t\t -u        Output sequences in no particular order [--unordered]\n"
+         "  \t\t           (with -n, saves buffering the output of subtrees)\n"
+         "  \t\t -x        Count all tags above the cut-off by dynamic programming\n"
+         "  \t\t           instead of enumerating them [--exact] (also with -m)\n"
+         "  \t\t -F        Output sequences in FASTA format, with the score as header [--fasta]\n"
+         "  \t\t -B        Output sequences as a binary stream of 2-bit packed tags [--binary]\n"
+         "  \t\t           (see tagrec.h, converted back to text by mba_bin2txt)\n"
+         "  \t\t -C        Output strand-canonical sequences [--canonical]: each sequence\n"
+         "  \t\t           matching the PWM on either strand is output once for itself\n"
+         "  \t\t           and its reverse complement, with the scores of both and the\n"
+         "  \t\t           orientations (+, -) that pass the cut-off\n\n"
          "\n\tThe Matrix Branch-and-bound Algorithm (mba) generates sequences from a given\n"
          "\tposition weight matrix (PWM) and a cut-off value.\n"
          "\tOptionally, the program computes a probability matrix instead of generating\n"
@@ -617,7 +1474,9 @@ main(int argc, char *argv[])
          "\tThe PWM is included in the <PWM file_in> file.\n"
          "\tA value can be optionally specified as a cut-off for the matrix (default=0).\n"
          "\tIf the option '-t' is given, the program only counts the total number of\n"
-         "\tsequences that can be generated, given the PWM and the cut-off value.\n\n",
+         "\tsequences that can be generated, given the PWM and the cut-off value.\n"
+         "\tWith an expansion order other than natural, sequences are not listed in\n"
+         "\tlexicographic order.\n\n",
          argv[0], K);
     return 1;
   }
@@ -637,6 +1496,24 @@ main(int argc, char *argv[])
   }
   if ((pwmLen = read_profile(argv[optind++])) <= 0)
     return 1;
+  if (options.fasta && options.binary) {
+    fprintf(stderr, "Options -F (FASTA output) and -B (binary output) are mutually exclusive\n");
+    return 1;
+  }
+  if (options.canonical && (options.matrix || options.exact)) {
+    fprintf(stderr, "Option -C (canonical sequences) cannot be combined with -m or -x\n");
+    return 1;
+  }
+  if (nbThreads < 1)
+    nbThreads = 1;
+  if (nbThreads > THREADS_MAX)
+    nbThreads = THREADS_MAX;
+  if ((order = calloc(pwmLen, sizeof(int))) == NULL) {
+    fprintf(stderr, "Out of memory\n");
+    return 1;
+  }
+  if (order_init(profile, pwmLen, options.order, order) != 0)
+    return 1;
 
   if (options.debug != 0) {
     fprintf(stderr, "Cut-Off : %d\n", cutOff);
@@ -713,6 +1590,7 @@ main(int argc, char *argv[])
     for (i = 0; i < pwmLen; i++)
       free(profile[i]);
     free(profile);
+    free(order);
     if (options.matrix) {
       for (i = 0; i < NUCL; i++)
         free(cntmat[i]);
@@ -727,6 +1605,7 @@ main(int argc, char *argv[])
   for (i = 0; i < pwmLen; i++)
     free(profile[i]);
   free(profile);
+  free(order);
   if (options.matrix) {
     for (i = 0; i < NUCL; i++)
       free(cntmat[i]);
@@ -0,0 +1,201 @@
+/*
+  mba_bin2txt.c
+
+  Convert a binary tag stream (mba -B output) into the text or FASTA
+  output format of mba.
+
+  # Arguments:
+  # binary tag file (or stdin)
+
+  The tag length, record size, cut-off and whether tags are strand-canonical
+  (mba -C) are taken from the stream header (see tagrec.h).
+
+  Copyright (c) 2015
+  School of Life Sciences
+  Ecole Polytechnique Federale de Lausanne
+  and Swiss Institute of Bioinformatics
+  EPFL SV ISREC UPNAE
+  Station 15
+  CH-1015 Lausanne, Switzerland.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "tagrec.h"
+#ifdef DEBUG
+#include <mcheck.h>
+#endif
+
+#define TAG_BLOCK 4096
+
+typedef struct _options_t {
+  int help;
+  int debug;
+  int fasta;
+} options_t;
+
+static options_t options;
+
+static void
+put_strands(int score, int rscore, int cutOff)
+{
+  /* Orientations of a strand-canonical tag that pass the cut-off */
+  if (score >= cutOff)
+    putchar('+');
+  if (rscore >= cutOff)
+    putchar('-');
+}
+
+static int
+process_tags(FILE *input)
+{
+  static const char nucl[] = "ACGT";
+  tag_hdr_t h;
+  unsigned char *recs;
+  char *tag;
+  size_t n;
+  unsigned long k = 0;
+
+  if (fread(&h, sizeof(tag_hdr_t), 1, input) != 1
+      || memcmp(h.magic, TAG_MAGIC, sizeof(h.magic)) != 0) {
+    fprintf(stderr, "Input is not a binary tag stream (mba -B)\n");
+    return 1;
+  }
+  if (h.version != TAG_VERSION) {
+    fprintf(stderr, "Binary tag stream has version %u (expected %d)\n",
+            h.version, TAG_VERSION);
+    return 1;
+  }
+  if (h.len == 0 || h.rec_size != TAG_REC_SIZE(h.len, h.flags)) {
+    fprintf(stderr, "Invalid binary tag stream header (length %u, record size %u)\n",
+            h.len, h.rec_size);
+    return 1;
+  }
+  int canonical = (h.flags & TAG_CANONICAL) != 0;
+  size_t vlen = (canonical ? 2 : 1) * sizeof(int32_t);
+  if ((recs = malloc((size_t)TAG_BLOCK * h.rec_size)) == NULL
+      || (tag = malloc((size_t)h.len + 1)) == NULL) {
+    perror("process_tags: malloc");
+    exit(1);
+  }
+  tag[h.len] = 0;
+  while ((n = fread(recs, h.rec_size, TAG_BLOCK, input)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      const unsigned char *r = recs + i * h.rec_size;
+      const unsigned char *b = r + vlen;
+      int32_t v[2] = {0, 0};
+      memcpy(v, r, vlen);
+      for (uint32_t j = 0; j < h.len; j++)
+        tag[j] = nucl[TAG_BASE(b, j)];
+      if (options.fasta) {
+        /* >SCORE  (canonical: >SCORE:RSCORE:STRANDS) */
+        /* TAG                                        */
+        printf(">%d", v[0]);
+        if (canonical) {
+          printf(":%d:", v[1]);
+          put_strands(v[0], v[1], h.cutoff);
+        }
+        printf("\n%s\n", tag);
+      } else {
+        /* TAG  SCORE  (canonical: TAG  SCORE  RSCORE  STRANDS) */
+        printf("%s  %d", tag, v[0]);
+        if (canonical) {
+          printf("  %d  ", v[1]);
+          put_strands(v[0], v[1], h.cutoff);
+        }
+        putchar('\n');
+      }
+    }
+    k += n;
+  }
+  if (ferror(input)) {
+    perror("process_tags: fread");
+    return 1;
+  }
+  if (options.debug)
+    fprintf(stderr, "Number of tag records: %lu\n", k);
+  free(recs);
+  free(tag);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+#ifdef DEBUG
+  mcheck(NULL);
+  mtrace();
+#endif
+  FILE *input;
+
+  while (1) {
+    int c = getopt(argc, argv, "dhF");
+    if (c == -1)
+      break;
+    switch (c) {
+      case 'd':
+        options.debug = 1;
+        break;
+      case 'h':
+        options.help = 1;
+        break;
+      case 'F':
+        options.fasta = 1;
+        break;
+      case '?':
+        break;
+      default:
+        printf ("?? getopt returned character code 0%o ??\n", c);
+    }
+  }
+  if (optind > argc || options.help == 1) {
+    fprintf(stderr, "Usage: %s [options] [<] <binary tag file|stdin>\n"
+             "      where options are:\n"
+             "  \t\t -h     Show this help text\n"
+             "  \t\t -d     Produce debug information\n"
+             "  \t\t -F     Output tags in FASTA format (as mba -F)\n"
+             "\n\tConvert a binary tag stream (mba -B output) into the text output format\n"
+             "\tof mba (mba -F with -F). Strand-canonical streams (mba -B -C) give the\n"
+             "\toutput of mba -C.\n\n",
+             argv[0]);
+      return 1;
+  }
+  if (argc > optind) {
+      if(!strcmp(argv[optind],"-")) {
+          input = stdin;
+      } else {
+          input = fopen(argv[optind], "r");
+          if (NULL == input) {
+              fprintf(stderr, "Unable to open '%s': %s(%d)\n",
+                  argv[optind], strerror(errno), errno);
+             exit(EXIT_FAILURE);
+          }
+          if (options.debug)
+             fprintf(stderr, "Processing file %s\n", argv[optind]);
+      }
+  } else {
+      input = stdin;
+  }
+  if (process_tags(input) != 0)
+    return 1;
+  if (input != stdin)
+    fclose(input);
+  return 0;
+}
@@ -37,6 +37,8 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include "hashtable.h"
+#include "seqpack.h"
+#include "hitrec.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -49,6 +51,7 @@
 #define POS_MAX 16
 #define SCORE_MAX 12
 #define TAG_MAX 128
+#define HIT_BLOCK 4096
 
 typedef struct _options_t {
   int help;
@@ -72,6 +75,7 @@ typedef struct _bedline_t {
 bedline_t bed_reg;
 
 char *Species = NULL;
+char *genomeFile = NULL;
 static hash_table_t *ac_table = NULL;
 
 
@@ -301,7 +305,11 @@ process_bed(FILE *input, char *iFile)
 #endif
     int ac_len = strlen(seq_id) + 1;
     char *nb = hash_table_lookup(ac_table, seq_id, ac_len);
-    printf("chr%s\t%lu\t%lu\t%s\t%d\t%c\n", nb, start, end, tag, score, strand);
+    /* Extra columns (e.g. matrix name in library mode) are passed through */
+    if (*buf != 0)
+      printf("chr%s\t%lu\t%lu\t%s\t%d\t%c\t%s\n", nb, start, end, tag, score, strand, buf);
+    else
+      printf("chr%s\t%lu\t%lu\t%s\t%d\t%c\n", nb, start, end, tag, score, strand);
     k++;
   } /* End of While */
   if (options.debug) {
@@ -311,6 +319,60 @@ process_bed(FILE *input, char *iFile)
   return 0;
 }
 
+int
+process_hits(FILE *input, genome_t *g)
+{
+  /* Binary match records: chromosome names and matched words are */
+  /* taken from the genome pack                                   */
+  hit_hdr_t h;
+  hit_pwm_t *pwms;
+  hit_t hits[HIT_BLOCK];
+  char *word;
+  size_t n;
+  uint32_t maxLen = 0;
+
+  if (hit_read_header(input, &h, &pwms) != 0)
+    return 1;
+  if (hit_check_genome(&h, g) != 0)
+    return 1;
+  for (uint32_t p = 0; p < h.nb_pwms; p++) {
+    if (pwms[p].len > maxLen)
+      maxLen = pwms[p].len;
+  }
+  if ((word = malloc((size_t)maxLen + 1)) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  while ((n = fread(hits, sizeof(hit_t), HIT_BLOCK, input)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hit_t *hit = &hits[i];
+      if (!hit_valid(&h, pwms, g, hit)) {
+        fprintf(stderr, "Invalid match record\n");
+        return 1;
+      }
+      const pack_chrom_t *c = &g->chrom[hit->chrom];
+      uint32_t len = pwms[hit->pwm].len;
+      /* Sequences not in the chr_NC_gi table keep their accession, */
+      /* without the chr prefix                                     */
+      if (c->chr[0])
+        printf("chr%s", c->chr);
+      else
+        fputs(c->ac[0] ? c->ac : c->id, stdout);
+      printf("\t%u\t%u\t%s\t%d\t%c", hit->start,
+             hit->start + len, hit_word(g, hit, len, word), hit->score, hit->strand);
+      if (h.flags & HIT_NAMED)
+        printf("\t%s", pwms[hit->pwm].name);
+      putchar('\n');
+    }
+  }
+  free(word);
+  free(pwms);
+  if (input != stdin) {
+    fclose(input);
+  }
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -321,7 +383,7 @@ main(int argc, char *argv[])
   FILE *input;
 
   while (1) {
-    int c = getopt(argc, argv, "dhi:s:");
+    int c = getopt(argc, argv, "dhg:i:s:");
     if (c == -1)
       break;
     switch (c) {
@@ -338,18 +400,24 @@ main(int argc, char *argv[])
       case 's':
         Species = optarg;
         break;
+      case 'g':
+        genomeFile = optarg;
+        break;
       default:
         printf ("?? getopt returned character code 0%o ??\n", c);
     }
   }
-  if (optind > argc || options.help == 1 || Species == NULL) {
+  if (optind > argc || options.help == 1 || (Species == NULL && genomeFile == NULL)) {
     fprintf(stderr, "Usage: %s [options] -s <s_assembly (e.g. hg18)> [<] <Matrix Scan File|stdin>\n"
+             "       %s [options] -g <genome_pack> [<] <Matrix Scan binary File|stdin>\n"
              "      where options are:\n"
              "  \t\t -h     Show this help text\n"
              "  \t\t -d     Produce debug information\n"
              "  \t\t -i <path> Use <path> to locate the chr_NC_gi file (default is /home/local/db/genome)\n"
-             "\n\tConvert output of matrix_scan program into BED format.\n\n",
-             argv[0]);
+             "  \t\t -g <file> Read binary match records (matrix_scan -B) referring to genome pack <file>\n"
+             "\n\tConvert output of matrix_scan program into BED format.\n"
+             "\tFor binary match records, chromosome names and matched words are taken from the genome pack.\n\n",
+             argv[0], argv[0]);
       return 1;
   }
   if (argc > optind) {
@@ -368,6 +436,15 @@ main(int argc, char *argv[])
   } else {
       input = stdin;
   }
+  if (genomeFile != NULL) {
+    genome_t g;
+    if (genome_open(&g, genomeFile) != 0)
+      return 1;
+    if (process_hits(input, &g) != 0)
+      return 1;
+    genome_close(&g);
+    return 0;
+  }
   if (options.debug) {
     fprintf(stderr, " Arguments:\n");
     fprintf(stderr, " Matrix Scan file : %s\n", argv[optind]);
@@ -37,6 +37,8 @@
 #include <ctype.h>
 #include <sys/stat.h>
 #include "hashtable.h"
+#include "seqpack.h"
+#include "hitrec.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -50,6 +52,7 @@
 #define POS_MAX 16
 #define SCORE_MAX 12
 #define TAG_MAX 128
+#define HIT_BLOCK 4096
 
 typedef struct _options_t {
   char *dbPath;
@@ -74,6 +77,7 @@ bedline_t bed_reg;
 
 char *Species = NULL;
 char *Feature = NULL;
+char *genomeFile = NULL;
 
 static hash_table_t *ac_table = NULL;
 
@@ -324,6 +328,54 @@ process_bed(FILE *input, char *iFile)
   return 0;
 }
 
+int
+process_hits(FILE *input, genome_t *g, int named)
+{
+  /* Binary match records: accessions and matched words are taken */
+  /* from the genome pack. In library mode, the matrix name is    */
+  /* used as feature name unless one is given (-f).               */
+  hit_hdr_t h;
+  hit_pwm_t *pwms;
+  hit_t hits[HIT_BLOCK];
+  char *word;
+  size_t n;
+  uint32_t maxLen = 0;
+
+  if (hit_read_header(input, &h, &pwms) != 0)
+    return 1;
+  if (hit_check_genome(&h, g) != 0)
+    return 1;
+  for (uint32_t p = 0; p < h.nb_pwms; p++) {
+    if (pwms[p].len > maxLen)
+      maxLen = pwms[p].len;
+  }
+  if ((word = malloc((size_t)maxLen + 1)) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  while ((n = fread(hits, sizeof(hit_t), HIT_BLOCK, input)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hit_t *hit = &hits[i];
+      if (!hit_valid(&h, pwms, g, hit)) {
+        fprintf(stderr, "Invalid match record\n");
+        return 1;
+      }
+      const pack_chrom_t *c = &g->chrom[hit->chrom];
+      uint32_t len = pwms[hit->pwm].len;
+      unsigned long pos = (hit->strand == '+') ? hit->start + 1 : hit->start + len;
+      const char *ft = (!named && (h.flags & HIT_NAMED)) ? pwms[hit->pwm].name : Feature;
+      printf("%s\t%s\t%lu\t%c\t1\t%s\t%d\n", c->ac[0] ? c->ac : c->id, ft, pos, hit->strand,
+             hit_word(g, hit, len, word), hit->score);
+    }
+  }
+  free(word);
+  free(pwms);
+  if (input != stdin) {
+    fclose(input);
+  }
+  return 0;
+}
+
 int
 main(int argc, char *argv[])
 {
@@ -332,9 +384,10 @@ main(int argc, char *argv[])
   mtrace();
 #endif
   FILE *input;
+  int named = 0;
 
   while (1) {
-    int c = getopt(argc, argv, "dhf:s:");
+    int c = getopt(argc, argv, "dhf:g:i:s:");
     if (c == -1)
       break;
     switch (c) {
@@ -350,6 +403,10 @@ main(int argc, char *argv[])
         break;
       case 'f':
         Feature = optarg;
+        named = 1;
+        break;
+      case 'g':
+        genomeFile = optarg;
         break;
       case 's':
         Species = optarg;
@@ -358,17 +415,20 @@ main(int argc, char *argv[])
         printf ("?? getopt returned character code 0%o ??\n", c);
     }
   }
-  if (optind > argc || options.help == 1 || Species == NULL) {
+  if (optind > argc || options.help == 1 || (Species == NULL && genomeFile == NULL)) {
     fprintf(stderr, "Usage: %s [options] [-f <feature name>] -s <s_assembly (e.g. hg18)> [<] <BED file|stdin>\n"
+             "       %s [options] [-f <feature name>] -g <genome_pack> [<] <Matrix Scan binary file|stdin>\n"
              "      where options are:\n"
              "  \t\t -d     Produce debug information\n"
              "  \t\t -h     Show this help text\n"
              "  \t\t -i <path> Use <path> to locate the chr_NC_gi file (default is /home/local/db/genome)\n"
+             "  \t\t -g <file> Read binary match records (matrix_scan -B) referring to genome pack <file>\n"
              "\n\tConvert BED format (from PWM scan or sequence scan applications) into extended SGA format.\n"
              "\n\tBED lines have the following format:\n"
              "\t\t chr1\t28940\t28955\tGGCTTCCCAGAACCC\t1330\t+\n"
-             "\n\t representing the genomic position of a sequence tag match.\n\n",
-             argv[0]);
+             "\n\t representing the genomic position of a sequence tag match.\n"
+             "\tFor binary match records, accessions and matched words are taken from the genome pack.\n\n",
+             argv[0], argv[0]);
       return 1;
   }
   if (argc > optind) {
@@ -405,6 +465,15 @@ main(int argc, char *argv[])
     }
   }
 
+  if (genomeFile != NULL) {
+    genome_t g;
+    if (genome_open(&g, genomeFile) != 0)
+      return 1;
+    if (process_hits(input, &g, named) != 0)
+      return 1;
+    genome_close(&g);
+    return 0;
+  }
   if (options.debug) {
     fprintf(stderr, " Arguments:\n");
     fprintf(stderr, " Feature : %s\n", Feature);
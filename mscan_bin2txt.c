@@ -0,0 +1,170 @@
+/*
+  mscan_bin2txt.c
+
+  Convert binary match records (matrix_scan -B output) into the text
+  output format of matrix_scan.
+
+  # Arguments:
+  # genome pack file the matches refer to
+  # binary match file (or stdin)
+
+  Sequence identifiers (accessions) and matched words are taken from the
+  genome pack file (see seqpack.h and hitrec.h).
+
+  Copyright (c) 2015
+  School of Life Sciences
+  Ecole Polytechnique Federale de Lausanne
+  and Swiss Institute of Bioinformatics
+  EPFL SV ISREC UPNAE
+  Station 15
+  CH-1015 Lausanne, Switzerland.
+
+  This program is free software: you can redistribute it and/or modify
+  it under the terms of the GNU General Public License as published by
+  the Free Software Foundation, either version 3 of the License, or
+  (at your option) any later version.
+
+  This program is distributed in the hope that it will be useful,
+  but WITHOUT ANY WARRANTY; without even the implied warranty of
+  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+  GNU General Public License for more details.
+
+  You should have received a copy of the GNU General Public License
+  along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+*/
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include "seqpack.h"
+#include "hitrec.h"
+#ifdef DEBUG
+#include <mcheck.h>
+#endif
+
+#define HIT_BLOCK 4096
+
+typedef struct _options_t {
+  int help;
+  int debug;
+} options_t;
+
+static options_t options;
+
+char *genomeFile = NULL;
+
+static int
+process_hits(FILE *input, genome_t *g)
+{
+  hit_hdr_t h;
+  hit_pwm_t *pwms;
+  hit_t hits[HIT_BLOCK];
+  char *word;
+  size_t n;
+  unsigned long k = 0;
+  uint32_t maxLen = 0;
+
+  if (hit_read_header(input, &h, &pwms) != 0)
+    return 1;
+  if (hit_check_genome(&h, g) != 0)
+    return 1;
+  for (uint32_t p = 0; p < h.nb_pwms; p++) {
+    if (pwms[p].len > maxLen)
+      maxLen = pwms[p].len;
+  }
+  if ((word = malloc((size_t)maxLen + 1)) == NULL) {
+    perror("process_hits: malloc");
+    exit(1);
+  }
+  while ((n = fread(hits, sizeof(hit_t), HIT_BLOCK, input)) > 0) {
+    for (size_t i = 0; i < n; i++) {
+      hit_t *hit = &hits[i];
+      if (!hit_valid(&h, pwms, g, hit)) {
+        fprintf(stderr, "Invalid match record %lu\n", k + i);
+        return 1;
+      }
+      const pack_chrom_t *c = &g->chrom[hit->chrom];
+      uint32_t len = pwms[hit->pwm].len;
+      printf("%s\t%u\t%u\t%s\t%d\t%c", c->ac[0] ? c->ac : c->id, hit->start,
+             hit->start + len, hit_word(g, hit, len, word), hit->score, hit->strand);
+      if (h.flags & HIT_NAMED)
+        printf("\t%s", pwms[hit->pwm].name);
+      putchar('\n');
+    }
+    k += n;
+  }
+  if (options.debug)
+    fprintf(stderr, "Number of match records: %lu\n", k);
+  free(word);
+  free(pwms);
+  return 0;
+}
+
+int
+main(int argc, char *argv[])
+{
+#ifdef DEBUG
+  mcheck(NULL);
+  mtrace();
+#endif
+  FILE *input;
+  genome_t g;
+
+  while (1) {
+    int c = getopt(argc, argv, "dhg:");
+    if (c == -1)
+      break;
+    switch (c) {
+      case 'd':
+        options.debug = 1;
+        break;
+      case 'h':
+        options.help = 1;
+        break;
+      case 'g':
+        genomeFile = optarg;
+        break;
+      case '?':
+        break;
+      default:
+        printf ("?? getopt returned character code 0%o ??\n", c);
+    }
+  }
+  if (optind > argc || options.help == 1 || genomeFile == NULL) {
+    fprintf(stderr, "Usage: %s [options] -g <genome_pack> [<] <binary match file|stdin>\n"
+             "      where options are:\n"
+             "  \t\t -h     Show this help text\n"
+             "  \t\t -d     Produce debug information\n"
+             "\n\tConvert binary match records (matrix_scan -B output) into the text output\n"
+             "\tformat of matrix_scan. The genome pack file (-g) must be the one that was scanned.\n\n",
+             argv[0]);
+      return 1;
+  }
+  if (argc > optind) {
+      if(!strcmp(argv[optind],"-")) {
+          input = stdin;
+      } else {
+          input = fopen(argv[optind], "r");
+          if (NULL == input) {
+              fprintf(stderr, "Unable to open '%s': %s(%d)\n",
+                  argv[optind], strerror(errno), errno);
+             exit(EXIT_FAILURE);
+          }
+          if (options.debug)
+             fprintf(stderr, "Processing file %s\n", argv[optind]);
+      }
+  } else {
+      input = stdin;
+  }
+  if (genome_open(&g, genomeFile) != 0)
+    return 1;
+  if (process_hits(input, &g) != 0)
+    return 1;
+  genome_close(&g);
+  if (input != stdin)
+    fclose(input);
+  return 0;
+}
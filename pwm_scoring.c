@@ -41,6 +41,7 @@
 #include <assert.h>
 #include <float.h>
 #include <limits.h>
+#include "zfile.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -79,7 +80,7 @@ typedef struct _seq_t {
   int len;
 } seq_t, *seq_p_t;
 
-FILE *fasta_in;
+zfile_t *fasta_in;
 
 int seqCnt;
 double **lpm;                /* Letter Probability Matrix  */
@@ -573,31 +574,22 @@ process_seq_pwm(seq_p_t seq, FILE *out)
 }
 
 static int
-process_file(FILE *input, char *iFile, FILE *out)
+process_file(zfile_t *input, char *iFile, FILE *out)
 {
   char buf[BUF_SIZE], *res;
   seq_t seq;
   int mLen;
 
-  if (input == NULL) {
-    FILE *f = fopen(iFile, "r");
-    if (f == NULL) {
-      fprintf(stderr, "Could not open file %s: %s(%d)\n",
-        iFile, strerror(errno), errno);
-      return -1;
-    }
-    input = f;
-  }
+  if (input == NULL && (input = zfile_open(iFile, 0)) == NULL)
+    return -1;
   if (options.debug != 0)
     fprintf(stderr, "Processing file %s\n", iFile);
-  while ((res = fgets(buf, BUF_SIZE, input)) != NULL
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL
      && buf[0] != '>')
     ;
   if (res == NULL || buf[0] != '>') {
     fprintf(stderr, "Could not find a sequence in file %s\n", iFile);
-    if (input != stdin) {
-      fclose(input);
-    }
+    zfile_close(input);
     return -1;
   }
   seq.hdr = malloc(HDR_MAX * sizeof(char));
@@ -611,7 +603,7 @@ process_file(FILE *input, char *iFile, FILE *out)
     while (*s && !isspace(*s)) {
       if (i >= HDR_MAX) {
         fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return -1;
       }
       seq.hdr[i++] = *s++;
@@ -620,7 +612,7 @@ process_file(FILE *input, char *iFile, FILE *out)
       seq.hdr[i] = 0;
     /* Gobble sequence  */
     seq.len = 0;
-    while ((res = fgets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
+    while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
       char c;
       int n;
       s = buf;
@@ -666,9 +658,7 @@ process_file(FILE *input, char *iFile, FILE *out)
   }
   free(seq.hdr);
   free(seq.seq);
-  if (input != stdin) {
-    fclose(input);
-  }
+  zfile_close(input);
   return 0;
 }
 
@@ -903,23 +893,20 @@ main(int argc, char *argv[])
   }
   if (argc > optind) {
       if(!strcmp(argv[optind],"-")) {
-          fasta_in = stdin;
+          fasta_in = zfile_open(NULL, 0);
       } else {
-          fasta_in = fopen(argv[optind], "r");
-          if (fasta_in == NULL) {
-              fprintf(stderr, "Unable to open '%s': %s(%d)\n",
-                  argv[optind], strerror(errno), errno);
+          fasta_in = zfile_open(argv[optind], 0);
+          if (fasta_in == NULL)
              exit(EXIT_FAILURE);
-          }
           if (options.debug)
              fprintf(stderr, "Processing file %s\n", argv[optind]);
       }
   } else {
-      fasta_in = stdin;
+      fasta_in = zfile_open(NULL, 0);
   }
 
   if (options.debug != 0) {
-    if (fasta_in != stdin) {
+    if (argc > optind && strcmp(argv[optind], "-") != 0) {
       fprintf(stderr, "Fasta File : %s\n", argv[optind]);
     } else {
       fprintf(stderr, "Sequence File from STDIN\n");
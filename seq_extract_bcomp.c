@@ -13,6 +13,7 @@
   #   -c Compute base composition [forward strand]
   #   -b Compute base composition for both strands  [-c mode set]
   #   -r Compute base composition on reverse strand [-c mode set]
+  #   -g Read sequences from a genome pack file (built by genome_pack)
 
   Giovanna Ambrosini, EPFL/SV, giovanna.ambrosini@epfl.ch
 
@@ -48,6 +49,8 @@
 #include <ctype.h>
 #include <limits.h>
 #include "hashtable.h"
+#include "seqpack.h"
+#include "zfile.h"
 #ifdef DEBUG
 #include <mcheck.h>
 #endif
@@ -104,8 +107,9 @@ typedef struct _chr_bed_t {
 static chr_bed_t chr_record[NB_OF_CHRS];
 static int bed_rec_cnt[NB_OF_CHRS] = {0};
 
-FILE *fasta_in;
+zfile_t *fasta_in;
 char *bedFile = NULL;
+char *genomeFile = NULL;
 
 char *Species = NULL;
 
@@ -610,7 +614,7 @@ dump_bed()
 }
 
 static int
-process_seqs(FILE *input, const char *iFile)
+process_seqs(zfile_t *input, const char *iFile)
 {
   char buf[BUF_SIZE], *res;
   seq_t seq;
@@ -619,26 +623,17 @@ process_seqs(FILE *input, const char *iFile)
   int ac_len;
   int chr;
 
-  if (input == NULL) {
-    FILE *f = fopen(iFile, "r");
-    if (f == NULL) {
-      fprintf(stderr, "Could not open file %s: %s(%d)\n",
-        iFile, strerror(errno), errno);
-      return -1;
-    }
-    input = f;
-  }
+  if (input == NULL && (input = zfile_open(iFile, 0)) == NULL)
+    return -1;
   if (options.debug != 0)
     fprintf(stderr, "Processing file %s\n", iFile);
 
-  while ((res = fgets(buf, BUF_SIZE, input)) != NULL
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL
     && buf[0] != '>')
     ;
   if (res == NULL || buf[0] != '>') {
     fprintf(stderr, "Could not find a sequence in file %s\n", iFile);
-    if (input != stdin) {
-      fclose(input);
-    }
+    zfile_close(input);
     return 1;
   }
   seq.hdr = malloc(HDR_MAX * sizeof(char));
@@ -649,9 +644,7 @@ process_seqs(FILE *input, const char *iFile)
     /* Get the header */
     if (buf[0] != '>') {
       fprintf(stderr, "Could not find a sequence header in file %s\n", iFile);
-      if (input != stdin) {
-        fclose(input);
-      }
+      zfile_close(input);
       return 1;
     }
     char *s = buf;
@@ -660,7 +653,7 @@ process_seqs(FILE *input, const char *iFile)
     while (*s && !isspace(*s)) {
       if (i >= HDR_MAX) {
         fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       seq.hdr[i++] = *s++;
@@ -673,7 +666,7 @@ process_seqs(FILE *input, const char *iFile)
       s = strchr(s, '|');
       if (s == NULL) {
         fprintf(stderr, "Bad header line \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       s += 1;
@@ -684,7 +677,7 @@ process_seqs(FILE *input, const char *iFile)
     while (*s && *s != '|' && *s != ';' && !isspace(*s)) {
       if (seq.len >= AC_MAX) {
         fprintf(stderr, "process_seqs: AC from Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       seq.ac[seq.len++] = *s++;
@@ -693,7 +686,7 @@ process_seqs(FILE *input, const char *iFile)
       seq.ac[seq.len] = 0;
     /* Gobble sequence  */
     seq.len = 0;
-    while ((res = fgets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
+    while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
       char c;
       int n;
       s = buf;
@@ -776,12 +769,12 @@ process_seqs(FILE *input, const char *iFile)
     }   /* If Seq Length not NULL   */
   }
   free(seq.seq);
-  fclose(input);
+  zfile_close(input);
   return 0;
 }
 
 static int
-compute_bcomp_r(FILE *input, const char *iFile)
+compute_bcomp_r(zfile_t *input, const char *iFile)
 {
   char buf[BUF_SIZE], *res;
   seq_t seq;
@@ -792,26 +785,17 @@ compute_bcomp_r(FILE *input, const char *iFile)
   unsigned int bcomp[5] = {0, 0, 0, 0, 0};
   unsigned long tot_len = 0;
 
-  if (input == NULL) {
-    FILE *f = fopen(iFile, "r");
-    if (f == NULL) {
-      fprintf(stderr, "Could not open file %s: %s(%d)\n",
-        iFile, strerror(errno), errno);
-      return -1;
-    }
-    input = f;
-  }
+  if (input == NULL && (input = zfile_open(iFile, 0)) == NULL)
+    return -1;
   if (options.debug != 0)
     fprintf(stderr, "Processing file %s\n", iFile);
 
-  while ((res = fgets(buf, BUF_SIZE, input)) != NULL
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL
      && buf[0] != '>')
     ;
   if (res == NULL || buf[0] != '>') {
     fprintf(stderr, "Could not find a sequence in file %s\n", iFile);
-    if (input != stdin) {
-      fclose(input);
-    }
+    zfile_close(input);
     return 1;
   }
   seq.hdr = malloc(HDR_MAX * sizeof(char));
@@ -822,9 +806,7 @@ compute_bcomp_r(FILE *input, const char *iFile)
     /* Get the header */
     if (buf[0] != '>') {
       fprintf(stderr, "Could not find a sequence header in file %s\n", iFile);
-      if (input != stdin) {
-        fclose(input);
-      }
+      zfile_close(input);
       return 1;
     }
     char *s = buf;
@@ -833,7 +815,7 @@ compute_bcomp_r(FILE *input, const char *iFile)
     while (*s && !isspace(*s)) {
       if (i >= HDR_MAX) {
         fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       seq.hdr[i++] = *s++;
@@ -846,7 +828,7 @@ compute_bcomp_r(FILE *input, const char *iFile)
       s = strchr(s, '|');
       if (s == NULL) {
         fprintf(stderr, "Bad header line \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       s += 1;
@@ -867,7 +849,7 @@ compute_bcomp_r(FILE *input, const char *iFile)
       seq.ac[seq.len] = 0;
     /* Gobble sequence  */
     seq.len = 0;
-    while ((res = fgets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
+    while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
       char c;
       int n;
       s = buf;
@@ -958,12 +940,12 @@ compute_bcomp_r(FILE *input, const char *iFile)
   fprintf(stderr, "Total Sequence length: %lu\n", tot_len);
   printf("%.4f,%.4f,%.4f,%.4f\n", (double)((double)(bcomp[0]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[1]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[2]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[3]+bcomp[4]/4)/tot_len));
   free(seq.seq);
-  fclose(input);
+  zfile_close(input);
   return 0;
 }
 
 static int
-compute_bcomp(FILE *input, const char *iFile)
+compute_bcomp(zfile_t *input, const char *iFile)
 {
   char buf[BUF_SIZE], *res;
   seq_t seq;
@@ -974,26 +956,17 @@ compute_bcomp(FILE *input, const char *iFile)
   unsigned int bcomp[5] = {0, 0, 0, 0, 0};
   unsigned long tot_len = 0;
 
-  if (input == NULL) {
-    FILE *f = fopen(iFile, "r");
-    if (f == NULL) {
-      fprintf(stderr, "Could not open file %s: %s(%d)\n",
-        iFile, strerror(errno), errno);
-      return -1;
-    }
-    input = f;
-  }
+  if (input == NULL && (input = zfile_open(iFile, 0)) == NULL)
+    return -1;
   if (options.debug != 0)
     fprintf(stderr, "Processing file %s\n", iFile);
 
-  while ((res = fgets(buf, BUF_SIZE, input)) != NULL
+  while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL
      && buf[0] != '>')
     ;
   if (res == NULL || buf[0] != '>') {
     fprintf(stderr, "Could not find a sequence in file %s\n", iFile);
-    if (input != stdin) {
-      fclose(input);
-    }
+    zfile_close(input);
     return 1;
   }
   seq.hdr = malloc(HDR_MAX * sizeof(char));
@@ -1004,9 +977,7 @@ compute_bcomp(FILE *input, const char *iFile)
     /* Get the header */
     if (buf[0] != '>') {
       fprintf(stderr, "Could not find a sequence header in file %s\n", iFile);
-      if (input != stdin) {
-        fclose(input);
-      }
+      zfile_close(input);
       return 1;
     }
     char *s = buf;
@@ -1015,7 +986,7 @@ compute_bcomp(FILE *input, const char *iFile)
     while (*s && !isspace(*s)) {
       if (i >= HDR_MAX) {
         fprintf(stderr, "Fasta Header too long \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       seq.hdr[i++] = *s++;
@@ -1028,7 +999,7 @@ compute_bcomp(FILE *input, const char *iFile)
       s = strchr(s, '|');
       if (s == NULL) {
         fprintf(stderr, "Bad header line \"%s\" in file %s\n", res, iFile);
-        fclose(input);
+        zfile_close(input);
         return 1;
       }
       s += 1;
@@ -1049,7 +1020,7 @@ compute_bcomp(FILE *input, const char *iFile)
       seq.ac[seq.len] = 0;
     /* Gobble sequence  */
     seq.len = 0;
-    while ((res = fgets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
+    while ((res = zfile_gets(buf, BUF_SIZE, input)) != NULL && buf[0] != '>') {
       char c;
       int n;
       s = buf;
@@ -1143,7 +1114,131 @@ compute_bcomp(FILE *input, const char *iFile)
     printf("%.4f,%.4f,%.4f,%.4f\n", (double)((double)(bcomp[0]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[1]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[2]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[3]+bcomp[4]/4)/tot_len));
   }
   free(seq.seq);
-  fclose(input);
+  zfile_close(input);
+  return 0;
+}
+
+static void
+print_region(const char *hdr, const char *codes, unsigned long start, unsigned long end, char strand)
+{
+  /* Print extracted region [start..end] (codes[0] is base start) */
+  int cnt = 0;
+
+  printf(">%s [%lu..%lu]\n", hdr, start, end);
+  if (strand == '-') {
+    for (unsigned long i = end; i >= start; i--) {
+      cnt++;
+      printf("%c", r_nucleotide[(int)codes[i - start]]);
+      if ( ((cnt) % 70) == 0 ) {
+        printf("\n");
+      }
+    }
+  } else {
+    for (unsigned long i = start; i <= end; i++) {
+      cnt++;
+      printf("%c", nucleotide[(int)codes[i - start]]);
+      if ( ((cnt) % 70) == 0 ) {
+        printf("\n");
+      }
+    }
+  }
+  printf("\n");
+}
+
+static void
+count_bases(const char *codes, unsigned long len, int rev, unsigned int *bcomp)
+{
+  /* Add base counts of codes[0..len-1], complemented if rev is set */
+  for (unsigned long i = 0; i < len; i++) {
+    if (rev && codes[i] < 4)
+      bcomp[3-codes[i]]++;
+    else
+      bcomp[(int)codes[i]]++;
+  }
+}
+
+static int
+process_genome(const char *iFile)
+{
+  /* Extract BED regions or compute base composition from a genome  */
+  /* pack file: only the requested regions are decoded              */
+  genome_t g;
+  char *codes;
+  unsigned long mLen = FOUR_MEG;
+  unsigned int bcomp[5] = {0, 0, 0, 0, 0};
+  unsigned long tot_len = 0;
+
+  if (genome_open(&g, iFile) != 0)
+    return 1;
+  if (options.debug != 0)
+    fprintf(stderr, "Processing genome pack file %s (%u sequences)\n", iFile, g.hdr->nb_chroms);
+  if ((codes = malloc(mLen * sizeof(char))) == NULL) {
+    perror("process_genome: malloc");
+    exit(1);
+  }
+  for (int k = 0; k < (int)g.hdr->nb_chroms; k++) {
+    unsigned long len = g.chrom[k].len;
+    if (len == 0)
+      continue;
+    if (bedFile != NULL) {
+      /* Get Chromosome number (chromosome name stored in the pack) */
+      char chr_nb[PACK_NAME_MAX];
+      int chr;
+      strcpy(chr_nb, g.chrom[k].chr);
+      if (chr_nb[0] == 0)
+        continue;
+      change_chrnb(chr_nb);
+      chr = atoi(chr_nb);
+      if (chr < 1 || chr > NB_OF_CHRS)
+        continue;
+      if (options.debug != 0) {
+        fprintf (stderr, "Processing BED file for Chromosome %d\n", chr);
+        fprintf (stderr, "Number of BED Records %d\n", bed_rec_cnt[chr-1]);
+      }
+      /* Loop on BED Record Array for Chromosome chr   */
+      for (int r = 0; r < bed_rec_cnt[chr-1]; r++) {
+        unsigned long start = chr_record[chr-1].bed_array[r].start;
+        unsigned long end = chr_record[chr-1].bed_array[r].end;
+        char strand = chr_record[chr-1].bed_array[r].strand;
+        if (start < 1 || end < start || end > len)
+          continue;
+        if (end - start + 1 > mLen) {
+          mLen = end - start + 1;
+          if ((codes = realloc(codes, mLen * sizeof(char))) == NULL) {
+            perror("process_genome: realloc");
+            exit(1);
+          }
+        }
+        genome_decode(&g, k, (uint32_t)start, (uint32_t)end, codes);
+        if (options.bcomp) {
+          /* Reverse strand regions are complemented (unless -r) */
+          count_bases(codes, end - start + 1, (strand == '-') != (options.rev != 0), bcomp);
+          tot_len += end - start + 1;
+        } else {
+          print_region(g.chrom[k].id, codes, start, end, strand);
+        }
+      } /* End loop on BED Records  */
+    } else {  /* Process the entire sequence by blocks  */
+      for (unsigned long start = 1; start <= len; start += mLen) {
+        unsigned long end = (start + mLen - 1 < len) ? start + mLen - 1 : len;
+        genome_decode(&g, k, (uint32_t)start, (uint32_t)end, codes);
+        count_bases(codes, end - start + 1, options.rev, bcomp);
+      }
+      tot_len += len;
+    }
+  }
+  if (options.bcomp) {
+    fprintf(stderr, "Total Sequence length: %lu\n", tot_len);
+    if (options.both && !options.rev) {
+      double bcomp_at = (double)((double)(bcomp[0]+bcomp[4]/4)/tot_len);
+      double bcomp_cg = (double) 0.5 - bcomp_at;
+      printf("%.2f,%.2f,%.2f,%.2f\n", bcomp_at, bcomp_cg, bcomp_cg, bcomp_at);
+    } else {
+      printf("%.4f,%.4f,%.4f,%.4f\n", (double)((double)(bcomp[0]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[1]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[2]+bcomp[4]/4)/tot_len), (double)((double)(bcomp[3]+bcomp[4]/4)/tot_len));
+    }
+  }
+  free(codes);
+  genome_close(&g);
   return 0;
 }
 
@@ -1157,7 +1252,7 @@ main(int argc, char *argv[])
   options.acPipe = 2;
   options.dbPath = NULL;
   while (1) {
-    int c = getopt(argc, argv, "dhbcri:f:p:s:");
+    int c = getopt(argc, argv, "dhbcri:f:g:p:s:");
     if (c == -1)
       break;
     switch (c) {
@@ -1179,6 +1274,9 @@ main(int argc, char *argv[])
     case 'f':
       bedFile = optarg;
       break;
+    case 'g':
+      genomeFile = optarg;
+      break;
     case 'p':
       options.dbPath = optarg;
       break;
@@ -1206,6 +1304,8 @@ main(int argc, char *argv[])
         "        -i <int>    AC index (after how many pipes |) for FASTA header [%d]\n"
         "        -p <path>   Use <path> to locate the chr_NC_gi file [if BED file is given]\n"
         "                    [default is: $HOME/db/genome]\n"
+        "        -g <file>   Read sequences from a genome pack file (built by genome_pack)\n"
+        "                    instead of FASTA input\n"
         "\n\tExtract BED regions from a set of FASTA-formatted sequences.\n"
         "\tThe extracted sequences are written to standard output.\n"
         "\tOptionally (-c), the program computes and only outputs the base composition,\n"
@@ -1217,24 +1317,25 @@ main(int argc, char *argv[])
         argv[0], options.acPipe);
     return 1;
   }
-  if (argc > optind) {
+  if (genomeFile != NULL) {
+      fasta_in = NULL;
+  } else if (argc > optind) {
       if(!strcmp(argv[optind],"-")) {
-          fasta_in = stdin;
+          fasta_in = zfile_open(NULL, 0);
       } else {
-          fasta_in = fopen(argv[optind], "r");
-          if (fasta_in == NULL) {
-              fprintf(stderr, "Unable to open '%s': %s(%d)\n",
-                  argv[optind], strerror(errno), errno);
+          fasta_in = zfile_open(argv[optind], 0);
+          if (fasta_in == NULL)
              exit(EXIT_FAILURE);
-          }
           if (options.debug)
              fprintf(stderr, "Processing file %s\n", argv[optind]);
       }
   } else {
-      fasta_in = stdin;
+      fasta_in = zfile_open(NULL, 0);
   }
   if (options.debug != 0) {
-    if (fasta_in != stdin) {
+    if (genomeFile != NULL) {
+      fprintf(stderr, "Genome pack file : %s\n", genomeFile);
+    } else if (argc > optind && strcmp(argv[optind], "-") != 0) {
       fprintf(stderr, "FASTA sequence file : %s\n", argv[optind]);
     } else {
       fprintf(stderr, "FASTA sequence file from STDIN\n");
@@ -1249,14 +1350,21 @@ main(int argc, char *argv[])
     load_bed(bedFile);
     if (options.debug)
       dump_bed();
-    if (process_ac() == 0) {
+    if (genomeFile != NULL) {
+      /* Chromosome names are stored in the genome pack file */
+      if (options.debug)
+        fprintf(stderr, " Chromosome names taken from genome pack file\n");
+    } else if (process_ac() == 0) {
       if (options.debug)
         fprintf(stderr, " HASH Table for chromosome access identifier initialized\n");
     } else {
       return 1;
     }
   }
-  if (options.bcomp) {
+  if (genomeFile != NULL) {
+    if (process_genome(genomeFile) != 0)
+      return 1;
+  } else if (options.bcomp) {
     if (options.rev) {
       if (compute_bcomp_r(fasta_in, argv[optind++]) != 0)
         return 1;
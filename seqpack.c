@@ -0,0 +1,147 @@
+/**
+ * License GPLv3+
+ * @file seqpack.c
+ * @brief binary genome store: 2-bit packed bases, N-runs and chromosome index
+ */
+#include "seqpack.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+/**
+ * Function to map a genome pack file into memory (read-only, shared)
+ * @param g genome structure to be filled in
+ * @param file name of the genome pack file
+ * @returns 0 on success
+ * @returns -1 on error (a message is printed on stderr)
+ */
+int genome_open(genome_t *g, const char *file)
+{
+  struct stat st;
+  int fd = open(file, O_RDONLY);
+
+  if (fd < 0) {
+    fprintf(stderr, "Could not open file %s: %s(%d)\n",
+            file, strerror(errno), errno);
+    return -1;
+  }
+  if (fstat(fd, &st) != 0) {
+    fprintf(stderr, "Could not stat file %s: %s(%d)\n",
+            file, strerror(errno), errno);
+    close(fd);
+    return -1;
+  }
+  if ((size_t)st.st_size < sizeof(pack_hdr_t)) {
+    fprintf(stderr, "File %s is not a genome pack file\n", file);
+    close(fd);
+    return -1;
+  }
+  g->size = (size_t)st.st_size;
+  g->map = mmap(NULL, g->size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (g->map == MAP_FAILED) {
+    fprintf(stderr, "Could not map file %s: %s(%d)\n",
+            file, strerror(errno), errno);
+    return -1;
+  }
+  g->hdr = (pack_hdr_t *)g->map;
+  if (memcmp(g->hdr->magic, PACK_MAGIC, sizeof(g->hdr->magic)) != 0) {
+    fprintf(stderr, "File %s is not a genome pack file\n", file);
+    genome_close(g);
+    return -1;
+  }
+  if (g->hdr->version != PACK_VERSION) {
+    fprintf(stderr, "Genome pack file %s has version %u (expected %d)\n",
+            file, g->hdr->version, PACK_VERSION);
+    genome_close(g);
+    return -1;
+  }
+  if (g->hdr->index_off > g->size
+      || (g->size - g->hdr->index_off) / sizeof(pack_chrom_t) < g->hdr->nb_chroms) {
+    fprintf(stderr, "Genome pack file %s is truncated\n", file);
+    genome_close(g);
+    return -1;
+  }
+  g->chrom = (pack_chrom_t *)(g->map + g->hdr->index_off);
+  for (uint32_t k = 0; k < g->hdr->nb_chroms; k++) {
+    pack_chrom_t *c = &g->chrom[k];
+    if (c->seq_off + c->len / 4 + 1 > g->size
+        || c->run_off + (uint64_t)c->nb_runs * sizeof(nrun_t) > g->size) {
+      fprintf(stderr, "Genome pack file %s is truncated\n", file);
+      genome_close(g);
+      return -1;
+    }
+  }
+  /* Sequences are mostly read front to back */
+  madvise(g->map, g->size, MADV_SEQUENTIAL);
+  return 0;
+}
+
+/**
+ * Function to unmap a genome pack file
+ * @param g genome to be unmapped
+ */
+void genome_close(genome_t *g)
+{
+  munmap(g->map, g->size);
+  g->map = NULL;
+  g->hdr = NULL;
+  g->chrom = NULL;
+}
+
+/**
+ * Function to get the packed bases of sequence k
+ * @returns pointer to the packed bases (base 1 is in the first byte)
+ */
+const unsigned char * genome_seq(const genome_t *g, int k)
+{
+  return g->map + g->chrom[k].seq_off;
+}
+
+/**
+ * Function to get the N-runs of sequence k
+ * @returns pointer to the ordered array of N-runs
+ */
+const nrun_t * genome_nruns(const genome_t *g, int k)
+{
+  return (const nrun_t *)(g->map + g->chrom[k].run_off);
+}
+
+/**
+ * Function to decode bases [from..to] of sequence k
+ * @param codes output array of (to - from + 1) codes: 0..3 for ACGT, 4 for N
+ */
+void genome_decode(const genome_t *g, int k, uint32_t from, uint32_t to, char *codes)
+{
+  const unsigned char *seq = genome_seq(g, k);
+  const nrun_t *nrun = genome_nruns(g, k);
+  uint32_t nb_runs = g->chrom[k].nb_runs;
+  uint32_t lo = 0;
+  uint32_t hi = nb_runs;
+
+  if (to > g->chrom[k].len)
+    to = g->chrom[k].len;
+  if (from < 1 || from > to)
+    return;
+  for (uint32_t j = from; j <= to; j++)
+    codes[j - from] = (char)PACK_BASE(seq, j);
+  /* Find the first N-run that ends at or after from */
+  while (lo < hi) {
+    uint32_t mid = (lo + hi) / 2;
+    if (nrun[mid].end < from)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+  for (uint32_t r = lo; r < nb_runs && nrun[r].beg <= to; r++) {
+    uint32_t b = (nrun[r].beg < from) ? from : nrun[r].beg;
+    uint32_t e = (nrun[r].end > to) ? to : nrun[r].end;
+    memset(codes + (b - from), 4, e - b + 1);
+  }
+}
@@ -0,0 +1,118 @@
+/**
+ * License GPLv3+
+ * @file seqpack.h
+ * @brief binary genome store: 2-bit packed bases, N-runs and chromosome index
+ *
+ * A genome pack file (built by genome_pack) has the following layout:
+ *
+ *   pack_hdr_t                       file header
+ *   for each sequence:
+ *     packed bases                   (len/4 + 1) bytes, padded to 8 bytes
+ *     N-runs                         nb_runs x nrun_t
+ *   pack_chrom_t x nb_chroms         sequence index (at hdr->index_off)
+ *
+ * Bases are packed four per byte (2-bit codes A=0,C=1,G=2,T=3), base j
+ * being stored at bits 2*(j%4) of byte j/4. Positions start at 1, so the
+ * lowest two bits of the first byte are unused. N's (and any other
+ * non-ACGT letters) are stored as A's and recorded as an ordered list of
+ * runs [beg..end]. All integers are stored in native byte order.
+ */
+#ifndef _SEQPACK_H
+#define _SEQPACK_H
+
+#include <sys/types.h>
+#include <stdint.h>
+
+#define PACK_MAGIC "PWMSPACK"
+#define PACK_VERSION 1
+#define PACK_ID_MAX 256
+#define PACK_NAME_MAX 64
+
+/**
+ * Return the 2-bit code of the base at position j of packed sequence s
+ */
+#define PACK_BASE(s, j) (((s)[(j) >> 2] >> (((j) & 3) << 1)) & 3)
+
+/**
+ * @struct nrun_t "seqpack.h"
+ * @brief stretch of N's [beg..end] (1-based, inclusive)
+ */
+typedef struct _nrun_t {
+  uint32_t beg;
+  uint32_t end;
+} nrun_t, *nrun_p_t;
+
+/**
+ * @struct pack_hdr_t "seqpack.h"
+ * @brief genome pack file header
+ */
+typedef struct _pack_hdr_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t nb_chroms;
+  uint64_t index_off;
+  char assembly[PACK_NAME_MAX];
+} pack_hdr_t;
+
+/**
+ * @struct pack_chrom_t "seqpack.h"
+ * @brief genome pack index entry (one per sequence)
+ */
+typedef struct _pack_chrom_t {
+  /** FASTA sequence identifier, e.g. chr|NC_000001|NC_000001.10 */
+  char id[PACK_ID_MAX];
+  /** NCBI accession, e.g. NC_000001.10 */
+  char ac[PACK_NAME_MAX];
+  /** chromosome name from the chr_hdr/chr_NC_gi tables, e.g. 1 or X */
+  char chr[PACK_NAME_MAX];
+  uint32_t len;
+  uint32_t nb_runs;
+  uint64_t seq_off;
+  uint64_t run_off;
+} pack_chrom_t;
+
+/**
+ * @struct genome_t "seqpack.h"
+ * @brief memory-mapped genome pack
+ */
+typedef struct _genome_t {
+  unsigned char *map;
+  size_t size;
+  pack_hdr_t *hdr;
+  pack_chrom_t *chrom;
+} genome_t;
+
+/**
+ * Function to map a genome pack file into memory (read-only, shared)
+ * @param g genome structure to be filled in
+ * @param file name of the genome pack file
+ * @returns 0 on success
+ * @returns -1 on error (a message is printed on stderr)
+ */
+int genome_open(genome_t *g, const char *file);
+
+/**
+ * Function to unmap a genome pack file
+ * @param g genome to be unmapped
+ */
+void genome_close(genome_t *g);
+
+/**
+ * Function to get the packed bases of sequence k
+ * @returns pointer to the packed bases (base 1 is in the first byte)
+ */
+const unsigned char * genome_seq(const genome_t *g, int k);
+
+/**
+ * Function to get the N-runs of sequence k
+ * @returns pointer to the ordered array of N-runs
+ */
+const nrun_t * genome_nruns(const genome_t *g, int k);
+
+/**
+ * Function to decode bases [from..to] of sequence k
+ * @param codes output array of (to - from + 1) codes: 0..3 for ACGT, 4 for N
+ */
+void genome_decode(const genome_t *g, int k, uint32_t from, uint32_t to, char *codes);
+
+#endif
@@ -0,0 +1,60 @@
+/**
+ * License GPLv3+
+ * @file tagrec.h
+ * @brief binary tag records (mba -B output, read by mba_bin2txt)
+ *
+ * A binary tag stream has the following layout:
+ *
+ *   tag_hdr_t                        stream header
+ *   tag records ...                  up to the end of the stream
+ *
+ * Each record is hdr.rec_size bytes long: the tag score (int32_t),
+ * followed by the tag bases packed four per byte (2-bit codes A=0,C=1,
+ * G=2,T=3), base j being stored at bits 2*(j%4) of byte j/4 (as in genome
+ * pack files, see seqpack.h). Records are padded to 4 bytes. All integers
+ * are stored in native byte order.
+ *
+ * Strand-canonical streams (mba -C, TAG_CANONICAL flag) hold each tag once
+ * for itself and its reverse complement: records have a second score, that
+ * of the reverse complement, before the bases. An orientation passes if its
+ * score is at least hdr.cutoff.
+ */
+#ifndef _TAGREC_H
+#define _TAGREC_H
+
+#include <stdint.h>
+
+#define TAG_MAGIC "PWMSTAGS"
+#define TAG_VERSION 1
+/** Records hold strand-canonical tags with both strand scores */
+#define TAG_CANONICAL 1
+
+/**
+ * Size of a tag record of len bases
+ */
+#define TAG_REC_SIZE(len, flags) \
+  ((((flags) & TAG_CANONICAL) ? 2 : 1) * sizeof(int32_t) + (((len) + 15) / 16) * 4)
+
+/**
+ * Return the 2-bit code of base j of the packed bases b of a record
+ */
+#define TAG_BASE(b, j) (((b)[(j) >> 2] >> (((j) & 3) << 1)) & 3)
+
+/**
+ * @struct tag_hdr_t "tagrec.h"
+ * @brief binary tag stream header
+ */
+typedef struct _tag_hdr_t {
+  char magic[8];
+  uint32_t version;
+  uint32_t flags;
+  /** tag (PWM) length */
+  uint32_t len;
+  /** record size in bytes */
+  uint32_t rec_size;
+  /** PWM cut-off */
+  int32_t cutoff;
+  uint32_t pad;
+} tag_hdr_t;
+
+#endif
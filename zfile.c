@@ -0,0 +1,548 @@
+/**
+ * License GPLv3+
+ * @file zfile.c
+ * @brief transparent reading of plain, gzip and BGZF compressed text files
+ */
+#define _GNU_SOURCE
+#include "zfile.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <zlib.h>
+
+#define ZF_PLAIN 0
+#define ZF_GZIP 1
+#define ZF_BGZF 2
+
+/** Size of raw input reads */
+#define ZF_READ_SIZE 1048576
+/** Size of decompressed buffers */
+#define ZF_BUF_SIZE 4194304
+/** Number of decompressed buffers in flight */
+#define ZF_NBUF 3
+/** Size of a BGZF block header (gzip header with a BC extra subfield) */
+#define BGZF_HDR_SIZE 18
+#define BGZF_BLOCK_MAX 65536
+
+typedef struct _zbuf_t {
+  unsigned char *data;
+  size_t len;
+} zbuf_t;
+
+/* BGZF block, offsets are relative to the start of the batch */
+typedef struct _bgzf_blk_t {
+  size_t in;
+  size_t inLen;
+  size_t out;
+  size_t outLen;
+  unsigned long crc;
+} bgzf_blk_t;
+
+struct _zfile_t {
+  int fd;
+  int mode;
+  /* Raw input (only touched by the producer thread in gzip/BGZF mode) */
+  unsigned char *in;
+  size_t inSize;
+  size_t inLen;
+  size_t inPos;
+  int inEof;
+  /* Data being read */
+  unsigned char *cur;
+  size_t curLen;
+  size_t curPos;
+  int held;
+  /* Ring of decompressed buffers, filled by the producer thread */
+  zbuf_t ring[ZF_NBUF];
+  int head;
+  int count;
+  int done;
+  int stop;
+  pthread_t producer;
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  /* BGZF worker pool */
+  int nbWorkers;
+  pthread_t *workers;
+  bgzf_blk_t *blk;
+  int blkSize;
+  int nbBlk;
+  int nextBlk;
+  int doneBlk;
+  unsigned char *out;
+  unsigned long job;
+  int quit;
+  pthread_mutex_t jobLock;
+  pthread_cond_t work;
+  pthread_cond_t workDone;
+};
+
+static void
+zf_fatal(const char *msg)
+{
+  fprintf(stderr, "%s\n", msg);
+  exit(1);
+}
+
+static unsigned long
+le32(const unsigned char *p)
+{
+  return (unsigned long)p[0] | (unsigned long)p[1] << 8
+    | (unsigned long)p[2] << 16 | (unsigned long)p[3] << 24;
+}
+
+/*
+ * Make at least need bytes of raw input available from inPos (fewer at end
+ * of file), compacting and growing the input buffer as needed.
+ * Returns the number of bytes available.
+ */
+static size_t
+zf_avail(zfile_t *z, size_t need)
+{
+  if (z->inLen - z->inPos >= need || z->inEof)
+    return z->inLen - z->inPos;
+  if (z->inPos > 0) {
+    memmove(z->in, z->in + z->inPos, z->inLen - z->inPos);
+    z->inLen -= z->inPos;
+    z->inPos = 0;
+  }
+  if (need > z->inSize) {
+    size_t size = z->inSize * 2;
+    while (size < need)
+      size *= 2;
+    if ((z->in = realloc(z->in, size)) == NULL) {
+      perror("zf_avail: realloc");
+      exit(1);
+    }
+    z->inSize = size;
+  }
+  while (z->inLen < need) {
+    ssize_t n = read(z->fd, z->in + z->inLen, z->inSize - z->inLen);
+    if (n < 0) {
+      if (errno == EINTR)
+        continue;
+      perror("zf_avail: read");
+      exit(1);
+    }
+    if (n == 0) {
+      z->inEof = 1;
+      break;
+    }
+    z->inLen += (size_t)n;
+  }
+  return z->inLen - z->inPos;
+}
+
+/* Wait for a free ring buffer (NULL if the stream is being closed) */
+static zbuf_t *
+ring_get(zfile_t *z)
+{
+  zbuf_t *b = NULL;
+
+  pthread_mutex_lock(&z->lock);
+  while (z->count == ZF_NBUF && !z->stop)
+    pthread_cond_wait(&z->freed, &z->lock);
+  if (!z->stop)
+    b = &z->ring[(z->head + z->count) % ZF_NBUF];
+  pthread_mutex_unlock(&z->lock);
+  return b;
+}
+
+static void
+ring_put(zfile_t *z)
+{
+  pthread_mutex_lock(&z->lock);
+  z->count++;
+  pthread_cond_signal(&z->filled);
+  pthread_mutex_unlock(&z->lock);
+}
+
+static void
+ring_done(zfile_t *z)
+{
+  pthread_mutex_lock(&z->lock);
+  z->done = 1;
+  pthread_cond_signal(&z->filled);
+  pthread_mutex_unlock(&z->lock);
+}
+
+static void *
+gzip_producer(void *arg)
+{
+  zfile_t *z = arg;
+  z_stream s;
+  zbuf_t *b;
+  int member = 0;
+  int end = 0;
+
+  memset(&s, 0, sizeof(s));
+  if (inflateInit2(&s, 15 + 32) != Z_OK)
+    zf_fatal("gzip_producer: inflateInit2 failed");
+  while (!end && (b = ring_get(z)) != NULL) {
+    s.next_out = b->data;
+    s.avail_out = ZF_BUF_SIZE;
+    while (s.avail_out > 0) {
+      if (zf_avail(z, 1) == 0) {
+        if (member)
+          zf_fatal("Compressed input is truncated");
+        end = 1;
+        break;
+      }
+      s.next_in = z->in + z->inPos;
+      s.avail_in = (uInt)(z->inLen - z->inPos);
+      member = 1;
+      int ret = inflate(&s, Z_NO_FLUSH);
+      z->inPos = z->inLen - s.avail_in;
+      if (ret == Z_STREAM_END) {
+        /* Concatenated gzip members */
+        member = 0;
+        inflateReset(&s);
+      } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+        zf_fatal("Corrupt gzip input");
+      }
+    }
+    b->len = ZF_BUF_SIZE - s.avail_out;
+    if (b->len > 0)
+      ring_put(z);
+  }
+  inflateEnd(&s);
+  ring_done(z);
+  return NULL;
+}
+
+static void
+bgzf_inflate(z_stream *s, const unsigned char *in, const bgzf_blk_t *b,
+             unsigned char *out)
+{
+  if (b->outLen == 0)
+    return;
+  inflateReset(s);
+  s->next_in = (unsigned char *)in;
+  s->avail_in = (uInt)b->inLen;
+  s->next_out = out;
+  s->avail_out = (uInt)b->outLen;
+  if (inflate(s, Z_FINISH) != Z_STREAM_END || s->avail_out != 0
+      || crc32(crc32(0L, Z_NULL, 0), out, (uInt)b->outLen) != b->crc)
+    zf_fatal("Corrupt BGZF block");
+}
+
+/* Inflate blocks of the current batch until none is left */
+static void
+bgzf_blocks(zfile_t *z, z_stream *s)
+{
+  pthread_mutex_lock(&z->jobLock);
+  while (z->nextBlk < z->nbBlk) {
+    bgzf_blk_t b = z->blk[z->nextBlk++];
+    const unsigned char *in = z->in + z->inPos + b.in;
+    unsigned char *out = z->out + b.out;
+    pthread_mutex_unlock(&z->jobLock);
+    bgzf_inflate(s, in, &b, out);
+    pthread_mutex_lock(&z->jobLock);
+    if (++z->doneBlk == z->nbBlk)
+      pthread_cond_signal(&z->workDone);
+  }
+  pthread_mutex_unlock(&z->jobLock);
+}
+
+static void *
+bgzf_worker(void *arg)
+{
+  zfile_t *z = arg;
+  z_stream s;
+  unsigned long job = 0;
+
+  memset(&s, 0, sizeof(s));
+  if (inflateInit2(&s, -15) != Z_OK)
+    zf_fatal("bgzf_worker: inflateInit2 failed");
+  pthread_mutex_lock(&z->jobLock);
+  while (1) {
+    while (!z->quit && z->job == job)
+      pthread_cond_wait(&z->work, &z->jobLock);
+    if (z->quit)
+      break;
+    job = z->job;
+    pthread_mutex_unlock(&z->jobLock);
+    bgzf_blocks(z, &s);
+    pthread_mutex_lock(&z->jobLock);
+  }
+  pthread_mutex_unlock(&z->jobLock);
+  inflateEnd(&s);
+  return NULL;
+}
+
+/*
+ * Parse the BGZF block starting pos bytes after inPos.
+ * Returns the block size, or 0 at end of input.
+ */
+static size_t
+bgzf_block(zfile_t *z, size_t pos, bgzf_blk_t *b)
+{
+  size_t avail = zf_avail(z, pos + BGZF_HDR_SIZE);
+  size_t xlen, bsize = 0;
+  const unsigned char *h;
+
+  if (avail == pos)
+    return 0;
+  if (avail < pos + BGZF_HDR_SIZE)
+    zf_fatal("Compressed input is truncated");
+  h = z->in + z->inPos + pos;
+  if (h[0] != 31 || h[1] != 139 || h[2] != 8 || !(h[3] & 4))
+    zf_fatal("Input is not in BGZF format");
+  xlen = (size_t)h[10] | (size_t)h[11] << 8;
+  if (zf_avail(z, pos + 12 + xlen) < pos + 12 + xlen)
+    zf_fatal("Compressed input is truncated");
+  h = z->in + z->inPos + pos;
+  for (size_t k = 12; k + 4 <= 12 + xlen; k += 4 + ((size_t)h[k + 2] | (size_t)h[k + 3] << 8)) {
+    if (h[k] == 'B' && h[k + 1] == 'C' && h[k + 2] == 2 && h[k + 3] == 0)
+      bsize = ((size_t)h[k + 4] | (size_t)h[k + 5] << 8) + 1;
+  }
+  if (bsize < 12 + xlen + 8)
+    zf_fatal("Input is not in BGZF format");
+  if (zf_avail(z, pos + bsize) < pos + bsize)
+    zf_fatal("Compressed input is truncated");
+  h = z->in + z->inPos + pos;
+  b->in = pos + 12 + xlen;
+  b->inLen = bsize - 12 - xlen - 8;
+  b->crc = le32(h + bsize - 8);
+  b->outLen = le32(h + bsize - 4);
+  if (b->outLen > BGZF_BLOCK_MAX)
+    zf_fatal("Corrupt BGZF block");
+  return bsize;
+}
+
+/*
+ * The producer gathers as many whole blocks as fit in a ring buffer, then
+ * inflates them together with the workers, each block going straight to
+ * its place in the buffer (block sizes are known from the gzip trailers).
+ */
+static void *
+bgzf_producer(void *arg)
+{
+  zfile_t *z = arg;
+  z_stream s;
+  zbuf_t *b;
+
+  memset(&s, 0, sizeof(s));
+  if (inflateInit2(&s, -15) != Z_OK)
+    zf_fatal("bgzf_producer: inflateInit2 failed");
+  while ((b = ring_get(z)) != NULL) {
+    bgzf_blk_t blk;
+    size_t pos = 0, out = 0, bsize;
+    int n = 0;
+
+    while ((bsize = bgzf_block(z, pos, &blk)) > 0) {
+      if (out + blk.outLen > ZF_BUF_SIZE)
+        break;
+      if (n == z->blkSize) {
+        z->blkSize = z->blkSize ? 2 * z->blkSize : 256;
+        if ((z->blk = realloc(z->blk, (size_t)z->blkSize * sizeof(bgzf_blk_t))) == NULL) {
+          perror("bgzf_producer: realloc");
+          exit(1);
+        }
+      }
+      blk.out = out;
+      z->blk[n++] = blk;
+      pos += bsize;
+      out += blk.outLen;
+    }
+    if (n == 0)
+      break;
+    pthread_mutex_lock(&z->jobLock);
+    z->out = b->data;
+    z->nbBlk = n;
+    z->nextBlk = 0;
+    z->doneBlk = 0;
+    z->job++;
+    pthread_cond_broadcast(&z->work);
+    pthread_mutex_unlock(&z->jobLock);
+    bgzf_blocks(z, &s);
+    pthread_mutex_lock(&z->jobLock);
+    while (z->doneBlk < z->nbBlk)
+      pthread_cond_wait(&z->workDone, &z->jobLock);
+    pthread_mutex_unlock(&z->jobLock);
+    z->inPos += pos;
+    b->len = out;
+    if (out > 0)
+      ring_put(z);
+  }
+  inflateEnd(&s);
+  ring_done(z);
+  return NULL;
+}
+
+/*
+ * Make the next chunk of text current.
+ * Returns 0 at end of file.
+ */
+static int
+zf_next(zfile_t *z)
+{
+  if (z->mode == ZF_PLAIN) {
+    /* Bytes read for format detection come first */
+    if (z->inPos == z->inLen) {
+      z->inPos = z->inLen = 0;
+      z->inEof = 0;
+      zf_avail(z, 1);
+    }
+    z->cur = z->in + z->inPos;
+    z->curLen = z->inLen - z->inPos;
+    z->curPos = 0;
+    z->inPos = z->inLen;
+    return z->curLen > 0;
+  }
+  pthread_mutex_lock(&z->lock);
+  if (z->held) {
+    z->head = (z->head + 1) % ZF_NBUF;
+    z->count--;
+    z->held = 0;
+    pthread_cond_signal(&z->freed);
+  }
+  while (z->count == 0 && !z->done)
+    pthread_cond_wait(&z->filled, &z->lock);
+  if (z->count > 0) {
+    z->cur = z->ring[z->head].data;
+    z->curLen = z->ring[z->head].len;
+    z->curPos = 0;
+    z->held = 1;
+  }
+  pthread_mutex_unlock(&z->lock);
+  return z->held;
+}
+
+zfile_t *
+zfile_open(const char *path, int threads)
+{
+  zfile_t *z;
+  const unsigned char *h;
+
+  if ((z = calloc(1, sizeof(zfile_t))) == NULL) {
+    perror("zfile_open: calloc");
+    exit(1);
+  }
+  if (path == NULL || !strcmp(path, "-")) {
+    z->fd = STDIN_FILENO;
+  } else if ((z->fd = open(path, O_RDONLY)) < 0) {
+    fprintf(stderr, "Unable to open '%s': %s(%d)\n", path, strerror(errno), errno);
+    free(z);
+    return NULL;
+  }
+  z->inSize = ZF_READ_SIZE;
+  if ((z->in = malloc(z->inSize)) == NULL) {
+    perror("zfile_open: malloc");
+    exit(1);
+  }
+  zf_avail(z, BGZF_HDR_SIZE);
+  h = z->in;
+  if (z->inLen < 2 || h[0] != 0x1f || h[1] != 0x8b)
+    return z;
+  z->mode = ZF_GZIP;
+  if (z->inLen >= BGZF_HDR_SIZE && (h[3] & 4) && h[12] == 'B' && h[13] == 'C'
+      && h[14] == 2 && h[15] == 0)
+    z->mode = ZF_BGZF;
+  for (int i = 0; i < ZF_NBUF; i++) {
+    if ((z->ring[i].data = malloc(ZF_BUF_SIZE)) == NULL) {
+      perror("zfile_open: malloc");
+      exit(1);
+    }
+  }
+  pthread_mutex_init(&z->lock, NULL);
+  pthread_cond_init(&z->filled, NULL);
+  pthread_cond_init(&z->freed, NULL);
+  pthread_mutex_init(&z->jobLock, NULL);
+  pthread_cond_init(&z->work, NULL);
+  pthread_cond_init(&z->workDone, NULL);
+  if (z->mode == ZF_BGZF) {
+    if (threads <= 0)
+      threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if (threads > ZF_THREADS_MAX)
+      threads = ZF_THREADS_MAX;
+    z->nbWorkers = threads > 1 ? threads - 1 : 0;
+    if ((z->workers = calloc((size_t)z->nbWorkers + 1, sizeof(pthread_t))) == NULL) {
+      perror("zfile_open: calloc");
+      exit(1);
+    }
+    for (int i = 0; i < z->nbWorkers; i++) {
+      if (pthread_create(&z->workers[i], NULL, bgzf_worker, z) != 0)
+        zf_fatal("zfile_open: pthread_create failed");
+    }
+  }
+  if (pthread_create(&z->producer, NULL,
+                     z->mode == ZF_BGZF ? bgzf_producer : gzip_producer, z) != 0)
+    zf_fatal("zfile_open: pthread_create failed");
+  return z;
+}
+
+char *
+zfile_gets(char *buf, int size, zfile_t *z)
+{
+  size_t n = 0;
+
+  if (size <= 0)
+    return NULL;
+  while (n < (size_t)size - 1) {
+    if (z->curPos == z->curLen && !zf_next(z))
+      break;
+    const unsigned char *p = z->cur + z->curPos;
+    size_t k = z->curLen - z->curPos;
+    if (k > (size_t)size - 1 - n)
+      k = (size_t)size - 1 - n;
+    const unsigned char *nl = memchr(p, '\n', k);
+    if (nl != NULL)
+      k = (size_t)(nl - p) + 1;
+    memcpy(buf + n, p, k);
+    n += k;
+    z->curPos += k;
+    if (nl != NULL)
+      break;
+  }
+  if (n == 0)
+    return NULL;
+  buf[n] = 0;
+  return buf;
+}
+
+int
+zfile_getc(zfile_t *z)
+{
+  if (z->curPos == z->curLen && !zf_next(z))
+    return EOF;
+  return z->cur[z->curPos++];
+}
+
+void
+zfile_close(zfile_t *z)
+{
+  if (z->mode != ZF_PLAIN) {
+    pthread_mutex_lock(&z->lock);
+    z->stop = 1;
+    pthread_cond_signal(&z->freed);
+    pthread_mutex_unlock(&z->lock);
+    pthread_join(z->producer, NULL);
+    pthread_mutex_lock(&z->jobLock);
+    z->quit = 1;
+    pthread_cond_broadcast(&z->work);
+    pthread_mutex_unlock(&z->jobLock);
+    for (int i = 0; i < z->nbWorkers; i++)
+      pthread_join(z->workers[i], NULL);
+    pthread_mutex_destroy(&z->lock);
+    pthread_cond_destroy(&z->filled);
+    pthread_cond_destroy(&z->freed);
+    pthread_mutex_destroy(&z->jobLock);
+    pthread_cond_destroy(&z->work);
+    pthread_cond_destroy(&z->workDone);
+    for (int i = 0; i < ZF_NBUF; i++)
+      free(z->ring[i].data);
+    free(z->workers);
+    free(z->blk);
+  }
+  if (z->fd != STDIN_FILENO)
+    close(z->fd);
+  free(z->in);
+  free(z);
+}
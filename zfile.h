@@ -0,0 +1,60 @@
+/**
+ * License GPLv3+
+ * @file zfile.h
+ * @brief transparent reading of plain, gzip and BGZF compressed text files
+ *
+ * The format of the input is detected from its first bytes:
+ *
+ *   plain text       read as is
+ *   gzip             inflated by a background thread (concatenated members
+ *                    are supported), so that decompression overlaps with the
+ *                    processing of the text
+ *   BGZF             blocked gzip, as written by bgzip; blocks are independent
+ *                    gzip members of at most 64 kb, which are inflated in
+ *                    parallel by a pool of threads
+ *
+ * Decompressed data is handed over to the reader in large buffers, in input
+ * order, so that zfile_gets() behaves like fgets() on the uncompressed text.
+ */
+#ifndef _ZFILE_H
+#define _ZFILE_H
+
+/** Upper bound on the number of BGZF decompression threads */
+#define ZF_THREADS_MAX 16
+
+/**
+ * @struct zfile_t "zfile.h"
+ * @brief compressed or plain input stream (opaque)
+ */
+typedef struct _zfile_t zfile_t;
+
+/**
+ * Function to open a plain, gzip or BGZF compressed file
+ * @param path file name ("-" or NULL for stdin)
+ * @param threads number of BGZF decompression threads
+ *        (0 for one per online processor)
+ * @returns the input stream
+ * @returns NULL on error (a message is printed on stderr)
+ */
+zfile_t * zfile_open(const char *path, int threads);
+
+/**
+ * Function to read a line, with the semantics of fgets()
+ * @returns buf
+ * @returns NULL at end of file
+ */
+char * zfile_gets(char *buf, int size, zfile_t *z);
+
+/**
+ * Function to read a character, with the semantics of fgetc()
+ * @returns the next character
+ * @returns EOF at end of file
+ */
+int zfile_getc(zfile_t *z);
+
+/**
+ * Function to close an input stream (stdin is left open)
+ */
+void zfile_close(zfile_t *z);
+
+#endif